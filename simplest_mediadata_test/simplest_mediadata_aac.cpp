@@ -29,118 +29,772 @@
 #include <stdlib.h>
 #include <string.h>
 
+//Block size of ADTS scanner when the file cannot be mapped
+#define ADTS_BLOCK_SIZE (1<<20)
+#define ADTS_HEADER_SIZE 7
+//frame_length is 13 bit
+#define ADTS_MAX_FRAME 8191
+//Consecutive headers needed to (re)gain sync
+#define ADTS_SYNC_FRAMES 3
+//Bits of the first channel element protected by CRC
+#define ADTS_CRC_ELEMENT_BITS 192
+//Samples per channel of a raw data block
+#define ADTS_FRAME_SAMPLES 1024
+//Sidecar index
+#define ADTSIDX_VERSION 1
+#define ADTSIDX_VBR 0x01
+//Frames per writev() batch
+#define ADTS_IOV_BATCH 256
 
-int getADTSframe(unsigned char* buffer, int buf_size, unsigned char* data ,int* data_size){
-	int size = 0;
+/**
+ * File helpers, see simplest_mediadata_io.cpp
+ */
+extern unsigned char *simplest_map_file(const char *url,long long *size);
+extern void simplest_unmap_file(unsigned char *data,long long size);
+extern int simplest_file_stat(const char *url,long long *size,long long *mtime);
+extern long long simplest_copy_range(FILE *fp_in,long long offset,long long size,FILE *fp_out);
+extern long long simplest_writev(FILE *fp,const void **base,const long long *len,int num);
+
+/**
+ * ADTS frame. data points into the mapped file or into the block buffer
+ * of scanner (valid until the next getADTSframe()).
+ */
+typedef struct
+{
+	long long offset;             //! Offset of the frame in file
+	int size;                     //! frame_length, including header
+	int header_size;              //! 7, or 9 with CRC
+	int protection_absent;
+	int profile;                  //! 0 Main, 1 LC, 2 SSR
+	int sampling_frequency_index;
+	int channel_configuration;
+	int raw_blocks;               //! Raw data blocks in frame
+	int crc;                      //! 1 ok, 0 error, -1 not checked
+	const unsigned char *data;    //! First byte of header
+} ADTS_FRAME;
+
+/**
+ * ADTS scanner. The whole file is mapped if possible, otherwise it is
+ * read in blocks.
+ */
+typedef struct
+{
+	unsigned char *map;           //! Mapped file (mmap mode)
+	long long map_size;
+	FILE *fp;                     //! Input file (block mode)
+	unsigned char *buf;           //! File bytes [buf_offset, buf_offset+buf_len) (block mode)
+	int buf_len;
+	long long buf_offset;
+	long long pos;                //! Offset of the next frame
+	int eof;
+	int synced;
+	int resyncs;                  //! Times sync was lost
+	long long skipped;            //! Bytes outside of frames
+} ADTS_SCANNER;
+
+ADTS_SCANNER adtsscanner;        //!< scanner of the AAC file
+
+static unsigned short adts_crc_table[256];
+
+static void adts_crc_init(){
+	int i=0,j=0;
+	if(adts_crc_table[1]!=0)
+		return;
+	for(i=0;i<256;i++){
+		unsigned c=i<<8;
+		for(j=0;j<8;j++)
+			c=(c&0x8000)?(c<<1)^0x8005:c<<1;
+		adts_crc_table[i]=(unsigned short)c;
+	}
+}
+
+static unsigned adts_crc_update(unsigned crc,const unsigned char *p,int len){
+	int i=0;
+	for(i=0;i<len;i++)
+		crc=((crc<<8)^adts_crc_table[((crc>>8)^p[i])&0xFF])&0xFFFF;
+	return crc;
+}
+
+/**
+ * Check CRC of a frame with one raw data block. CRC covers the header
+ * and the first 192 bits of the first element after its 3 bit id. Only
+ * SCE/LFE are checked: the second region of CPE starts after the first
+ * channel, which is only known by decoding it.
+ * @return  1 ok, 0 error, -1 not checked.
+ */
+static int adts_check_crc(const unsigned char *p,int size){
+	unsigned char region[ADTS_CRC_ELEMENT_BITS/8];
+	const unsigned char *raw=p+9;
+	int raw_size=size-9,id=0,i=0;
+	unsigned crc=0xFFFF;
+
+	//The element must fit in the frame, with 3 bits id before and ID_END after it
+	if(raw_size*8<3+ADTS_CRC_ELEMENT_BITS+3)
+		return -1;
+	id=raw[0]>>5;
+	if(id!=0&&id!=3)
+		return -1;
+	for(i=0;i<ADTS_CRC_ELEMENT_BITS/8;i++)
+		region[i]=(unsigned char)((raw[i]<<3)|(raw[i+1]>>5));
+	adts_crc_init();
+	crc=adts_crc_update(crc,p,ADTS_HEADER_SIZE);
+	crc=adts_crc_update(crc,region,sizeof(region));
+	return crc==(unsigned)((p[7]<<8)|p[8]);
+}
 
-	if(!buffer || !data || !data_size ){
+/**
+ * Parse ADTS header at p (at least 7 bytes).
+ * @return  0 if it is a valid header, -1 if not.
+ */
+static int adts_parse_header(const unsigned char *p,ADTS_FRAME *f){
+	//Sync word, and layer is 0
+	if(p[0]!=0xFF||(p[1]&0xF6)!=0xF0)
+		return -1;
+	f->protection_absent=p[1]&0x01;
+	f->profile=p[2]>>6;
+	f->sampling_frequency_index=(p[2]>>2)&0x0F;
+	f->channel_configuration=((p[2]&0x01)<<2)|(p[3]>>6);
+	f->size=((p[3]&0x03)<<11)|(p[4]<<3)|(p[5]>>5);
+	f->raw_blocks=(p[6]&0x03)+1;
+	f->header_size=f->protection_absent?7:9+(f->raw_blocks>1?2*(f->raw_blocks-1):0);
+	if(f->sampling_frequency_index>12||f->size<f->header_size)
 		return -1;
+	return 0;
+}
+
+/**
+ * Check that the following frames also start with a header of the same
+ * stream, before taking a sync word at p.
+ * @return  1 ok, 0 not a frame, -1 need more data.
+ */
+static int adts_check_sync(const unsigned char *p,const unsigned char *end,int eof){
+	const unsigned char *q=p;
+	ADTS_FRAME f;
+	int i=0;
+
+	for(i=0;i<ADTS_SYNC_FRAMES;i++){
+		if(end-q<ADTS_HEADER_SIZE)
+			return eof?(q<=end):-1;
+		if(adts_parse_header(q,&f)<0||q[1]!=p[1]||q[2]!=p[2]||(q[3]&0xF0)!=(p[3]&0xF0))
+			return 0;
+		q+=f.size;
 	}
+	return 1;
+}
 
-	while(1){
-		if(buf_size  < 7 ){
-			return -1;
+static int adts_scanner_open(ADTS_SCANNER *s,const char *url){
+	memset(s,0,sizeof(ADTS_SCANNER));
+	s->map=simplest_map_file(url,&s->map_size);
+	if(s->map!=NULL)
+		return 0;
+	//Too large to map (32bit), or not a regular file
+	if((s->fp=fopen(url,"rb"))==NULL)
+		return -1;
+	s->buf=(unsigned char *)malloc(ADTS_BLOCK_SIZE);
+	return 0;
+}
+
+static void adts_scanner_close(ADTS_SCANNER *s){
+	simplest_unmap_file(s->map,s->map_size);
+	if(s->fp)
+		fclose(s->fp);
+	free(s->buf);
+	memset(s,0,sizeof(ADTS_SCANNER));
+}
+
+//Read more data, keeping the bytes from pos on (less than a few frames)
+static void adts_scanner_fill(ADTS_SCANNER *s){
+	int keep=(int)(s->buf_offset+s->buf_len-s->pos);
+	int n=0;
+
+	memmove(s->buf,s->buf+(s->pos-s->buf_offset),keep);
+	s->buf_offset=s->pos;
+	s->buf_len=keep;
+	n=(int)fread(s->buf+s->buf_len,1,ADTS_BLOCK_SIZE-s->buf_len,s->fp);
+	s->buf_len+=n;
+	if(n==0||feof(s->fp))
+		s->eof=1;
+}
+
+/**
+ * Get next ADTS frame without copying it. Data between frames is skipped,
+ * and sync is only taken again after several consecutive headers.
+ * @return  1 if a frame is found, 0 at the end of stream.
+ */
+static int adts_scanner_next(ADTS_SCANNER *s,ADTS_FRAME *f){
+	for(;;){
+		const unsigned char *base=s->map?s->map:s->buf;
+		long long base_offset=s->map?0:s->buf_offset;
+		const unsigned char *p=base+(s->pos-base_offset);
+		const unsigned char *end=base+(s->map?s->map_size:s->buf_len);
+		int eof=s->map?1:s->eof,ok=0;
+
+		if(end-p<ADTS_HEADER_SIZE){
+			if(eof){
+				s->skipped+=end-p;
+				s->pos+=end-p;
+				return 0;
+			}
+			adts_scanner_fill(s);
+			continue;
 		}
-		//Sync words
-		if((buffer[0] == 0xff) && ((buffer[1] & 0xf0) == 0xf0) ){
-			size |= ((buffer[3] & 0x03) <<11);     //high 2 bit
-			size |= buffer[4]<<3;                //middle 8 bit
-			size |= ((buffer[5] & 0xe0)>>5);        //low 3bit
-			break;
+		if(adts_parse_header(p,f)==0){
+			ok=s->synced?1:adts_check_sync(p,end,eof);
+			//Lookahead crosses the end of block
+			if(ok<0||(ok>0&&f->size>end-p&&!eof)){
+				adts_scanner_fill(s);
+				continue;
+			}
+			if(ok>0&&f->size<=end-p){
+				f->offset=s->pos;
+				f->data=p;
+				f->crc=(!f->protection_absent&&f->raw_blocks==1)?adts_check_crc(p,f->size):-1;
+				s->pos+=f->size;
+				s->synced=1;
+				return 1;
+			}
+		}
+		//Lost sync: skip to the next 0xFF
+		if(s->synced){
+			s->synced=0;
+			s->resyncs++;
+		}
+		{
+			const unsigned char *q=(const unsigned char *)memchr(p+1,0xFF,end-p-1);
+			if(q==NULL)
+				q=end-1;
+			s->skipped+=q-p;
+			s->pos+=q-p;
 		}
-		--buf_size;
-		++buffer;
-	}
-
-	if(buf_size < size){
-		return 1;
 	}
+}
 
-	memcpy(data, buffer, size);
-	*data_size = size;
-
-	return 0;
+/**
+ * Get next ADTS frame of adtsscanner.
+ * @return  Size of frame, 0 at the end of stream.
+ */
+int getADTSframe(ADTS_FRAME *frame){
+	if(!adts_scanner_next(&adtsscanner,frame))
+		return 0;
+	return frame->size;
 }
 
+/**
+ * Analysis AAC (ADTS) file
+ * @param url    Location of input AAC file.
+ */
 int simplest_aac_parser(char *url)
 {
-	int data_size = 0;
+	ADTS_FRAME frame;
 	int size = 0;
 	int cnt=0;
-	int offset=0;
+	int crc_ok=0,crc_error=0;
 
 	//FILE *myout=fopen("output_log.txt","wb+");
 	FILE *myout=stdout;
 
-	unsigned char *aacframe=(unsigned char *)malloc(1024*5);
-	unsigned char *aacbuffer=(unsigned char *)malloc(1024*1024);
-
-	FILE *ifile = fopen(url, "rb");
-	if(!ifile){
+	if(adts_scanner_open(&adtsscanner,url)<0){
 		printf("Open file error");
 		return -1;
 	}
 
-	printf("-----+- ADTS Frame Table -+------+\n");
-	printf(" NUM | Profile | Frequency| Size |\n");
-	printf("-----+---------+----------+------+\n");
+	printf("-----+- ADTS Frame Table -+------+-----+\n");
+	printf(" NUM | Profile | Frequency| Size | CRC |\n");
+	printf("-----+---------+----------+------+-----+\n");
 
-	while(!feof(ifile)){
-		data_size = fread(aacbuffer+offset, 1, 1024*1024-offset, ifile);
-		unsigned char* input_data = aacbuffer;
+	while((size=getADTSframe(&frame))>0)
+	{
+		char profile_str[10]={0};
+		char frequence_str[10]={0};
+		const char *crc_str=frame.crc>0?"ok":(frame.crc==0?"ERR":"-");
 
-		while(1)
-		{
-			int ret=getADTSframe(input_data, data_size, aacframe, &size);
-			if(ret==-1){
-				break;
-			}else if(ret==1){
-				memcpy(aacbuffer,input_data,data_size);
-				offset=data_size;
-				break;
-			}
+		switch(frame.profile){
+		case 0: sprintf(profile_str,"Main");break;
+		case 1: sprintf(profile_str,"LC");break;
+		case 2: sprintf(profile_str,"SSR");break;
+		default:sprintf(profile_str,"unknown");break;
+		}
+
+		switch(frame.sampling_frequency_index){
+		case 0: sprintf(frequence_str,"96000Hz");break;
+		case 1: sprintf(frequence_str,"88200Hz");break;
+		case 2: sprintf(frequence_str,"64000Hz");break;
+		case 3: sprintf(frequence_str,"48000Hz");break;
+		case 4: sprintf(frequence_str,"44100Hz");break;
+		case 5: sprintf(frequence_str,"32000Hz");break;
+		case 6: sprintf(frequence_str,"24000Hz");break;
+		case 7: sprintf(frequence_str,"22050Hz");break;
+		case 8: sprintf(frequence_str,"16000Hz");break;
+		case 9: sprintf(frequence_str,"12000Hz");break;
+		case 10: sprintf(frequence_str,"11025Hz");break;
+		case 11: sprintf(frequence_str,"8000Hz");break;
+		default:sprintf(frequence_str,"unknown");break;
+		}
 
-			char profile_str[10]={0};
-			char frequence_str[10]={0};
+		crc_ok+=frame.crc>0;
+		crc_error+=frame.crc==0;
+		fprintf(myout,"%5d| %8s|  %8s| %5d| %4s|\n",cnt,profile_str ,frequence_str,size,crc_str);
+		cnt++;
+	}
+	printf("Frames:%d Resync:%d Skipped:%lld bytes CRC ok:%d error:%d\n",cnt,adtsscanner.resyncs,adtsscanner.skipped,crc_ok,crc_error);
 
-			unsigned char profile=aacframe[2]&0xC0;
-			profile=profile>>6;
-			switch(profile){
-			case 0: sprintf(profile_str,"Main");break;
-			case 1: sprintf(profile_str,"LC");break;
-			case 2: sprintf(profile_str,"SSR");break;
-			default:sprintf(profile_str,"unknown");break;
-			}
+	adts_scanner_close(&adtsscanner);
 
-			unsigned char sampling_frequency_index=aacframe[2]&0x3C;
-			sampling_frequency_index=sampling_frequency_index>>2;
-			switch(sampling_frequency_index){
-			case 0: sprintf(frequence_str,"96000Hz");break;
-			case 1: sprintf(frequence_str,"88200Hz");break;
-			case 2: sprintf(frequence_str,"64000Hz");break;
-			case 3: sprintf(frequence_str,"48000Hz");break;
-			case 4: sprintf(frequence_str,"44100Hz");break;
-			case 5: sprintf(frequence_str,"32000Hz");break;
-			case 6: sprintf(frequence_str,"24000Hz");break;
-			case 7: sprintf(frequence_str,"22050Hz");break;
-			case 8: sprintf(frequence_str,"16000Hz");break;
-			case 9: sprintf(frequence_str,"12000Hz");break;
-			case 10: sprintf(frequence_str,"11025Hz");break;
-			case 11: sprintf(frequence_str,"8000Hz");break;
-			default:sprintf(frequence_str,"unknown");break;
-			}
+	return 0;
+}
 
+/**
+ * Sidecar index (<file>.aacidx): ADTSIDX_HEADER followed by one
+ * ADTSIDX_ENTRY per frame. It is valid while size and mtime of the AAC
+ * file stay the same.
+ */
+typedef struct
+{
+	char tag[4];                  //! "AIDX"
+	unsigned version;
+	unsigned entry_size;
+	unsigned num;                 //! Number of frames
+	long long file_size;          //! Size of indexed file
+	long long file_mtime;         //! Modification time of indexed file
+	long long samples;            //! Samples per channel
+	unsigned sample_rate;
+	unsigned channels;
+	unsigned profile;
+	unsigned flags;               //! ADTSIDX_VBR
+} ADTSIDX_HEADER;
 
-			fprintf(myout,"%5d| %8s|  %8s| %5d|\n",cnt,profile_str ,frequence_str,size);
-			data_size -= size;
-			input_data += size;
-			cnt++;
-		}   
+typedef struct
+{
+	long long offset;             //! Offset of frame in file
+	long long sample;             //! First sample of frame
+	unsigned size;                //! frame_length
+	unsigned reserved;
+} ADTSIDX_ENTRY;
+
+static const int adts_sample_rate[13]={96000,88200,64000,48000,44100,32000,24000,22050,16000,12000,11025,8000,7350};
+
+static void adtsidx_close(ADTSIDX_HEADER *h,long long map_size){
+	if(map_size>0)
+		simplest_unmap_file((unsigned char *)h,map_size);
+	else
+		free(h);
+}
+
+/**
+ * Open index of AAC file. A valid sidecar is mapped, otherwise the index
+ * is built in memory, and written to the sidecar if persist is set.
+ * @param map_size  Output, size of mapping, or 0 if the index is in memory.
+ * @param status    Output, "up to date" or "built".
+ * @return          Index (entries follow the header), NULL on error.
+ */
+static ADTSIDX_HEADER *adtsidx_open(const char *url,int persist,long long *map_size,const char **status){
+	char idxpath[1024],tmppath[1040];
+	long long size=0,mtime=0;
+	ADTSIDX_HEADER *h=NULL;
+	ADTS_SCANNER s;
+	ADTS_FRAME f;
+	unsigned cap=0;
+	int vbr=1;
+	FILE *fp_idx=NULL;
+
+	if(strlen(url)+16>sizeof(idxpath)||simplest_file_stat(url,&size,&mtime)<0)
+		return NULL;
+	sprintf(idxpath,"%s.aacidx",url);
+	sprintf(tmppath,"%s.tmp",idxpath);
+
+	h=(ADTSIDX_HEADER *)simplest_map_file(idxpath,map_size);
+	if(h!=NULL){
+		if(*map_size>=(long long)sizeof(ADTSIDX_HEADER)&&memcmp(h->tag,"AIDX",4)==0&&h->version==ADTSIDX_VERSION
+			&&h->entry_size==sizeof(ADTSIDX_ENTRY)&&*map_size==(long long)(sizeof(ADTSIDX_HEADER)+(long long)h->num*sizeof(ADTSIDX_ENTRY))
+			&&h->file_size==size&&h->file_mtime==mtime){
+			*status="up to date";
+			return h;
+		}
+		simplest_unmap_file((unsigned char *)h,*map_size);
+	}
+	*map_size=0;
+	*status="built";
+
+	if(adts_scanner_open(&s,url)<0)
+		return NULL;
+	cap=(unsigned)(size/256)+16;
+	h=(ADTSIDX_HEADER *)calloc(1,sizeof(ADTSIDX_HEADER)+cap*sizeof(ADTSIDX_ENTRY));
+	while(adts_scanner_next(&s,&f)){
+		ADTSIDX_ENTRY *e=NULL;
+		if(h->num==cap){
+			cap*=2;
+			h=(ADTSIDX_HEADER *)realloc(h,sizeof(ADTSIDX_HEADER)+cap*sizeof(ADTSIDX_ENTRY));
+		}
+		if(h->num==0){
+			h->sample_rate=adts_sample_rate[f.sampling_frequency_index];
+			h->channels=f.channel_configuration;
+			h->profile=f.profile;
+		}
+		e=(ADTSIDX_ENTRY *)(h+1)+h->num;
+		e->offset=f.offset;
+		e->sample=h->samples;
+		e->size=f.size;
+		e->reserved=0;
+		h->samples+=ADTS_FRAME_SAMPLES*f.raw_blocks;
+		h->num++;
+		//adts_buffer_fullness 0x7FF signals VBR
+		if((((f.data[5]&0x1F)<<6)|(f.data[6]>>2))!=0x7FF)
+			vbr=0;
+	}
+	adts_scanner_close(&s);
+	memcpy(h->tag,"AIDX",4);
+	h->version=ADTSIDX_VERSION;
+	h->entry_size=sizeof(ADTSIDX_ENTRY);
+	h->file_size=size;
+	h->file_mtime=mtime;
+	h->flags=(vbr&&h->num>0)?ADTSIDX_VBR:0;
+
+	if(persist&&(fp_idx=fopen(tmppath,"wb"))!=NULL){
+		fwrite(h,sizeof(ADTSIDX_HEADER)+h->num*sizeof(ADTSIDX_ENTRY),1,fp_idx);
+		fclose(fp_idx);
+		remove(idxpath);
+		rename(tmppath,idxpath);
+	}
+	return h;
+}
+
+/**
+ * Frame that contains the sample (entries are sorted by sample).
+ */
+static unsigned adtsidx_find_sample(const ADTSIDX_HEADER *h,long long sample){
+	const ADTSIDX_ENTRY *entry=(const ADTSIDX_ENTRY *)(h+1);
+	unsigned lo=0,hi=h->num;
+	while(lo<hi){
+		unsigned mid=lo+(hi-lo)/2;
+		if(entry[mid].sample<=sample)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return lo>0?lo-1:0;
+}
+
+/**
+ * Index ADTS frames of AAC file, and print duration, bitrate and whether
+ * it is VBR.
+ * @param url      Location of input AAC file.
+ * @param persist  Keep the index in <url>.aacidx for later calls.
+ */
+int simplest_aac_index(char *url,int persist){
+	long long map_size=0,bytes=0,window_bytes=0;
+	const char *status=NULL;
+	ADTSIDX_HEADER *h=adtsidx_open(url,persist,&map_size,&status);
+	const ADTSIDX_ENTRY *entry=NULL;
+	double duration=0,avg=0,peak=0,low=0;
+	unsigned i=0,first=0;
+
+	if(h==NULL){
+		printf("Open file error\n");
+		return -1;
+	}
+	entry=(const ADTSIDX_ENTRY *)(h+1);
+	if(h->num==0||h->sample_rate==0){
+		printf("Index:%s No ADTS frame found.\n",status);
+		adtsidx_close(h,map_size);
+		return -1;
+	}
+	duration=(double)h->samples/h->sample_rate;
+	//Bitrate over a sliding window of at most one second of samples
+	//(frames may carry several raw data blocks)
+	for(i=0;i<h->num;i++){
+		long long end=i+1<h->num?entry[i+1].sample:h->samples;
+		bytes+=entry[i].size;
+		window_bytes+=entry[i].size;
+		while(first<i&&end-entry[first].sample>h->sample_rate)
+			window_bytes-=entry[first++].size;
+		if(end-entry[0].sample>=h->sample_rate||i+1==h->num){
+			long long samples=end-entry[first].sample;
+			double kbps=window_bytes*8.0*h->sample_rate/samples/1000.0;
+			if(peak==0||kbps>peak)
+				peak=kbps;
+			if(low==0||kbps<low)
+				low=kbps;
+		}
+	}
+	avg=bytes*8.0/duration/1000.0;
+	printf("Index:%s Frames:%u Sample Rate:%uHz Channels:%u\n",status,h->num,h->sample_rate,h->channels);
+	printf("Duration:%.3fs Bitrate avg %.1fkbps peak %.1fkbps min %.1fkbps\n",duration,avg,peak,low);
+	//Rate control keeps CBR within the bit reservoir over one second
+	printf("VBR:%s Bitrate variation:%.1f%%\n",(h->flags&ADTSIDX_VBR)?"yes (buffer fullness 0x7FF)":((peak-low)>0.1*avg?"yes":"no"),
+		(peak-low)*100/avg);
+	adtsidx_close(h,map_size);
+	return 0;
+}
+
+/**
+ * Extract a time range of AAC file, from the frame that contains the
+ * start time. The index is kept in <url>.aacidx.
+ * @param url        Location of input AAC file.
+ * @param start      Start time in seconds.
+ * @param duration   Duration in seconds.
+ * @param url_out    Location of output AAC file.
+ */
+int simplest_aac_seek(char *url,double start,double duration,const char *url_out){
+	long long map_size=0,offset=0,end=0;
+	const char *status=NULL;
+	ADTSIDX_HEADER *h=adtsidx_open(url,1,&map_size,&status);
+	const ADTSIDX_ENTRY *entry=NULL;
+	unsigned first=0,last=0;
+	int ret=0;
+	FILE *fp=NULL,*fp_out=NULL;
+
+	if(h==NULL){
+		printf("Open file error\n");
+		return -1;
+	}
+	entry=(const ADTSIDX_ENTRY *)(h+1);
+	if(h->num==0||start<0||duration<=0||start*h->sample_rate>=h->samples){
+		printf("Error: Time %.3fs out of range.\n",start);
+		adtsidx_close(h,map_size);
+		return -1;
+	}
+	first=adtsidx_find_sample(h,(long long)(start*h->sample_rate));
+	last=adtsidx_find_sample(h,(long long)((start+duration)*h->sample_rate)-1);
+	offset=entry[first].offset;
+	end=entry[last].offset+entry[last].size;
+	printf("Index:%s Frame:%u-%u Time:%.3fs-%.3fs Offset:%lld Size:%lld\n",status,first,last,
+		(double)entry[first].sample/h->sample_rate,(double)(last+1<h->num?entry[last+1].sample:h->samples)/h->sample_rate,offset,end-offset);
+	adtsidx_close(h,map_size);
 
+	if((fp=fopen(url,"rb"))==NULL||(fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot open file.\n");
+		if(fp)
+			fclose(fp);
+		return -1;
+	}
+	if(simplest_copy_range(fp,offset,end-offset,fp_out)!=end-offset){
+		printf("Error: Cannot write %s.\n",url_out);
+		ret=-1;
 	}
-	fclose(ifile);
-	free(aacbuffer);
-	free(aacframe);
+	fclose(fp);
+	fclose(fp_out);
+	return ret;
+}
 
+/**
+ * Pending scatter-gather write: frame headers and pointers to the
+ * payloads in the mapped file (or block buffer).
+ */
+typedef struct
+{
+	const void *base[2*ADTS_IOV_BATCH];
+	long long len[2*ADTS_IOV_BATCH];
+	unsigned char header[ADTS_IOV_BATCH][ADTS_HEADER_SIZE];
+	int num;
+} ADTS_IOV;
+
+//Write the pending buffers, return -1 on write error
+static int adts_iov_flush(FILE *fp,ADTS_IOV *iov){
+	long long w=0;
+	if(iov->num>0)
+		w=simplest_writev(fp,iov->base,iov->len,iov->num);
+	iov->num=0;
+	return w<0?-1:0;
+}
+
+//Queue a header (copied) and a payload (referenced), return -1 on write error
+static int adts_iov_add(FILE *fp,ADTS_IOV *iov,const unsigned char *header,int header_size,const unsigned char *data,long long len){
+	unsigned char *h=iov->header[iov->num/2];
+	memcpy(h,header,header_size);
+	iov->base[iov->num]=h;
+	iov->len[iov->num]=header_size;
+	iov->base[iov->num+1]=data;
+	iov->len[iov->num+1]=len;
+	iov->num+=2;
+	if(iov->num==2*ADTS_IOV_BATCH)
+		return adts_iov_flush(fp,iov);
+	return 0;
+}
+
+/**
+ * Locate the raw data blocks of a frame. With several blocks, the CRC part
+ * of the header gives the position of each block after the first one
+ * (counted from the first block), and every block ends with its own CRC.
+ * @param start   Output, offset of each block in the frame.
+ * @param end     Output, end of each block in the frame, CRC excluded.
+ * @return  0, or -1 if the blocks cannot be located (no CRC, bad positions).
+ */
+static int adts_raw_blocks(const ADTS_FRAME *f,int *start,int *end){
+	int k=0;
+	start[0]=f->header_size;
+	if(f->raw_blocks==1){
+		end[0]=f->size;
+		return 0;
+	}
+	if(f->protection_absent)
+		return -1;
+	for(k=1;k<f->raw_blocks;k++)
+		start[k]=f->header_size+((f->data[5+2*k]<<8)|f->data[6+2*k]);
+	for(k=0;k<f->raw_blocks;k++){
+		end[k]=(k+1<f->raw_blocks?start[k+1]:f->size)-2;
+		if(end[k]<start[k])
+			return -1;
+	}
 	return 0;
 }
+
+/**
+ * Convert ADTS to raw AAC access units, each prefixed with its length
+ * (2 bytes, big-endian), and write the AudioSpecificConfig of the stream.
+ * Frames with several raw data blocks are split into one access unit per
+ * block, which needs the block positions of the CRC header.
+ * @param url        Location of input AAC (ADTS) file.
+ * @param url_out    Location of output raw AAC file.
+ * @param url_asc    Location of output AudioSpecificConfig.
+ */
+int simplest_aac_adts_to_raw(char *url,const char *url_out,const char *url_asc){
+	ADTS_SCANNER s;
+	ADTS_FRAME f;
+	ADTS_IOV *iov=NULL;
+	FILE *fp_out=NULL,*fp_asc=NULL;
+	unsigned char asc[2];
+	int cnt=0,invalid=0,failed=0;
+	long long bytes=0;
+
+	if(adts_scanner_open(&s,url)<0){
+		printf("Open file error\n");
+		return -1;
+	}
+	if((fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot open output file.\n");
+		adts_scanner_close(&s);
+		return -1;
+	}
+	iov=(ADTS_IOV *)malloc(sizeof(ADTS_IOV));
+	iov->num=0;
+
+	while(adts_scanner_next(&s,&f)){
+		unsigned char prefix[2];
+		int start[4],end[4],k=0;
+		if(cnt==0){
+			//AudioSpecificConfig: audioObjectType (profile+1), sampling frequency index, channels
+			asc[0]=(unsigned char)(((f.profile+1)<<3)|(f.sampling_frequency_index>>1));
+			asc[1]=(unsigned char)(((f.sampling_frequency_index&0x01)<<7)|(f.channel_configuration<<3));
+		}
+		//Each raw data block is one access unit, leaving one out would make a gap
+		if(adts_raw_blocks(&f,start,end)<0){
+			printf("Error: Cannot split %d raw data blocks of frame at %lld%s.\n",f.raw_blocks,f.offset,
+				f.protection_absent?" (no CRC, so no block positions)":"");
+			invalid=1;
+			break;
+		}
+		for(k=0;k<f.raw_blocks&&!failed;k++){
+			int len=end[k]-start[k];
+			prefix[0]=(unsigned char)(len>>8);
+			prefix[1]=(unsigned char)len;
+			if(adts_iov_add(fp_out,iov,prefix,2,f.data+start[k],len)<0)
+				failed=1;
+			bytes+=2+len;
+			cnt++;
+		}
+		//In block mode the payload is only valid until the next frame
+		if(failed||(s.map==NULL&&adts_iov_flush(fp_out,iov)<0)){
+			failed=1;
+			break;
+		}
+	}
+	if(adts_iov_flush(fp_out,iov)<0||failed){
+		printf("Error: Cannot write output file.\n");
+		failed=1;
+	}
+	fclose(fp_out);
+
+	if(cnt>0&&(fp_asc=fopen(url_asc,"wb"))!=NULL){
+		fwrite(asc,1,2,fp_asc);
+		fclose(fp_asc);
+	}
+	printf("Frames:%d Output:%lld bytes AudioSpecificConfig:%02X %02X\n",cnt,bytes,cnt>0?asc[0]:0,cnt>0?asc[1]:0);
+
+	free(iov);
+	adts_scanner_close(&s);
+	return cnt>0&&!failed&&!invalid?0:-1;
+}
+
+/**
+ * Convert raw AAC access units (2 byte length prefix, as written by
+ * simplest_aac_adts_to_raw()) to ADTS.
+ * @param url        Location of input raw AAC file.
+ * @param url_asc    Location of AudioSpecificConfig.
+ * @param url_out    Location of output AAC (ADTS) file.
+ */
+int simplest_aac_raw_to_adts(char *url,const char *url_asc,const char *url_out){
+	unsigned char header[ADTS_HEADER_SIZE];
+	unsigned char asc[2];
+	unsigned char *map=NULL;
+	long long map_size=0,pos=0;
+	int aot=0,sfi=0,channels=0,cnt=0,failed=0,ret=0;
+	ADTS_IOV *iov=NULL;
+	FILE *fp_asc=NULL,*fp_out=NULL;
+
+	if((fp_asc=fopen(url_asc,"rb"))==NULL||fread(asc,1,2,fp_asc)!=2){
+		printf("Error: Cannot read AudioSpecificConfig.\n");
+		if(fp_asc)
+			fclose(fp_asc);
+		return -1;
+	}
+	fclose(fp_asc);
+	aot=asc[0]>>3;
+	sfi=((asc[0]&0x07)<<1)|(asc[1]>>7);
+	channels=(asc[1]>>3)&0x0F;
+	//ADTS profile has 2 bits: Main, LC, SSR, LTP
+	if(aot<1||aot>4||sfi>12||channels>7){
+		printf("Error: AudioSpecificConfig not supported by ADTS (object type %d).\n",aot);
+		return -1;
+	}
+	if((map=simplest_map_file(url,&map_size))==NULL){
+		printf("Open file error\n");
+		return -1;
+	}
+	if((fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot open output file.\n");
+		simplest_unmap_file(map,map_size);
+		return -1;
+	}
+
+	//Header template: MPEG-4, no CRC, buffer fullness 0x7FF (VBR), one raw data block
+	header[0]=0xFF;
+	header[1]=0xF1;
+	header[2]=(unsigned char)(((aot-1)<<6)|(sfi<<2)|(channels>>2));
+	header[3]=(unsigned char)((channels&0x03)<<6);
+	header[4]=0;
+	header[5]=0x1F;
+	header[6]=0xFC;
+	iov=(ADTS_IOV *)malloc(sizeof(ADTS_IOV));
+	iov->num=0;
+
+	while(pos+2<=map_size){
+		int len=(map[pos]<<8)|map[pos+1];
+		int size=len+ADTS_HEADER_SIZE;
+		pos+=2;
+		if(len>map_size-pos||size>ADTS_MAX_FRAME){
+			printf("Error: Access unit at %lld %s.\n",pos-2,size>ADTS_MAX_FRAME?"too large":"truncated");
+			ret=-1;
+			break;
+		}
+		//Only frame_length changes
+		header[3]=(unsigned char)((header[3]&0xFC)|(size>>11));
+		header[4]=(unsigned char)(size>>3);
+		header[5]=(unsigned char)(((size&0x07)<<5)|(header[5]&0x1F));
+		if(adts_iov_add(fp_out,iov,header,ADTS_HEADER_SIZE,map+pos,len)<0){
+			failed=1;
+			break;
+		}
+		pos+=len;
+		cnt++;
+	}
+	if(adts_iov_flush(fp_out,iov)<0||failed){
+		printf("Error: Cannot write output file.\n");
+		ret=-1;
+	}
+	printf("Frames:%d\n",cnt);
+
+	free(iov);
+	fclose(fp_out);
+	simplest_unmap_file(map,map_size);
+	return ret;
+}
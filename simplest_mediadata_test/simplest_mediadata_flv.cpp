@@ -29,39 +29,462 @@
 #include <stdlib.h>
 #include <string.h>
 
-//Important!
-#pragma pack(1)
-
 
 #define TAG_TYPE_SCRIPT 18
 #define TAG_TYPE_AUDIO  8
 #define TAG_TYPE_VIDEO  9
 
+#define FLV_HEADER_SIZE 9
+#define FLV_TAG_HEADER_SIZE 11
+//Block size of FLV reader when the file cannot be mapped
+#define FLV_BLOCK_SIZE (4<<20)
+//AMF0 types
+#define AMF_NUMBER       0x00
+#define AMF_BOOLEAN      0x01
+#define AMF_STRING       0x02
+#define AMF_OBJECT       0x03
+#define AMF_NULL         0x05
+#define AMF_UNDEFINED    0x06
+#define AMF_REFERENCE    0x07
+#define AMF_ECMA_ARRAY   0x08
+#define AMF_OBJECT_END   0x09
+#define AMF_STRICT_ARRAY 0x0A
+#define AMF_DATE         0x0B
+#define AMF_LONG_STRING  0x0C
+//Nesting limit of AMF0 values
+#define AMF_MAX_DEPTH 32
+//Array members printed by amf_print()
+#define AMF_PRINT_VALUES 8
+#define FLVIDX_VERSION 1
+//NALUs per writev() batch
+#define FLV_IOV_BATCH 256
+
 typedef unsigned char byte;
 typedef unsigned int uint;
 
-typedef struct {
-	byte Signature[3];
-	byte Version;
-	byte Flags;
-	uint DataOffset;
-} FLV_HEADER;
+/**
+ * File helpers, see simplest_mediadata_io.cpp
+ */
+extern unsigned char *simplest_map_file(const char *url,long long *size);
+extern void simplest_unmap_file(unsigned char *data,long long size);
+extern long long simplest_copy_range(FILE *fp_in,long long offset,long long size,FILE *fp_out);
+extern int simplest_file_stat(const char *url,long long *size,long long *mtime);
+extern int simplest_fseek64(FILE *fp,long long offset,int whence);
+extern long long simplest_ftell64(FILE *fp);
+extern long long simplest_writev(FILE *fp,const void **base,const long long *len,int num);
+
+/**
+ * G.711 decoder and WAVE writer, see simplest_mediadata_raw.cpp
+ */
+extern void simplest_g711_decode(const unsigned char *in,short *out,int num,int ulaw);
+extern int simplest_pcm_to_wave(const char *pcmpath,const char *fmt,int channels,int sample_rate,const char *wavepath);
+
+//Big-endian integers of FLV
+static uint flv_be16(const byte *p){
+	return (p[0]<<8)|p[1];
+}
+
+static uint flv_be24(const byte *p){
+	return (p[0]<<16)|(p[1]<<8)|p[2];
+}
+
+static uint flv_be32(const byte *p){
+	return ((uint)p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+}
+
+static void flv_put_be24(byte *p,uint v){
+	p[0]=(byte)(v>>16);
+	p[1]=(byte)(v>>8);
+	p[2]=(byte)v;
+}
+
+static void flv_put_be32(byte *p,uint v){
+	p[0]=(byte)(v>>24);
+	p[1]=(byte)(v>>16);
+	p[2]=(byte)(v>>8);
+	p[3]=(byte)v;
+}
+
+/**
+ * FLV tag. header points into the mapped file or into the block buffer
+ * of reader (valid until the next flv_reader_next()). Tag header, data
+ * and PreviousTagSize are contiguous.
+ */
+typedef struct
+{
+	long long offset;             //! Offset of the tag header in file
+	int type;
+	int data_size;
+	uint timestamp;               //! Including TimestampExtended
+	int tail_size;                //! 4 if PreviousTagSize follows, 0 at the end of a cut file
+	const byte *header;
+	const byte *data;
+} FLV_TAG;
+
+/**
+ * FLV reader. The whole file is mapped if possible, otherwise it is read
+ * in large blocks that always hold a whole tag.
+ */
+typedef struct
+{
+	unsigned char *map;           //! Mapped file (mmap mode)
+	long long map_size;
+	FILE *fp;                     //! Input file (block mode)
+	byte *buf;                    //! File bytes [buf_offset, buf_offset+buf_len) (block mode)
+	int buf_size;
+	int buf_len;
+	long long buf_offset;
+	long long pos;                //! Offset of the next tag
+	int eof;
+} FLV_READER;
+
+static int flv_reader_open(FLV_READER *r,const char *url){
+	memset(r,0,sizeof(FLV_READER));
+	r->map=simplest_map_file(url,&r->map_size);
+	if(r->map!=NULL)
+		return 0;
+	//Too large to map (32bit), or not a regular file
+	if((r->fp=fopen(url,"rb"))==NULL)
+		return -1;
+	r->buf_size=FLV_BLOCK_SIZE;
+	r->buf=(byte *)malloc(r->buf_size);
+	return 0;
+}
+
+static void flv_reader_close(FLV_READER *r){
+	simplest_unmap_file(r->map,r->map_size);
+	if(r->fp)
+		fclose(r->fp);
+	free(r->buf);
+	memset(r,0,sizeof(FLV_READER));
+}
+
+/**
+ * Make bytes [pos, pos+need) available.
+ * @return  Pointer to byte pos, or NULL if the file ends before.
+ */
+static const byte *flv_reader_ensure(FLV_READER *r,int need){
+	if(r->map)
+		return r->pos+need<=r->map_size?r->map+r->pos:NULL;
+	if(r->pos+need>r->buf_offset+r->buf_len){
+		int keep=(int)(r->buf_offset+r->buf_len-r->pos);
+		memmove(r->buf,r->buf+(r->pos-r->buf_offset),keep);
+		r->buf_offset=r->pos;
+		r->buf_len=keep;
+		if(need>r->buf_size){
+			r->buf_size=need+FLV_BLOCK_SIZE;
+			r->buf=(byte *)realloc(r->buf,r->buf_size);
+		}
+		while(r->buf_len<need&&!r->eof){
+			int n=(int)fread(r->buf+r->buf_len,1,r->buf_size-r->buf_len,r->fp);
+			r->buf_len+=n;
+			if(n==0)
+				r->eof=1;
+		}
+		if(r->buf_len<need)
+			return NULL;
+	}
+	return r->buf+(r->pos-r->buf_offset);
+}
+
+/**
+ * Read FLV header and skip to the first tag.
+ * @return  Pointer to the 9 byte header (valid until the next read), NULL if it is not FLV.
+ */
+static const byte *flv_reader_header(FLV_READER *r,byte *header){
+	const byte *p=flv_reader_ensure(r,FLV_HEADER_SIZE);
+	if(p==NULL||p[0]!='F'||p[1]!='L'||p[2]!='V')
+		return NULL;
+	memcpy(header,p,FLV_HEADER_SIZE);
+	//DataOffset, then PreviousTagSize0
+	r->pos=flv_be32(header+5)+4;
+	return header;
+}
+
+/**
+ * Get next tag without copying it.
+ * @return  1 if a tag is found, 0 at the end of file.
+ */
+static int flv_reader_next(FLV_READER *r,FLV_TAG *t){
+	const byte *p=flv_reader_ensure(r,FLV_TAG_HEADER_SIZE);
+	int size=0;
+
+	if(p==NULL)
+		return 0;
+	size=FLV_TAG_HEADER_SIZE+flv_be24(p+1);
+	t->tail_size=4;
+	if((p=flv_reader_ensure(r,size+4))==NULL){
+		t->tail_size=0;
+		if((p=flv_reader_ensure(r,size))==NULL)
+			return 0;
+	}
+	t->offset=r->pos;
+	t->type=p[0]&0x1F;
+	t->data_size=size-FLV_TAG_HEADER_SIZE;
+	t->timestamp=flv_be24(p+4)|((uint)p[7]<<24);
+	t->header=p;
+	t->data=p+FLV_TAG_HEADER_SIZE;
+	r->pos+=size+t->tail_size;
+	return 1;
+}
+
+/**
+ * AMF0 value. Strings point into the script data, and members of
+ * objects and arrays are only decoded when they are visited, so decoding
+ * needs no memory besides the script data itself.
+ */
+typedef struct
+{
+	int type;
+	double number;                //! Number, boolean, date (ms)
+	const byte *str;              //! String or key (not terminated)
+	uint len;                     //! Length of string, or count of ECMA/strict array
+	const byte *members;          //! First member of object/array
+	const byte *end;              //! End of script data
+} AMF_VALUE;
 
-typedef struct {
-	byte TagType;
-	byte DataSize[3];
-	byte Timestamp[3];
-	uint Reserved;
-} TAG_HEADER;
+/**
+ * Iterator over members of object, ECMA array or strict array.
+ */
+typedef struct
+{
+	const byte *p;
+	const byte *end;
+	int keyed;                    //! Object or ECMA array
+	uint left;                    //! Values left in strict array
+	int depth;
+} AMF_ITER;
+
+static double amf_be_double(const byte *p){
+	unsigned long long u=((unsigned long long)flv_be32(p)<<32)|flv_be32(p+4);
+	double v=0;
+	memcpy(&v,&u,sizeof(v));
+	return v;
+}
 
+static const byte *amf_decode(const byte *p,const byte *end,AMF_VALUE *v,int depth);
 
-//reverse_bytes - turn a BigEndian byte array into a LittleEndian integer
-uint reverse_bytes(byte *p, char c) {
-	int r = 0;
-	int i;
-	for (i=0; i<c; i++) 
-		r |= ( *(p+i) << (((c-1)*8)-8*i));
-	return r;
+static void amf_iter_init(AMF_ITER *it,const AMF_VALUE *v,int depth){
+	it->p=v->members;
+	it->end=v->end;
+	it->keyed=v->type==AMF_OBJECT||v->type==AMF_ECMA_ARRAY;
+	it->left=v->type==AMF_STRICT_ARRAY?v->len:0;
+	it->depth=depth;
+}
+
+/**
+ * Decode next member. key is only set for objects and ECMA arrays.
+ * @return  1 if a member is decoded, 0 at the end, -1 on error.
+ */
+static int amf_iter_next(AMF_ITER *it,AMF_VALUE *key,AMF_VALUE *v){
+	const byte *p=it->p;
+	if(p==NULL)
+		return -1;
+	if(it->keyed){
+		uint len=0;
+		if(it->end-p<2)
+			return -1;
+		len=flv_be16(p);
+		//Empty key and object end marker
+		if(len==0&&it->end-p>=3&&p[2]==AMF_OBJECT_END){
+			it->p=p+3;
+			return 0;
+		}
+		if((uint)(it->end-p-2)<len)
+			return -1;
+		if(key){
+			key->type=AMF_STRING;
+			key->str=p+2;
+			key->len=len;
+		}
+		p+=2+len;
+	}else{
+		if(it->left==0)
+			return 0;
+		it->left--;
+	}
+	it->p=amf_decode(p,it->end,v,it->depth+1);
+	return it->p?1:-1;
+}
+
+/**
+ * Decode one AMF0 value. Members of objects and arrays are only walked
+ * over to find the end of the value.
+ * @return  Pointer after the value, NULL on error.
+ */
+static const byte *amf_decode(const byte *p,const byte *end,AMF_VALUE *v,int depth){
+	AMF_ITER it;
+	AMF_VALUE member;
+	int ret=0;
+
+	memset(v,0,sizeof(AMF_VALUE));
+	if(p>=end||depth>AMF_MAX_DEPTH)
+		return NULL;
+	v->type=*p++;
+	v->end=end;
+	switch(v->type){
+	case AMF_NUMBER:
+		if(end-p<8)
+			return NULL;
+		v->number=amf_be_double(p);
+		return p+8;
+	case AMF_BOOLEAN:
+		if(end-p<1)
+			return NULL;
+		v->number=p[0]!=0;
+		return p+1;
+	case AMF_STRING:
+	case AMF_LONG_STRING:{
+		int n=v->type==AMF_STRING?2:4;
+		if(end-p<n)
+			return NULL;
+		v->len=n==2?flv_be16(p):flv_be32(p);
+		if((unsigned long long)(end-p-n)<v->len)
+			return NULL;
+		v->str=p+n;
+		return p+n+v->len;
+	}
+	case AMF_NULL:
+	case AMF_UNDEFINED:
+		return p;
+	case AMF_REFERENCE:
+		if(end-p<2)
+			return NULL;
+		v->number=flv_be16(p);
+		return p+2;
+	case AMF_DATE:
+		//Milliseconds since 1970, then time zone (unused)
+		if(end-p<10)
+			return NULL;
+		v->number=amf_be_double(p);
+		return p+10;
+	case AMF_ECMA_ARRAY:
+	case AMF_STRICT_ARRAY:
+		if(end-p<4)
+			return NULL;
+		v->len=flv_be32(p);
+		p+=4;
+		//fall through
+	case AMF_OBJECT:
+		v->members=p;
+		amf_iter_init(&it,v,depth);
+		while((ret=amf_iter_next(&it,NULL,&member))>0)
+			;
+		return ret<0?NULL:it.p;
+	}
+	return NULL;
+}
+
+static int amf_key_is(const AMF_VALUE *key,const char *s){
+	return key->len==strlen(s)&&memcmp(key->str,s,key->len)==0;
+}
+
+/**
+ * Find member of object or ECMA array by name.
+ * @return  0 if found, -1 if not.
+ */
+static int amf_get(const AMF_VALUE *obj,const char *name,AMF_VALUE *v){
+	AMF_ITER it;
+	AMF_VALUE key;
+	if(obj->type!=AMF_OBJECT&&obj->type!=AMF_ECMA_ARRAY)
+		return -1;
+	amf_iter_init(&it,obj,0);
+	while(amf_iter_next(&it,&key,v)>0){
+		if(amf_key_is(&key,name))
+			return 0;
+	}
+	return -1;
+}
+
+//Print value, at most AMF_PRINT_VALUES members of each array
+static void amf_print(FILE *out,const AMF_VALUE *v,int indent){
+	AMF_ITER it;
+	AMF_VALUE key,member;
+	uint i=0;
+
+	switch(v->type){
+	case AMF_NUMBER:fprintf(out,"%.15g",v->number);break;
+	case AMF_BOOLEAN:fprintf(out,"%s",v->number?"true":"false");break;
+	case AMF_STRING:
+	case AMF_LONG_STRING:fprintf(out,"\"%.*s\"",(int)v->len,(const char *)v->str);break;
+	case AMF_NULL:fprintf(out,"null");break;
+	case AMF_UNDEFINED:fprintf(out,"undefined");break;
+	case AMF_REFERENCE:fprintf(out,"reference %d",(int)v->number);break;
+	case AMF_DATE:fprintf(out,"date %.0fms",v->number);break;
+	case AMF_STRICT_ARRAY:
+		fprintf(out,"[");
+		amf_iter_init(&it,v,0);
+		for(i=0;amf_iter_next(&it,NULL,&member)>0;i++){
+			if(i==AMF_PRINT_VALUES){
+				fprintf(out,", ... (%u values)",v->len);
+				break;
+			}
+			fprintf(out,i?", ":"");
+			amf_print(out,&member,indent+1);
+		}
+		fprintf(out,"]");
+		break;
+	case AMF_OBJECT:
+	case AMF_ECMA_ARRAY:
+		fprintf(out,"{\n");
+		amf_iter_init(&it,v,0);
+		while(amf_iter_next(&it,&key,&member)>0){
+			fprintf(out,"%*s%.*s: ",2*(indent+1),"",(int)key.len,(const char *)key.str);
+			amf_print(out,&member,indent+1);
+			fprintf(out,"\n");
+		}
+		fprintf(out,"%*s}",2*indent,"");
+		break;
+	default:fprintf(out,"type %d",v->type);break;
+	}
+}
+
+/**
+ * Fields of onMetaData.
+ */
+typedef struct
+{
+	AMF_VALUE value;              //! Object or ECMA array
+	double duration;
+	double width;
+	double height;
+	double framerate;
+	double videocodecid;
+	double audiocodecid;
+	int keyframes;                //! Number of entries of keyframes.filepositions, -1 if absent
+} FLV_METADATA;
+
+static double amf_get_number(const AMF_VALUE *obj,const char *name){
+	AMF_VALUE v;
+	if(amf_get(obj,name,&v)<0||(v.type!=AMF_NUMBER&&v.type!=AMF_BOOLEAN))
+		return -1;
+	return v.number;
+}
+
+/**
+ * Decode script data tag as onMetaData.
+ * @return  0 on success, -1 if it is not onMetaData.
+ */
+static int flv_parse_metadata(const byte *data,int size,FLV_METADATA *m){
+	AMF_VALUE name,keyframes,positions;
+	const byte *end=data+size;
+	const byte *p=amf_decode(data,end,&name,0);
+
+	if(p==NULL||name.type!=AMF_STRING||!amf_key_is(&name,"onMetaData"))
+		return -1;
+	if(amf_decode(p,end,&m->value,0)==NULL||(m->value.type!=AMF_OBJECT&&m->value.type!=AMF_ECMA_ARRAY))
+		return -1;
+	m->duration=amf_get_number(&m->value,"duration");
+	m->width=amf_get_number(&m->value,"width");
+	m->height=amf_get_number(&m->value,"height");
+	m->framerate=amf_get_number(&m->value,"framerate");
+	m->videocodecid=amf_get_number(&m->value,"videocodecid");
+	m->audiocodecid=amf_get_number(&m->value,"audiocodecid");
+	m->keyframes=-1;
+	if(amf_get(&m->value,"keyframes",&keyframes)==0&&amf_get(&keyframes,"filepositions",&positions)==0
+		&&positions.type==AMF_STRICT_ARRAY)
+		m->keyframes=(int)positions.len;
+	return 0;
 }
 
 /**
@@ -75,48 +498,46 @@ int simplest_flv_parser(char *url){
 	int output_a=1;
 	int output_v=1;
 	//-------------
-	FILE *ifh=NULL,*vfh=NULL, *afh = NULL;
+	FLV_READER reader;
+	FLV_TAG tag;
+	FILE *vfh=NULL, *afh = NULL, *pfh = NULL;
+	//G.711 audio is decoded to PCM
+	short *pcm_buf=NULL;
+	int g711_size=0,g711_channels=0;
 
 	//FILE *myout=fopen("output_log.txt","wb+");
 	FILE *myout=stdout;
 
-	FLV_HEADER flv;
-	TAG_HEADER tagheader;
-	uint previoustagsize, previoustagsize_z=0;
-	uint ts=0, ts_new=0;
+	byte flv[FLV_HEADER_SIZE];
+	byte previoustagsize_z[4]={0};
 
-	ifh = fopen(url, "rb+");
-	if ( ifh== NULL) {
+	if (flv_reader_open(&reader,url)<0) {
 		printf("Failed to open files!");
 		return -1;
 	}
 
 	//FLV file header
-	fread((char *)&flv,1,sizeof(FLV_HEADER),ifh);
+	if (flv_reader_header(&reader,flv)==NULL) {
+		printf("Not a FLV file!");
+		flv_reader_close(&reader);
+		return -1;
+	}
 
 	fprintf(myout,"============== FLV Header ==============\n");
-	fprintf(myout,"Signature:  0x %c %c %c\n",flv.Signature[0],flv.Signature[1],flv.Signature[2]);
-	fprintf(myout,"Version:    0x %X\n",flv.Version);
-	fprintf(myout,"Flags  :    0x %X\n",flv.Flags);
-	fprintf(myout,"HeaderSize: 0x %X\n",reverse_bytes((byte *)&flv.DataOffset, sizeof(flv.DataOffset)));
+	fprintf(myout,"Signature:  0x %c %c %c\n",flv[0],flv[1],flv[2]);
+	fprintf(myout,"Version:    0x %X\n",flv[3]);
+	fprintf(myout,"Flags  :    0x %X\n",flv[4]);
+	fprintf(myout,"HeaderSize: 0x %X\n",flv_be32(flv+5));
 	fprintf(myout,"========================================\n");
 
-	//move the file pointer to the end of the header
-	fseek(ifh, reverse_bytes((byte *)&flv.DataOffset, sizeof(flv.DataOffset)), SEEK_SET);
-
 	//process each tag
-	do {
-
-		previoustagsize = _getw(ifh);
-
-		fread((void *)&tagheader,sizeof(TAG_HEADER),1,ifh);
+	while (flv_reader_next(&reader,&tag)) {
 
-		//int temp_datasize1=reverse_bytes((byte *)&tagheader.DataSize, sizeof(tagheader.DataSize));
-		int tagheader_datasize=tagheader.DataSize[0]*65536+tagheader.DataSize[1]*256+tagheader.DataSize[2];
-		int tagheader_timestamp=tagheader.Timestamp[0]*65536+tagheader.Timestamp[1]*256+tagheader.Timestamp[2];
+		int tagheader_datasize=tag.data_size;
+		int tagheader_timestamp=flv_be24(tag.header+4);
 
 		char tagtype_str[10];
-		switch(tagheader.TagType){
+		switch(tag.type){
 		case TAG_TYPE_AUDIO:sprintf(tagtype_str,"AUDIO");break;
 		case TAG_TYPE_VIDEO:sprintf(tagtype_str,"VIDEO");break;
 		case TAG_TYPE_SCRIPT:sprintf(tagtype_str,"SCRIPT");break;
@@ -124,21 +545,23 @@ int simplest_flv_parser(char *url){
 		}
 		fprintf(myout,"[%6s] %6d %6d |",tagtype_str,tagheader_datasize,tagheader_timestamp);
 
-		//if we are not past the end of file, process the tag
-		if (feof(ifh)) {
-			break;
+		//Tags without data have nothing more to show
+		if (tag.data_size==0) {
+			fprintf(myout,"\n");
+			continue;
 		}
 
 		//process tag by type
-		switch (tagheader.TagType) {
+		switch (tag.type) {
 
 		case TAG_TYPE_AUDIO:{ 
 			char audiotag_str[100]={0};
 			strcat(audiotag_str,"| ");
-			char tagdata_first_byte;
-			tagdata_first_byte=fgetc(ifh);
+			byte tagdata_first_byte;
+			tagdata_first_byte=tag.data[0];
 			int x=tagdata_first_byte&0xF0;
 			x=x>>4;
+			int sound_format=x;
 			switch (x)
 			{
 			case 0:strcat(audiotag_str,"Linear PCM, platform endian");break;
@@ -188,28 +611,34 @@ int simplest_flv_parser(char *url){
 			fprintf(myout,"%s",audiotag_str);
 
 			//if the output file hasn't been opened, open it.
-			if(output_a!=0&&afh == NULL){
+			if(output_a!=0&&afh == NULL&&sound_format!=7&&sound_format!=8){
 				afh = fopen("output.mp3", "wb");
 			}
 
 			//TagData - First Byte Data
-			int data_size=reverse_bytes((byte *)&tagheader.DataSize, sizeof(tagheader.DataSize))-1;
-			if(output_a!=0){
+			int data_size=tag.data_size-1;
+			if(output_a!=0&&(sound_format==7||sound_format==8)){
+				//G.711: decode the whole tag data at once to 16LE PCM
+				if(pfh==NULL)
+					pfh=fopen("output_g711.pcm","wb");
+				if(data_size>g711_size){
+					pcm_buf=(short *)realloc(pcm_buf,data_size*sizeof(short));
+					g711_size=data_size;
+				}
+				simplest_g711_decode(tag.data+1,pcm_buf,data_size,sound_format==8);
+				fwrite(pcm_buf,sizeof(short),data_size,pfh);
+				g711_channels=(tagdata_first_byte&0x01)+1;
+			}else if(output_a!=0){
 				//TagData+1
-				for (int i=0; i<data_size; i++)
-					fputc(fgetc(ifh),afh);
-
-			}else{
-				for (int i=0; i<data_size; i++)
-					fgetc(ifh);
+				fwrite(tag.data+1,1,data_size,afh);
 			}
 			break;
 		}
 		case TAG_TYPE_VIDEO:{
 			char videotag_str[100]={0};
 			strcat(videotag_str,"| ");
-			char tagdata_first_byte;
-			tagdata_first_byte=fgetc(ifh);
+			byte tagdata_first_byte;
+			tagdata_first_byte=tag.data[0];
 			int x=tagdata_first_byte&0xF0;
 			x=x>>4;
 			switch (x)
@@ -236,54 +665,651 @@ int simplest_flv_parser(char *url){
 			}
 			fprintf(myout,"%s",videotag_str);
 
-			fseek(ifh, -1, SEEK_CUR);
 			//if the output file hasn't been opened, open it.
 			if (vfh == NULL&&output_v!=0) {
 				//write the flv header (reuse the original file's hdr) and first previoustagsize
 					vfh = fopen("output.flv", "wb");
-					fwrite((char *)&flv,1, sizeof(flv),vfh);
-					fwrite((char *)&previoustagsize_z,1,sizeof(previoustagsize_z),vfh);
+					fwrite(flv,1,FLV_HEADER_SIZE,vfh);
+					fwrite(previoustagsize_z,1,sizeof(previoustagsize_z),vfh);
 			}
+			if(output_v!=0){
+				const byte *header=tag.header;
 #if 0
-			//Change Timestamp
-			//Get Timestamp
-			ts = reverse_bytes((byte *)&tagheader.Timestamp, sizeof(tagheader.Timestamp));
-			ts=ts*2;
-			//Writeback Timestamp
-			ts_new = reverse_bytes((byte *)&ts, sizeof(ts));
-			memcpy(&tagheader.Timestamp, ((char *)&ts_new) + 1, sizeof(tagheader.Timestamp));
+				//Change Timestamp, in a copy of the tag header (the file may be mapped read-only)
+				byte header_ts[FLV_TAG_HEADER_SIZE];
+				uint ts=0;
+				memcpy(header_ts,tag.header,FLV_TAG_HEADER_SIZE);
+				ts=flv_be24(header_ts+4);
+				ts=ts*2;
+				flv_put_be24(header_ts+4,ts);
+				header=header_ts;
 #endif
-
-
-			//TagData + Previous Tag Size
-			int data_size=reverse_bytes((byte *)&tagheader.DataSize, sizeof(tagheader.DataSize))+4;
-			if(output_v!=0){
-				//TagHeader
-				fwrite((char *)&tagheader,1, sizeof(tagheader),vfh);
-				//TagData
-				for (int i=0; i<data_size; i++)
-					fputc(fgetc(ifh),vfh);
-			}else{
-				for (int i=0; i<data_size; i++)
-					fgetc(ifh);
+				//TagHeader + TagData + Previous Tag Size
+				fwrite(header,1,FLV_TAG_HEADER_SIZE,vfh);
+				fwrite(tag.data,1,tag.data_size+tag.tail_size,vfh);
+			}
+			break;
+			}
+		case TAG_TYPE_SCRIPT:{
+			FLV_METADATA m;
+			if(flv_parse_metadata(tag.data,tag.data_size,&m)==0){
+				fprintf(myout,"| onMetaData duration:%.3f %.0fx%.0f fps:%.3f keyframes:%d",m.duration,m.width,m.height,
+					m.framerate,m.keyframes);
 			}
-			//rewind 4 bytes, because we need to read the previoustagsize again for the loop's sake
-			fseek(ifh, -4, SEEK_CUR);
-
 			break;
 			}
 		default:
-
 			//skip the data of this tag
-			fseek(ifh, reverse_bytes((byte *)&tagheader.DataSize, sizeof(tagheader.DataSize)), SEEK_CUR);
+			break;
 		}
 
 		fprintf(myout,"\n");
 
-	} while (!feof(ifh));
+	}
 
+	flv_reader_close(&reader);
+	if(vfh)
+		fclose(vfh);
+	if(afh)
+		fclose(afh);
+	if(pfh)
+		fclose(pfh);
 
-	_fcloseall();
+	//G.711 in FLV is always 8kHz
+	if(g711_channels>0)
+		simplest_pcm_to_wave("output_g711.pcm","s16le",g711_channels,8000,"output_g711.wav");
+	free(pcm_buf);
 
 	return 0;
 }
+
+/**
+ * Keyframes and tag ranges collected by flv_collect_keyframes().
+ * Keyframe positions are relative to the first copied tag.
+ */
+typedef struct
+{
+	long long *kf_pos;
+	uint *kf_time;
+	int num_kf;
+	int size_kf;
+	long long *range;             //! [start, end) pairs of tags to copy
+	int num_range;
+	int size_range;
+	long long copy_bytes;         //! Sum of ranges
+	int script_tags;              //! Dropped script data tags
+	uint last_ts;
+	uint last_kf_ts;
+	int video_codec;              //! -1 if there is no video
+	int audio_codec;              //! -1 if there is no audio
+	int audio_flags;              //! Rate, size and type bits of the first audio tag
+	long long video_bytes;
+	long long audio_bytes;
+	int last_is_kf;
+	byte *old_meta;               //! Script data of the first onMetaData, NULL if none
+	int old_meta_size;
+} FLV_KEYFRAMES;
+
+static void flv_keyframes_free(FLV_KEYFRAMES *k){
+	free(k->kf_pos);
+	free(k->kf_time);
+	free(k->range);
+	free(k->old_meta);
+	memset(k,0,sizeof(FLV_KEYFRAMES));
+}
+
+/**
+ * Walk the tags once and collect keyframes. Old script data tags are
+ * dropped (the first onMetaData is kept aside, to merge its properties),
+ * the other tags are kept as ranges of the input file.
+ * @return  0 on success, -1 if it is not FLV.
+ */
+static int flv_collect_keyframes(FLV_READER *r,byte *flv,FLV_KEYFRAMES *k){
+	FLV_TAG tag;
+	FLV_METADATA m;
+
+	memset(k,0,sizeof(FLV_KEYFRAMES));
+	k->video_codec=-1;
+	k->audio_codec=-1;
+	if(flv_reader_header(r,flv)==NULL)
+		return -1;
+	while(flv_reader_next(r,&tag)){
+		long long end=tag.offset+FLV_TAG_HEADER_SIZE+tag.data_size+tag.tail_size;
+		int kf=0;
+		if(tag.type==TAG_TYPE_SCRIPT){
+			if(k->old_meta==NULL&&flv_parse_metadata(tag.data,tag.data_size,&m)==0){
+				k->old_meta=(byte *)malloc(tag.data_size);
+				memcpy(k->old_meta,tag.data,tag.data_size);
+				k->old_meta_size=tag.data_size;
+			}
+			k->script_tags++;
+			continue;
+		}
+		if(tag.timestamp>k->last_ts)
+			k->last_ts=tag.timestamp;
+		if(tag.type==TAG_TYPE_VIDEO&&tag.data_size>0){
+			if(k->video_codec<0)
+				k->video_codec=tag.data[0]&0x0F;
+			k->video_bytes+=tag.data_size;
+			//Key frame, but not AVC sequence header / end of sequence
+			kf=(tag.data[0]>>4)==1&&!((tag.data[0]&0x0F)==7&&(tag.data_size<2||tag.data[1]!=1));
+		}else if(tag.type==TAG_TYPE_AUDIO&&tag.data_size>0){
+			if(k->audio_codec<0){
+				k->audio_codec=tag.data[0]>>4;
+				k->audio_flags=tag.data[0]&0x0F;
+			}
+			k->audio_bytes+=tag.data_size;
+		}
+		if(kf){
+			if(k->num_kf==k->size_kf){
+				k->size_kf=k->size_kf?k->size_kf*2:1024;
+				k->kf_pos=(long long *)realloc(k->kf_pos,k->size_kf*sizeof(long long));
+				k->kf_time=(uint *)realloc(k->kf_time,k->size_kf*sizeof(uint));
+			}
+			k->kf_pos[k->num_kf]=k->copy_bytes;
+			k->kf_time[k->num_kf]=tag.timestamp;
+			k->num_kf++;
+			k->last_kf_ts=tag.timestamp;
+		}
+		if(tag.type==TAG_TYPE_VIDEO)
+			k->last_is_kf=kf;
+		//Adjacent tags are copied as one range
+		if(k->num_range>0&&k->range[2*k->num_range-1]==tag.offset){
+			k->range[2*k->num_range-1]=end;
+		}else{
+			if(k->num_range==k->size_range){
+				k->size_range=k->size_range?k->size_range*2:16;
+				k->range=(long long *)realloc(k->range,2*k->size_range*sizeof(long long));
+			}
+			k->range[2*k->num_range]=tag.offset;
+			k->range[2*k->num_range+1]=end;
+			k->num_range++;
+		}
+		k->copy_bytes+=end-tag.offset;
+	}
+	return 0;
+}
+
+static byte *amf_put_key(byte *p,const char *key){
+	int len=(int)strlen(key);
+	p[0]=(byte)(len>>8);
+	p[1]=(byte)len;
+	memcpy(p+2,key,len);
+	return p+2+len;
+}
+
+static byte *amf_put_number(byte *p,double v){
+	unsigned long long u=0;
+	int i=0;
+	memcpy(&u,&v,sizeof(u));
+	p[0]=AMF_NUMBER;
+	for(i=0;i<8;i++)
+		p[1+i]=(byte)(u>>(56-8*i));
+	return p+9;
+}
+
+static byte *amf_put_bool(byte *p,int v){
+	p[0]=AMF_BOOLEAN;
+	p[1]=(byte)(v!=0);
+	return p+2;
+}
+
+static byte *amf_put_end(byte *p){
+	p[0]=0;
+	p[1]=0;
+	p[2]=AMF_OBJECT_END;
+	return p+3;
+}
+
+//Properties written by flv_build_metadata(), the old values of them are dropped
+static const char *flv_meta_keys[]={
+	"hasKeyframes","hasVideo","hasAudio","hasMetadata","canSeekToEnd","duration","datasize",
+	"videocodecid","videosize","audiocodecid","audiosize","audiosamplerate","audiosamplesize","stereo",
+	"lasttimestamp","lastkeyframetimestamp","lastkeyframelocation","filesize","keyframes",NULL
+};
+
+/**
+ * Write onMetaData with keyframes (yamdi style). Other properties of the
+ * old onMetaData (width, height, framerate, encoder...) are copied as they
+ * are. All numbers have the same size, so the size does not depend on base.
+ * @param base  Offset of the first copied tag in output file.
+ * @return      Size of script data.
+ */
+static int flv_build_metadata(const FLV_KEYFRAMES *k,long long base,long long filesize,byte *out){
+	static const int sound_rate[4]={5512,11025,22050,44100};
+	FLV_METADATA m;
+	byte *p=out;
+	int i=0,count=0;
+
+	p[0]=AMF_STRING;
+	p=amf_put_key(p+1,"onMetaData");
+	p[0]=AMF_ECMA_ARRAY;
+	p+=5;
+	p=amf_put_key(p,"hasKeyframes");p=amf_put_bool(p,k->num_kf>0);count++;
+	p=amf_put_key(p,"hasVideo");p=amf_put_bool(p,k->video_codec>=0);count++;
+	p=amf_put_key(p,"hasAudio");p=amf_put_bool(p,k->audio_codec>=0);count++;
+	p=amf_put_key(p,"hasMetadata");p=amf_put_bool(p,1);count++;
+	p=amf_put_key(p,"canSeekToEnd");p=amf_put_bool(p,k->last_is_kf);count++;
+	p=amf_put_key(p,"duration");p=amf_put_number(p,k->last_ts/1000.0);count++;
+	p=amf_put_key(p,"datasize");p=amf_put_number(p,(double)(k->video_bytes+k->audio_bytes));count++;
+	if(k->video_codec>=0){
+		p=amf_put_key(p,"videocodecid");p=amf_put_number(p,k->video_codec);count++;
+		p=amf_put_key(p,"videosize");p=amf_put_number(p,(double)k->video_bytes);count++;
+	}
+	if(k->audio_codec>=0){
+		p=amf_put_key(p,"audiocodecid");p=amf_put_number(p,k->audio_codec);count++;
+		p=amf_put_key(p,"audiosize");p=amf_put_number(p,(double)k->audio_bytes);count++;
+		//From the flags of audio tag (AAC always says 44kHz stereo, the decoder uses AudioSpecificConfig)
+		p=amf_put_key(p,"audiosamplerate");p=amf_put_number(p,sound_rate[(k->audio_flags>>2)&0x03]);count++;
+		p=amf_put_key(p,"audiosamplesize");p=amf_put_number(p,(k->audio_flags&0x02)?16:8);count++;
+		p=amf_put_key(p,"stereo");p=amf_put_bool(p,k->audio_flags&0x01);count++;
+	}
+	p=amf_put_key(p,"lasttimestamp");p=amf_put_number(p,k->last_ts/1000.0);count++;
+	p=amf_put_key(p,"lastkeyframetimestamp");p=amf_put_number(p,k->last_kf_ts/1000.0);count++;
+	p=amf_put_key(p,"lastkeyframelocation");p=amf_put_number(p,k->num_kf?(double)(base+k->kf_pos[k->num_kf-1]):0.0);count++;
+	p=amf_put_key(p,"filesize");p=amf_put_number(p,(double)filesize);count++;
+	//Members of the old onMetaData are copied byte by byte, key included
+	if(k->old_meta!=NULL&&flv_parse_metadata(k->old_meta,k->old_meta_size,&m)==0){
+		AMF_ITER it;
+		AMF_VALUE key,v;
+		const byte *start=NULL;
+		amf_iter_init(&it,&m.value,0);
+		for(start=it.p;amf_iter_next(&it,&key,&v)>0;start=it.p){
+			for(i=0;flv_meta_keys[i]!=NULL&&!amf_key_is(&key,flv_meta_keys[i]);i++)
+				;
+			if(flv_meta_keys[i]!=NULL)
+				continue;
+			memcpy(p,start,it.p-start);
+			p+=it.p-start;
+			count++;
+		}
+	}
+	p=amf_put_key(p,"keyframes");count++;
+	p[0]=AMF_OBJECT;
+	p=amf_put_key(p+1,"filepositions");
+	p[0]=AMF_STRICT_ARRAY;
+	flv_put_be32(p+1,k->num_kf);
+	p+=5;
+	for(i=0;i<k->num_kf;i++)
+		p=amf_put_number(p,(double)(base+k->kf_pos[i]));
+	p=amf_put_key(p,"times");
+	p[0]=AMF_STRICT_ARRAY;
+	flv_put_be32(p+1,k->num_kf);
+	p+=5;
+	for(i=0;i<k->num_kf;i++)
+		p=amf_put_number(p,k->kf_time[i]/1000.0);
+	p=amf_put_end(p);
+	p=amf_put_end(p);
+	//ECMA array count, after "onMetaData" and the type marker
+	flv_put_be32(out+14,count);
+	return (int)(p-out);
+}
+
+/**
+ * Binary keyframe index for seek servers: FLVIDX_HEADER followed by one
+ * FLVIDX_ENTRY per keyframe, with offsets in the output file.
+ */
+typedef struct
+{
+	char tag[4];                  //! "FIDX"
+	uint version;
+	uint entry_size;
+	uint num;
+} FLVIDX_HEADER;
+
+typedef struct
+{
+	long long offset;             //! Offset of the keyframe tag
+	uint timestamp;               //! ms
+	uint reserved;
+} FLVIDX_ENTRY;
+
+/**
+ * Add onMetaData with keyframe positions and times to FLV file, so that
+ * players and servers can seek without reading the whole file. Old script
+ * data is replaced, keeping the properties of onMetaData that are not
+ * computed again. Tags are copied without changes.
+ * @param url        Location of input FLV file.
+ * @param url_out    Location of output FLV file.
+ * @param url_index  Location of output binary keyframe index, or NULL.
+ */
+int simplest_flv_inject_metadata(char *url,const char *url_out,const char *url_index){
+	FLV_READER reader;
+	FLV_KEYFRAMES k;
+	byte flv[FLV_HEADER_SIZE];
+	byte tag_header[FLV_TAG_HEADER_SIZE];
+	byte prev[4]={0};
+	byte *meta=NULL;
+	long long base=0,filesize=0;
+	int meta_size=0,i=0,failed=0;
+	FILE *fp=NULL,*fp_out=NULL,*fp_idx=NULL;
+
+	if(flv_reader_open(&reader,url)<0){
+		printf("Failed to open files!");
+		return -1;
+	}
+	if(flv_collect_keyframes(&reader,flv,&k)<0){
+		printf("Not a FLV file!");
+		flv_reader_close(&reader);
+		return -1;
+	}
+	flv_reader_close(&reader);
+
+	//Size first (it does not depend on the offsets), then the offsets
+	meta=(byte *)malloc(1024+k.num_kf*18+k.old_meta_size);
+	meta_size=flv_build_metadata(&k,0,0,meta);
+	//DataSize of the tag has 24 bits
+	if(meta_size>0xFFFFFF){
+		printf("Error: onMetaData of %d keyframes does not fit in a tag (%d bytes).\n",k.num_kf,meta_size);
+		free(meta);
+		flv_keyframes_free(&k);
+		return -1;
+	}
+	base=FLV_HEADER_SIZE+4+FLV_TAG_HEADER_SIZE+meta_size+4;
+	filesize=base+k.copy_bytes;
+	flv_build_metadata(&k,base,filesize,meta);
+
+	if((fp=fopen(url,"rb"))==NULL||(fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Failed to open files!");
+		if(fp)
+			fclose(fp);
+		free(meta);
+		flv_keyframes_free(&k);
+		return -1;
+	}
+	//Header without extra bytes, PreviousTagSize0
+	flv_put_be32(flv+5,FLV_HEADER_SIZE);
+	memset(tag_header,0,sizeof(tag_header));
+	tag_header[0]=TAG_TYPE_SCRIPT;
+	flv_put_be24(tag_header+1,meta_size);
+	if(fwrite(flv,1,FLV_HEADER_SIZE,fp_out)!=FLV_HEADER_SIZE||fwrite(prev,1,4,fp_out)!=4
+		||fwrite(tag_header,1,FLV_TAG_HEADER_SIZE,fp_out)!=FLV_TAG_HEADER_SIZE||fwrite(meta,1,meta_size,fp_out)!=(size_t)meta_size)
+		failed=1;
+	flv_put_be32(prev,FLV_TAG_HEADER_SIZE+meta_size);
+	if(!failed&&fwrite(prev,1,4,fp_out)!=4)
+		failed=1;
+	for(i=0;i<k.num_range&&!failed;i++){
+		long long size=k.range[2*i+1]-k.range[2*i];
+		if(simplest_copy_range(fp,k.range[2*i],size,fp_out)!=size)
+			failed=1;
+	}
+	fclose(fp);
+	//Buffered write errors show up when the file is flushed
+	if(fclose(fp_out)!=0)
+		failed=1;
+	if(failed){
+		printf("Error: Cannot write %s.\n",url_out);
+		free(meta);
+		flv_keyframes_free(&k);
+		return -1;
+	}
+
+	if(url_index!=NULL&&(fp_idx=fopen(url_index,"wb"))!=NULL){
+		FLVIDX_HEADER h;
+		FLVIDX_ENTRY e;
+		memset(&h,0,sizeof(h));
+		memcpy(h.tag,"FIDX",4);
+		h.version=FLVIDX_VERSION;
+		h.entry_size=sizeof(FLVIDX_ENTRY);
+		h.num=k.num_kf;
+		failed=fwrite(&h,sizeof(h),1,fp_idx)!=1;
+		for(i=0;i<k.num_kf&&!failed;i++){
+			e.offset=base+k.kf_pos[i];
+			e.timestamp=k.kf_time[i];
+			e.reserved=0;
+			failed=fwrite(&e,sizeof(e),1,fp_idx)!=1;
+		}
+		if(fclose(fp_idx)!=0||failed){
+			printf("Error: Cannot write %s.\n",url_index);
+			failed=1;
+		}
+	}
+
+	printf("Keyframes:%d Duration:%.3fs Script Tags Replaced:%d onMetaData:%d bytes Output:%lld bytes\n",k.num_kf,
+		k.last_ts/1000.0,k.script_tags,meta_size,filesize);
+	free(meta);
+	flv_keyframes_free(&k);
+	return failed?-1:0;
+}
+
+/**
+ * Print onMetaData of FLV file. Only the file header and the first tag
+ * are read, so it costs the same for files of any size.
+ * @param url    Location of input FLV file.
+ */
+int simplest_flv_probe(char *url){
+	byte header[FLV_HEADER_SIZE+4+FLV_TAG_HEADER_SIZE];
+	byte *data=NULL;
+	byte *tag=header+FLV_HEADER_SIZE+4;
+	FLV_METADATA m;
+	long long size=0,mtime=0;
+	int data_size=0,ret=-1;
+	FILE *fp=NULL;
+
+	if(simplest_file_stat(url,&size,&mtime)<0||(fp=fopen(url,"rb"))==NULL){
+		printf("Failed to open files!");
+		return -1;
+	}
+	if(fread(header,1,FLV_HEADER_SIZE,fp)!=FLV_HEADER_SIZE||memcmp(header,"FLV",3)!=0
+		||simplest_fseek64(fp,flv_be32(header+5)+4,SEEK_SET)<0||fread(tag,1,FLV_TAG_HEADER_SIZE,fp)!=FLV_TAG_HEADER_SIZE){
+		printf("Not a FLV file!");
+		fclose(fp);
+		return -1;
+	}
+	data_size=flv_be24(tag+1);
+	data=(byte *)malloc(data_size?data_size:1);
+	if((tag[0]&0x1F)==TAG_TYPE_SCRIPT&&fread(data,1,data_size,fp)==(size_t)data_size&&flv_parse_metadata(data,data_size,&m)==0){
+		printf("onMetaData: ");
+		amf_print(stdout,&m.value,0);
+		printf("\n");
+		printf("Duration:%.3fs Size:%.0fx%.0f FPS:%.3f Video Codec:%.0f Audio Codec:%.0f Keyframes:%d\n",m.duration,m.width,
+			m.height,m.framerate,m.videocodecid,m.audiocodecid,m.keyframes);
+		ret=0;
+	}else{
+		printf("No onMetaData in the first tag.\n");
+	}
+	printf("Read %lld of %lld bytes\n",simplest_ftell64(fp),size);
+	free(data);
+	fclose(fp);
+	return ret;
+}
+
+/**
+ * Pending scatter-gather write of Annex B NALUs: start codes and
+ * pointers to the payloads in the tags.
+ */
+typedef struct
+{
+	const void *base[2*FLV_IOV_BATCH];
+	long long len[2*FLV_IOV_BATCH];
+	int num;
+} FLV_IOV;
+
+static const byte flv_startcode[4]={0,0,0,1};
+
+//Write the pending buffers, return -1 on write error
+static int flv_iov_flush(FILE *fp,FLV_IOV *iov){
+	long long w=0;
+	if(iov->num>0)
+		w=simplest_writev(fp,iov->base,iov->len,iov->num);
+	iov->num=0;
+	return w<0?-1:0;
+}
+
+//Queue a start code and a NALU (referenced), return -1 on write error
+static int flv_iov_add_nalu(FILE *fp,FLV_IOV *iov,const byte *data,long long len){
+	iov->base[iov->num]=flv_startcode;
+	iov->len[iov->num]=4;
+	iov->base[iov->num+1]=data;
+	iov->len[iov->num+1]=len;
+	iov->num+=2;
+	if(iov->num==2*FLV_IOV_BATCH)
+		return flv_iov_flush(fp,iov);
+	return 0;
+}
+
+/**
+ * Extract H.264 of FLV file (AVC video tags) as Annex B stream. SPS/PPS
+ * of AVCDecoderConfigurationRecord are written at the start, and again
+ * before key frames that do not carry them.
+ * @param url        Location of input FLV file.
+ * @param url_out    Location of output H.264 Annex B file.
+ * @param url_ts     Location of output CSV with DTS/PTS of each frame, or NULL.
+ */
+int simplest_flv_to_h264(char *url,const char *url_out,const char *url_ts){
+	FLV_READER reader;
+	FLV_TAG tag;
+	FLV_IOV *iov=NULL;
+	byte flv[FLV_HEADER_SIZE];
+	byte *ps=NULL;                //Parameter sets of avcC, 2 byte length prefixed
+	int ps_size=0,ps_num=0,length_size=4;
+	int frames=0,nalus=0,errors=0,reordered=0,failed=0;
+	int cts_min=0,cts_max=0;
+	long long bytes=0,pts=0,last_pts=0;
+	FILE *fp_out=NULL,*fp_ts=NULL;
+
+	if(flv_reader_open(&reader,url)<0){
+		printf("Failed to open files!");
+		return -1;
+	}
+	if(flv_reader_header(&reader,flv)==NULL||(fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Failed to open files!");
+		flv_reader_close(&reader);
+		return -1;
+	}
+	if(url_ts!=NULL&&(fp_ts=fopen(url_ts,"wb"))!=NULL)
+		fprintf(fp_ts,"frame,dts,pts,key\n");
+	iov=(FLV_IOV *)malloc(sizeof(FLV_IOV));
+	iov->num=0;
+
+	while(flv_reader_next(&reader,&tag)){
+		const byte *p=tag.data+5;
+		const byte *end=tag.data+tag.data_size;
+		int cts=0,key=0,has_sps=0,i=0;
+
+		if(tag.type!=TAG_TYPE_VIDEO||tag.data_size<5||(tag.data[0]&0x0F)!=7)
+			continue;
+		key=(tag.data[0]>>4)==1;
+		//CompositionTime is SI24
+		cts=(int)flv_be24(tag.data+2);
+		if(cts&0x800000)
+			cts-=0x1000000;
+
+		switch(tag.data[1]){
+		case 0:{
+			//AVCDecoderConfigurationRecord: keep SPS/PPS (small) for later key frames
+			const byte *q=p+6;
+			int k=0,num=0;
+			if(end-p<7||p[0]!=1){
+				errors++;
+				break;
+			}
+			length_size=(p[4]&0x03)+1;
+			//Pending writes may still point into the old parameter sets
+			if(flv_iov_flush(fp_out,iov)<0){
+				failed=1;
+				break;
+			}
+			ps=(byte *)realloc(ps,end-p);
+			ps_size=0;
+			ps_num=0;
+			num=p[5]&0x1F;
+			for(k=0;k<2;k++){
+				for(i=0;i<num;i++){
+					int len=0;
+					if(end-q<2||end-q-2<(len=(int)flv_be16(q)))
+						break;
+					memcpy(ps+ps_size,q,2+len);
+					ps_size+=2+len;
+					ps_num++;
+					q+=2+len;
+				}
+				if(k==0){
+					if(q>=end)
+						break;
+					num=*q++;
+				}
+			}
+			for(i=0;i<ps_size;i+=2+flv_be16(ps+i)){
+				if(flv_iov_add_nalu(fp_out,iov,ps+i+2,flv_be16(ps+i))<0)
+					failed=1;
+			}
+			nalus+=ps_num;
+			break;
+		}
+		case 1:{
+			//Look for SPS in the frame first
+			const byte *q=p;
+			while(end-q>=length_size+1){
+				long long len=0;
+				for(i=0;i<length_size;i++)
+					len=(len<<8)|q[i];
+				if(len>end-q-length_size)
+					break;
+				if((q[length_size]&0x1F)==7)
+					has_sps=1;
+				q+=length_size+len;
+			}
+			if(key&&!has_sps){
+				for(i=0;i<ps_size;i+=2+flv_be16(ps+i)){
+					if(flv_iov_add_nalu(fp_out,iov,ps+i+2,flv_be16(ps+i))<0)
+						failed=1;
+				}
+			}
+			//Length prefixes become start codes, the payload is not copied
+			while(end-p>=length_size){
+				long long len=0;
+				for(i=0;i<length_size;i++)
+					len=(len<<8)|p[i];
+				p+=length_size;
+				if(len>end-p){
+					errors++;
+					break;
+				}
+				if(flv_iov_add_nalu(fp_out,iov,p,len)<0)
+					failed=1;
+				nalus++;
+				p+=len;
+			}
+			pts=(long long)tag.timestamp+cts;
+			if(fp_ts)
+				fprintf(fp_ts,"%d,%u,%lld,%d\n",frames,tag.timestamp,pts,key);
+			if(frames==0||cts<cts_min)
+				cts_min=cts;
+			if(frames==0||cts>cts_max)
+				cts_max=cts;
+			//Presented before the frame decoded ahead of it
+			if(frames>0&&pts<last_pts)
+				reordered++;
+			last_pts=pts;
+			frames++;
+			break;
+		}
+		default:
+			//End of sequence
+			break;
+		}
+		//In block mode the payload is only valid until the next tag
+		if(reader.map==NULL&&flv_iov_flush(fp_out,iov)<0)
+			failed=1;
+		if(failed)
+			break;
+	}
+	if(flv_iov_flush(fp_out,iov)<0||failed){
+		printf("Error: Cannot write output file.\n");
+		failed=1;
+	}
+	bytes=simplest_ftell64(fp_out);
+
+	printf("Frames:%d NALU Cnt:%d Output:%lld bytes Length Size:%d Parameter Sets:%d Errors:%d\n",frames,nalus,bytes,
+		length_size,ps_num,errors);
+	printf("CompositionTime min %dms max %dms, %d frames reordered\n",cts_min,cts_max,reordered);
+
+	if(fp_ts)
+		fclose(fp_ts);
+	fclose(fp_out);
+	free(iov);
+	free(ps);
+	flv_reader_close(&reader);
+	return failed?-1:0;
+}
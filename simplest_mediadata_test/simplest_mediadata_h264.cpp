@@ -28,6 +28,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define H264_USE_SSE2 1
+#endif
+
+//Read size of block mode scanner
+#define H264_BLOCK_SIZE (4<<20)
+//Bytes converted to RBSP for parameter sets, and for slice headers
+#define H264_HEADER_MAX 4096
+#define H264_SLICE_HEADER_MAX 64
+//Chunk size of parallel NALU indexing
+#define H264_INDEX_CHUNK (8<<20)
+//Sidecar index
+#define H264IDX_VERSION 1
+#define H264IDX_HASH_BYTES 4096
+#define H264IDX_IDR 0x01
+#define H264IDX_AU_START 0x02
+//NALUs per writev() batch
+#define H264_IOV_BATCH 256
+
+/**
+ * File helpers, see simplest_mediadata_io.cpp
+ */
+extern unsigned char *simplest_map_file(const char *url,long long *size);
+extern void simplest_unmap_file(unsigned char *data,long long size);
+extern int simplest_fseek64(FILE *fp,long long offset,int whence);
+extern int simplest_file_stat(const char *url,long long *size,long long *mtime);
+extern long long simplest_pread(FILE *fp,void *buf,long long size,long long offset);
+extern long long simplest_copy_range(FILE *fp_in,long long offset,long long size,FILE *fp_out);
+extern long long simplest_writev(FILE *fp,const void **base,const long long *len,int num);
 
 typedef enum {
 	NALU_TYPE_SLICE    = 1,
@@ -56,104 +88,706 @@ typedef struct
 {
 	int startcodeprefix_len;      //! 4 for parameter sets and first slice in picture, 3 for everything else (suggested)
 	unsigned len;                 //! Length of the NAL unit (Excluding the start code, which does not belong to the NALU)
-	unsigned max_size;            //! Nal Unit Buffer size
 	int forbidden_bit;            //! should be always FALSE
 	int nal_reference_idc;        //! NALU_PRIORITY_xxxx
 	int nal_unit_type;            //! NALU_TYPE_xxxx    
-	char *buf;                    //! contains the first byte followed by the EBSP
+	char *buf;                    //! contains the first byte followed by the EBSP, points into the scanner, valid until next NALU
 } NALU_t;
 
-FILE *h264bitstream = NULL;                //!< the bit stream file
+/**
+ * NALU found by H264_SCANNER. data points into the mapped file, or into the
+ * block buffer of scanner (valid until the next h264_scanner_next()).
+ */
+typedef struct
+{
+	long long offset;             //! Offset of the start code in file
+	int startcodeprefix_len;      //! 3 or 4
+	unsigned len;                 //! Length of the NAL unit (Excluding the start code)
+	int forbidden_bit;
+	int nal_reference_idc;
+	int nal_unit_type;
+	const unsigned char *data;    //! First byte followed by the EBSP
+} NALU_VIEW;
 
-int info2=0, info3=0;
+/**
+ * Annex B scanner. The whole file is mapped if possible, otherwise it is
+ * read in large blocks.
+ */
+typedef struct
+{
+	unsigned char *map;           //! Mapped file (mmap mode)
+	long long map_size;
+	FILE *fp;                     //! Input file (block mode)
+	unsigned char *buf;           //! File bytes [buf_offset, buf_offset+buf_len) (block mode)
+	int buf_size;
+	int buf_len;
+	long long buf_offset;
+	long long pos;                //! Offset of the next start code
+	long long scan;               //! Search for the end of current NALU goes on from here
+	int eof;
+} H264_SCANNER;
+
+H264_SCANNER h264scanner;        //!< scanner of the bit stream file
 
-static int FindStartCode2 (unsigned char *Buf){
-	if(Buf[0]!=0 || Buf[1]!=0 || Buf[2] !=1) return 0; //0x000001?
-	else return 1;
+/**
+ * Find the first 00 00 xx in [p,end). xx is 01 for start code, and
+ * 03 for emulation prevention.
+ * @return  Position of the pattern, or end if not found.
+ */
+static const unsigned char *h264_find_zero_zero(const unsigned char *p,const unsigned char *end,unsigned char last){
+#ifdef H264_USE_SSE2
+	const __m128i zero=_mm_setzero_si128(),tail=_mm_set1_epi8((char)last);
+	while(end-p>=18){
+		__m128i a=_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p),zero);
+		__m128i b=_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p+1)),zero);
+		__m128i c=_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p+2)),tail);
+		int mask=_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a,b),c));
+		if(mask!=0){
+			int i=0;
+			while(!(mask&(1<<i)))
+				i++;
+			return p+i;
+		}
+		p+=16;
+	}
+#endif
+	//Look for the last byte with memchr(), then check the two zeros before it
+	while(end-p>=3){
+		const unsigned char *q=(const unsigned char *)memchr(p+2,last,end-p-2);
+		if(q==NULL)
+			break;
+		if(q[-1]==0&&q[-2]==0)
+			return q-2;
+		p=q-1;
+	}
+	return end;
 }
 
-static int FindStartCode3 (unsigned char *Buf){
-	if(Buf[0]!=0 || Buf[1]!=0 || Buf[2] !=0 || Buf[3] !=1) return 0;//0x00000001?
-	else return 1;
+static const unsigned char *h264_find_startcode(const unsigned char *p,const unsigned char *end){
+	return h264_find_zero_zero(p,end,1);
 }
 
+static int h264_scanner_open(H264_SCANNER *s,const char *url){
+	memset(s,0,sizeof(H264_SCANNER));
+	s->map=simplest_map_file(url,&s->map_size);
+	if(s->map!=NULL)
+		return 0;
+	//Too large to map (32bit), or not a regular file
+	if((s->fp=fopen(url,"rb"))==NULL)
+		return -1;
+	s->buf_size=H264_BLOCK_SIZE;
+	s->buf=(unsigned char *)malloc(s->buf_size);
+	return 0;
+}
+
+static void h264_scanner_close(H264_SCANNER *s){
+	simplest_unmap_file(s->map,s->map_size);
+	if(s->fp)
+		fclose(s->fp);
+	free(s->buf);
+	memset(s,0,sizeof(H264_SCANNER));
+}
+
+//Read more data, keeping the bytes from pos on
+static void h264_scanner_fill(H264_SCANNER *s){
+	int keep=(int)(s->buf_offset+s->buf_len-s->pos);
+	int n=0;
+
+	memmove(s->buf,s->buf+(s->pos-s->buf_offset),keep);
+	s->buf_offset=s->pos;
+	s->buf_len=keep;
+	//One NALU takes more than half of the buffer
+	if(keep>s->buf_size/2){
+		s->buf_size*=2;
+		s->buf=(unsigned char *)realloc(s->buf,s->buf_size);
+	}else if(s->buf_size>H264_BLOCK_SIZE&&keep<=H264_BLOCK_SIZE/2){
+		//The large NALU is gone, give the memory back
+		s->buf_size=H264_BLOCK_SIZE;
+		s->buf=(unsigned char *)realloc(s->buf,s->buf_size);
+	}
+	n=(int)fread(s->buf+s->buf_len,1,s->buf_size-s->buf_len,s->fp);
+	s->buf_len+=n;
+	if(n==0||feof(s->fp))
+		s->eof=1;
+}
+
+/**
+ * Get next NALU without copying it.
+ * @return  1 if a NALU is found, 0 at the end of stream.
+ */
+static int h264_scanner_next(H264_SCANNER *s,NALU_VIEW *v){
+	for(;;){
+		const unsigned char *base=s->map?s->map:s->buf;
+		long long base_offset=s->map?0:s->buf_offset;
+		const unsigned char *p=base+(s->pos-base_offset);
+		const unsigned char *end=base+(s->map?s->map_size:s->buf_len);
+		const unsigned char *sc=h264_find_startcode(p,end);
+		int eof=s->map?1:s->eof;
+
+		if(sc!=end){
+			const unsigned char *payload=sc+3;
+			const unsigned char *from=base+(s->scan-base_offset);
+			const unsigned char *q=h264_find_startcode(from>payload?from:payload,end);
+			if(q!=end||eof){
+				const unsigned char *nal_end=q;
+				//0x00000001: the zero belongs to the next start code
+				if(q!=end&&q[-1]==0)
+					nal_end--;
+				v->startcodeprefix_len=(sc>p&&sc[-1]==0)?4:3;
+				v->offset=base_offset+(sc-base)-(v->startcodeprefix_len-3);
+				v->data=payload;
+				v->len=(unsigned)(nal_end-payload);
+				v->forbidden_bit=v->len?v->data[0]&0x80:0;
+				v->nal_reference_idc=v->len?v->data[0]&0x60:0;
+				v->nal_unit_type=v->len?v->data[0]&0x1f:0;
+				s->pos=base_offset+(nal_end-base);
+				s->scan=s->pos;
+				return 1;
+			}
+			//The end of this NALU is not in the buffer yet
+			s->pos=base_offset+(sc-base)-((sc>p&&sc[-1]==0)?1:0);
+			s->scan=base_offset+(end-base)-2;
+		}else{
+			if(eof)
+				return 0;
+			//Skip data without start code, keep the last bytes for a split start code
+			if(end-p>3)
+				s->pos=base_offset+(end-base)-3;
+			s->scan=s->pos;
+		}
+		h264_scanner_fill(s);
+	}
+}
 
 int GetAnnexbNALU (NALU_t *nalu){
-	int pos = 0;
-	int StartCodeFound, rewind;
-	unsigned char *Buf;
+	NALU_VIEW v;
+
+	if(!h264_scanner_next(&h264scanner,&v))
+		return 0;
+
+	nalu->startcodeprefix_len=v.startcodeprefix_len;
+	nalu->len=v.len;
+	nalu->buf=(char *)v.data;
+	nalu->forbidden_bit = v.forbidden_bit; //1 bit
+	nalu->nal_reference_idc = v.nal_reference_idc; // 2 bit
+	nalu->nal_unit_type = v.nal_unit_type;// 5 bit
+
+	return nalu->startcodeprefix_len+nalu->len;
+}
+
+/**
+ * Remove emulation prevention bytes (00 00 03 -> 00 00).
+ * @return  Length of RBSP in dst.
+ */
+static int h264_ebsp_to_rbsp(const unsigned char *src,int len,unsigned char *dst){
+	const unsigned char *p=src,*end=src+len;
+	unsigned char *d=dst;
+
+	for(;;){
+		const unsigned char *q=h264_find_zero_zero(p,end,3);
+		if(q==end){
+			memcpy(d,p,end-p);
+			d+=end-p;
+			break;
+		}
+		memcpy(d,p,q+2-p);
+		d+=q+2-p;
+		p=q+3;
+	}
+	return (int)(d-dst);
+}
+
+/**
+ * Bit reader with a 64bit cache, MSB first.
+ */
+typedef struct
+{
+	const unsigned char *p;
+	const unsigned char *end;
+	unsigned long long cache;     //! Next bits, MSB aligned
+	int bits;                     //! Valid bits in cache
+	int left;                     //! Bits not read yet, negative if read past the end
+} H264_BITS;
 
-	if ((Buf = (unsigned char*)calloc (nalu->max_size , sizeof(char))) == NULL) 
-		printf ("GetAnnexbNALU: Could not allocate Buf memory\n");
+static unsigned char h264_clz8[256];  //!< Leading zeros of a byte
 
-	nalu->startcodeprefix_len=3;
+static void h264_bits_init(H264_BITS *b,const unsigned char *data,int size){
+	int i=0;
+	if(h264_clz8[1]==0){
+		h264_clz8[0]=8;
+		for(i=1;i<256;i++){
+			int n=0;
+			while(!(i&(0x80>>n)))
+				n++;
+			h264_clz8[i]=(unsigned char)n;
+		}
+	}
+	b->p=data;
+	b->end=data+size;
+	b->cache=0;
+	b->bits=0;
+	b->left=size*8;
+}
 
-	if (3 != fread (Buf, 1, 3, h264bitstream)){
-		free(Buf);
+static void h264_bits_refill(H264_BITS *b){
+	while(b->bits<=56){
+		unsigned long long byte=0;
+		if(b->p<b->end)
+			byte=*b->p++;
+		b->cache|=byte<<(56-b->bits);
+		b->bits+=8;
+	}
+}
+
+//n is 1..32
+static unsigned h264_read_bits(H264_BITS *b,int n){
+	unsigned v=0;
+	if(b->bits<n)
+		h264_bits_refill(b);
+	v=(unsigned)(b->cache>>(64-n));
+	b->cache<<=n;
+	b->bits-=n;
+	b->left-=n;
+	return v;
+}
+
+//Unsigned Exp-Golomb, leading zeros come from a byte table
+static unsigned h264_read_ue(H264_BITS *b){
+	unsigned long long c=0;
+	int lz=0;
+	if(b->bits<32)
+		h264_bits_refill(b);
+	c=b->cache;
+	while(lz<32&&(c>>56)==0){
+		lz+=8;
+		c<<=8;
+	}
+	if(lz<32)
+		lz+=h264_clz8[c>>56];
+	if(lz>31){
+		b->left=-1;
 		return 0;
 	}
-	info2 = FindStartCode2 (Buf);
-	if(info2 != 1) {
-		if(1 != fread(Buf+3, 1, 1, h264bitstream)){
-			free(Buf);
-			return 0;
+	b->cache<<=lz;
+	b->bits-=lz;
+	b->left-=lz;
+	return h264_read_bits(b,lz+1)-1;
+}
+
+static int h264_read_se(H264_BITS *b){
+	unsigned k=h264_read_ue(b);
+	return (k&1)?(int)((k+1)/2):-(int)(k/2);
+}
+
+typedef struct
+{
+	int valid;
+	int profile_idc;
+	int constraint_flags;
+	int level_idc;
+	int chroma_format_idc;
+	int separate_colour_plane;
+	int bit_depth_luma;
+	int bit_depth_chroma;
+	int log2_max_frame_num;
+	int poc_type;
+	int log2_max_poc_lsb;
+	int delta_pic_order_always_zero;
+	int offset_for_non_ref_pic;
+	int offset_for_top_to_bottom_field;
+	int num_ref_frames_in_poc_cycle;
+	int offset_for_ref_frame[256];
+	int max_num_ref_frames;
+	int frame_mbs_only;
+	int width;
+	int height;
+	int timing_info_present;
+	unsigned num_units_in_tick;
+	unsigned time_scale;
+	int fixed_frame_rate;
+} H264_SPS;
+
+typedef struct
+{
+	int valid;
+	int sps_id;
+	int entropy_coding_mode;
+	int bottom_field_pic_order_in_frame_present;
+	int num_slice_groups;
+	int num_ref_idx_l0;
+	int num_ref_idx_l1;
+	int weighted_pred;
+	int weighted_bipred;
+	int pic_init_qp;
+	int deblocking_filter_control_present;
+	int redundant_pic_cnt_present;
+} H264_PPS;
+
+typedef struct
+{
+	int first_mb_in_slice;
+	int slice_type;               //! 0 P, 1 B, 2 I, 3 SP, 4 SI
+	int pps_id;
+	int frame_num;
+	int field_pic;
+	int bottom_field;
+	int idr;
+	int idr_pic_id;
+	int poc_lsb;
+	int delta_poc_bottom;
+	int delta_poc[2];
+	int poc;                      //! Picture order count
+} H264_SLICE;
+
+/**
+ * Parameter sets and POC state of a stream.
+ */
+typedef struct
+{
+	H264_SPS sps[32];
+	H264_PPS pps[256];
+	unsigned char rbsp[H264_HEADER_MAX];
+	int prev_poc_msb;
+	int prev_poc_lsb;
+	int prev_frame_num;
+	int prev_frame_num_offset;
+} H264_CONTEXT;
+
+static void h264_skip_scaling_list(H264_BITS *b,int size){
+	int last=8,next=8,j=0;
+	for(j=0;j<size;j++){
+		if(next!=0)
+			next=(last+h264_read_se(b)+256)%256;
+		last=next==0?last:next;
+	}
+}
+
+/**
+ * Parse SPS, including timing info of VUI.
+ * @return  SPS id, or -1 on error.
+ */
+static int h264_parse_sps(H264_CONTEXT *ctx,const unsigned char *nal,int len){
+	H264_BITS b;
+	H264_SPS sps;
+	int id=0,i=0,w_mbs=0,h_map=0;
+	unsigned log2=0;
+	int crop_left=0,crop_right=0,crop_top=0,crop_bottom=0;
+
+	memset(&sps,0,sizeof(sps));
+	len=h264_ebsp_to_rbsp(nal+1,(len>H264_HEADER_MAX?H264_HEADER_MAX:len)-1,ctx->rbsp);
+	h264_bits_init(&b,ctx->rbsp,len);
+
+	sps.profile_idc=h264_read_bits(&b,8);
+	sps.constraint_flags=h264_read_bits(&b,8);
+	sps.level_idc=h264_read_bits(&b,8);
+	id=h264_read_ue(&b);
+	if(id>31)
+		return -1;
+	sps.chroma_format_idc=1;
+	sps.bit_depth_luma=sps.bit_depth_chroma=8;
+	switch(sps.profile_idc){
+	case 100:case 110:case 122:case 244:case 44:case 83:case 86:case 118:case 128:case 138:case 139:case 134:case 135:
+		sps.chroma_format_idc=h264_read_ue(&b);
+		if(sps.chroma_format_idc==3)
+			sps.separate_colour_plane=h264_read_bits(&b,1);
+		sps.bit_depth_luma=h264_read_ue(&b)+8;
+		sps.bit_depth_chroma=h264_read_ue(&b)+8;
+		h264_read_bits(&b,1);     //qpprime_y_zero_transform_bypass_flag
+		if(h264_read_bits(&b,1)){ //seq_scaling_matrix_present_flag
+			for(i=0;i<(sps.chroma_format_idc!=3?8:12);i++)
+				if(h264_read_bits(&b,1))
+					h264_skip_scaling_list(&b,i<6?16:64);
 		}
-		info3 = FindStartCode3 (Buf);
-		if (info3 != 1){ 
-			free(Buf);
+		break;
+	}
+	//Both log2 fields are at most 16, they are used as bit counts and shifts
+	log2=h264_read_ue(&b);
+	if(log2>12)
+		return -1;
+	sps.log2_max_frame_num=log2+4;
+	sps.poc_type=h264_read_ue(&b);
+	if(sps.poc_type==0){
+		log2=h264_read_ue(&b);
+		if(log2>12)
+			return -1;
+		sps.log2_max_poc_lsb=log2+4;
+	}else if(sps.poc_type==1){
+		sps.delta_pic_order_always_zero=h264_read_bits(&b,1);
+		sps.offset_for_non_ref_pic=h264_read_se(&b);
+		sps.offset_for_top_to_bottom_field=h264_read_se(&b);
+		sps.num_ref_frames_in_poc_cycle=h264_read_ue(&b);
+		if(sps.num_ref_frames_in_poc_cycle>255)
 			return -1;
+		for(i=0;i<sps.num_ref_frames_in_poc_cycle;i++)
+			sps.offset_for_ref_frame[i]=h264_read_se(&b);
+	}
+	sps.max_num_ref_frames=h264_read_ue(&b);
+	h264_read_bits(&b,1);         //gaps_in_frame_num_value_allowed_flag
+	w_mbs=h264_read_ue(&b)+1;
+	h_map=h264_read_ue(&b)+1;
+	sps.frame_mbs_only=h264_read_bits(&b,1);
+	if(!sps.frame_mbs_only)
+		h264_read_bits(&b,1);     //mb_adaptive_frame_field_flag
+	h264_read_bits(&b,1);         //direct_8x8_inference_flag
+	if(h264_read_bits(&b,1)){     //frame_cropping_flag
+		crop_left=h264_read_ue(&b);
+		crop_right=h264_read_ue(&b);
+		crop_top=h264_read_ue(&b);
+		crop_bottom=h264_read_ue(&b);
+	}
+	if(h264_read_bits(&b,1)){     //vui_parameters_present_flag
+		if(h264_read_bits(&b,1)){ //aspect_ratio_info_present_flag
+			if(h264_read_bits(&b,8)==255)
+				h264_read_bits(&b,32);
 		}
-		else {
-			pos = 4;
-			nalu->startcodeprefix_len = 4;
+		if(h264_read_bits(&b,1))  //overscan_info_present_flag
+			h264_read_bits(&b,1);
+		if(h264_read_bits(&b,1)){ //video_signal_type_present_flag
+			h264_read_bits(&b,4);
+			if(h264_read_bits(&b,1))
+				h264_read_bits(&b,24);
+		}
+		if(h264_read_bits(&b,1)){ //chroma_loc_info_present_flag
+			h264_read_ue(&b);
+			h264_read_ue(&b);
+		}
+		sps.timing_info_present=h264_read_bits(&b,1);
+		if(sps.timing_info_present){
+			sps.num_units_in_tick=h264_read_bits(&b,32);
+			sps.time_scale=h264_read_bits(&b,32);
+			sps.fixed_frame_rate=h264_read_bits(&b,1);
 		}
 	}
-	else{
-		nalu->startcodeprefix_len = 3;
-		pos = 3;
+	if(b.left<0)
+		return -1;
+
+	//Crop unit depends on chroma format, see 7.4.2.1.1 of H.264
+	{
+		int unit_x=1,unit_y=2-sps.frame_mbs_only;
+		if(sps.chroma_format_idc!=0&&!sps.separate_colour_plane){
+			unit_x=sps.chroma_format_idc==3?1:2;
+			unit_y*=sps.chroma_format_idc==1?2:1;
+		}
+		sps.width=w_mbs*16-unit_x*(crop_left+crop_right);
+		sps.height=(2-sps.frame_mbs_only)*h_map*16-unit_y*(crop_top+crop_bottom);
 	}
-	StartCodeFound = 0;
-	info2 = 0;
-	info3 = 0;
+	sps.valid=1;
+	ctx->sps[id]=sps;
+	return id;
+}
 
-	while (!StartCodeFound){
-		if (feof (h264bitstream)){
-			nalu->len = (pos-1)-nalu->startcodeprefix_len;
-			memcpy (nalu->buf, &Buf[nalu->startcodeprefix_len], nalu->len);     
-			nalu->forbidden_bit = nalu->buf[0] & 0x80; //1 bit
-			nalu->nal_reference_idc = nalu->buf[0] & 0x60; // 2 bit
-			nalu->nal_unit_type = (nalu->buf[0]) & 0x1f;// 5 bit
-			free(Buf);
-			return pos-1;
+/**
+ * Parse PPS.
+ * @return  PPS id, or -1 on error.
+ */
+static int h264_parse_pps(H264_CONTEXT *ctx,const unsigned char *nal,int len){
+	H264_BITS b;
+	H264_PPS pps;
+	int id=0,i=0;
+
+	memset(&pps,0,sizeof(pps));
+	len=h264_ebsp_to_rbsp(nal+1,(len>H264_HEADER_MAX?H264_HEADER_MAX:len)-1,ctx->rbsp);
+	h264_bits_init(&b,ctx->rbsp,len);
+
+	id=h264_read_ue(&b);
+	pps.sps_id=h264_read_ue(&b);
+	if(id>255||pps.sps_id>31)
+		return -1;
+	pps.entropy_coding_mode=h264_read_bits(&b,1);
+	pps.bottom_field_pic_order_in_frame_present=h264_read_bits(&b,1);
+	pps.num_slice_groups=h264_read_ue(&b)+1;
+	if(pps.num_slice_groups>1){
+		int map_type=h264_read_ue(&b);
+		if(map_type==0){
+			for(i=0;i<pps.num_slice_groups;i++)
+				h264_read_ue(&b);         //run_length_minus1
+		}else if(map_type==2){
+			for(i=0;i<pps.num_slice_groups-1;i++){
+				h264_read_ue(&b);         //top_left
+				h264_read_ue(&b);         //bottom_right
+			}
+		}else if(map_type>=3&&map_type<=5){
+			h264_read_bits(&b,1);
+			h264_read_ue(&b);
+		}else if(map_type==6){
+			int units=h264_read_ue(&b)+1,bits=0;
+			while((1<<bits)<pps.num_slice_groups)
+				bits++;
+			for(i=0;i<units;i++)
+				h264_read_bits(&b,bits);
 		}
-		Buf[pos++] = fgetc (h264bitstream);
-		info3 = FindStartCode3(&Buf[pos-4]);
-		if(info3 != 1)
-			info2 = FindStartCode2(&Buf[pos-3]);
-		StartCodeFound = (info2 == 1 || info3 == 1);
 	}
+	pps.num_ref_idx_l0=h264_read_ue(&b)+1;
+	pps.num_ref_idx_l1=h264_read_ue(&b)+1;
+	pps.weighted_pred=h264_read_bits(&b,1);
+	pps.weighted_bipred=h264_read_bits(&b,2);
+	pps.pic_init_qp=h264_read_se(&b)+26;
+	h264_read_se(&b);             //pic_init_qs_minus26
+	h264_read_se(&b);             //chroma_qp_index_offset
+	pps.deblocking_filter_control_present=h264_read_bits(&b,1);
+	h264_read_bits(&b,1);         //constrained_intra_pred_flag
+	pps.redundant_pic_cnt_present=h264_read_bits(&b,1);
+	if(b.left<0)
+		return -1;
 
-	// Here, we have found another start code (and read length of startcode bytes more than we should
-	// have.  Hence, go back in the file
-	rewind = (info3 == 1)? -4 : -3;
+	pps.valid=1;
+	ctx->pps[id]=pps;
+	return id;
+}
 
-	if (0 != fseek (h264bitstream, rewind, SEEK_CUR)){
-		free(Buf);
-		printf("GetAnnexbNALU: Cannot fseek in the bit stream file");
+/**
+ * Parse slice header up to the POC fields, and compute POC (8.2.1 of H.264,
+ * memory_management_control_operation 5 is not taken into account).
+ * Only the first bytes of slice are converted to RBSP.
+ * @return  0, or -1 if the slice can not be parsed.
+ */
+static int h264_parse_slice(H264_CONTEXT *ctx,const unsigned char *nal,int len,H264_SLICE *slice){
+	H264_BITS b;
+	const H264_SPS *sps=NULL;
+	const H264_PPS *pps=NULL;
+	int nal_ref_idc=(nal[0]>>5)&3;
+	int max_frame_num=0,frame_num_offset=0,top=0,bottom=0;
+
+	memset(slice,0,sizeof(H264_SLICE));
+	slice->idr=(nal[0]&0x1f)==NALU_TYPE_IDR;
+	len=h264_ebsp_to_rbsp(nal+1,(len>H264_SLICE_HEADER_MAX?H264_SLICE_HEADER_MAX:len)-1,ctx->rbsp);
+	h264_bits_init(&b,ctx->rbsp,len);
+
+	slice->first_mb_in_slice=h264_read_ue(&b);
+	slice->slice_type=h264_read_ue(&b)%5;
+	slice->pps_id=h264_read_ue(&b);
+	if(slice->pps_id>255||!ctx->pps[slice->pps_id].valid)
+		return -1;
+	pps=&ctx->pps[slice->pps_id];
+	sps=&ctx->sps[pps->sps_id];
+	if(!sps->valid)
+		return -1;
+
+	if(sps->separate_colour_plane)
+		h264_read_bits(&b,2);     //colour_plane_id
+	slice->frame_num=h264_read_bits(&b,sps->log2_max_frame_num);
+	if(!sps->frame_mbs_only){
+		slice->field_pic=h264_read_bits(&b,1);
+		if(slice->field_pic)
+			slice->bottom_field=h264_read_bits(&b,1);
+	}
+	if(slice->idr)
+		slice->idr_pic_id=h264_read_ue(&b);
+	if(sps->poc_type==0){
+		slice->poc_lsb=h264_read_bits(&b,sps->log2_max_poc_lsb);
+		if(pps->bottom_field_pic_order_in_frame_present&&!slice->field_pic)
+			slice->delta_poc_bottom=h264_read_se(&b);
+	}
+	if(sps->poc_type==1&&!sps->delta_pic_order_always_zero){
+		slice->delta_poc[0]=h264_read_se(&b);
+		if(pps->bottom_field_pic_order_in_frame_present&&!slice->field_pic)
+			slice->delta_poc[1]=h264_read_se(&b);
 	}
+	if(b.left<0)
+		return -1;
 
-	// Here the Start code, the complete NALU, and the next start code is in the Buf.  
-	// The size of Buf is pos, pos+rewind are the number of bytes excluding the next
-	// start code, and (pos+rewind)-startcodeprefix_len is the size of the NALU excluding the start code
+	max_frame_num=1<<sps->log2_max_frame_num;
+	if(sps->poc_type==0){
+		int max_lsb=1<<sps->log2_max_poc_lsb,msb=0;
+		if(slice->idr){
+			ctx->prev_poc_msb=0;
+			ctx->prev_poc_lsb=0;
+		}
+		if(slice->poc_lsb<ctx->prev_poc_lsb&&ctx->prev_poc_lsb-slice->poc_lsb>=max_lsb/2)
+			msb=ctx->prev_poc_msb+max_lsb;
+		else if(slice->poc_lsb>ctx->prev_poc_lsb&&slice->poc_lsb-ctx->prev_poc_lsb>max_lsb/2)
+			msb=ctx->prev_poc_msb-max_lsb;
+		else
+			msb=ctx->prev_poc_msb;
+		top=msb+slice->poc_lsb;
+		bottom=slice->field_pic?top:top+slice->delta_poc_bottom;
+		if(nal_ref_idc){
+			ctx->prev_poc_msb=msb;
+			ctx->prev_poc_lsb=slice->poc_lsb;
+		}
+	}else{
+		if(slice->idr)
+			frame_num_offset=0;
+		else if(ctx->prev_frame_num>slice->frame_num)
+			frame_num_offset=ctx->prev_frame_num_offset+max_frame_num;
+		else
+			frame_num_offset=ctx->prev_frame_num_offset;
 
-	nalu->len = (pos+rewind)-nalu->startcodeprefix_len;
-	memcpy (nalu->buf, &Buf[nalu->startcodeprefix_len], nalu->len);//
-	nalu->forbidden_bit = nalu->buf[0] & 0x80; //1 bit
-	nalu->nal_reference_idc = nalu->buf[0] & 0x60; // 2 bit
-	nalu->nal_unit_type = (nalu->buf[0]) & 0x1f;// 5 bit
-	free(Buf);
+		if(sps->poc_type==2){
+			if(slice->idr)
+				top=0;
+			else
+				top=2*(frame_num_offset+slice->frame_num)-(nal_ref_idc==0);
+			bottom=top;
+		}else{
+			int abs_frame_num=0,expected=0,i=0;
+			if(sps->num_ref_frames_in_poc_cycle!=0)
+				abs_frame_num=frame_num_offset+slice->frame_num;
+			if(nal_ref_idc==0&&abs_frame_num>0)
+				abs_frame_num--;
+			if(abs_frame_num>0){
+				int delta_per_cycle=0;
+				for(i=0;i<sps->num_ref_frames_in_poc_cycle;i++)
+					delta_per_cycle+=sps->offset_for_ref_frame[i];
+				expected=(abs_frame_num-1)/sps->num_ref_frames_in_poc_cycle*delta_per_cycle;
+				for(i=0;i<=(abs_frame_num-1)%sps->num_ref_frames_in_poc_cycle;i++)
+					expected+=sps->offset_for_ref_frame[i];
+			}
+			if(nal_ref_idc==0)
+				expected+=sps->offset_for_non_ref_pic;
+			top=expected+slice->delta_poc[0];
+			bottom=slice->field_pic?expected+sps->offset_for_top_to_bottom_field+slice->delta_poc[0]
+				:top+sps->offset_for_top_to_bottom_field+slice->delta_poc[1];
+		}
+		ctx->prev_frame_num=slice->frame_num;
+		ctx->prev_frame_num_offset=frame_num_offset;
+	}
+	if(slice->field_pic)
+		slice->poc=slice->bottom_field?bottom:top;
+	else
+		slice->poc=top<bottom?top:bottom;
+	return 0;
+}
+
+/**
+ * Describe SPS, PPS and slice NALU in a short string.
+ */
+static void h264_describe(H264_CONTEXT *ctx,const unsigned char *nal,int len,char *info){
+	const char *slice_str[5]={"P","B","I","SP","SI"};
+	int type=len>0?nal[0]&0x1f:0,id=0;
+	H264_SLICE slice;
 
-	return (pos+rewind);
+	info[0]=0;
+	if(len<2)
+		return;
+	switch(type){
+	case NALU_TYPE_SPS:
+		if((id=h264_parse_sps(ctx,nal,len))<0){
+			sprintf(info,"bad SPS");
+		}else{
+			const H264_SPS *sps=&ctx->sps[id];
+			sprintf(info,"id:%d profile:%d level:%.1f %dx%d",id,sps->profile_idc,sps->level_idc/10.0,sps->width,sps->height);
+			if(sps->timing_info_present&&sps->num_units_in_tick)
+				sprintf(info+strlen(info)," fps:%.3f",sps->time_scale/(2.0*sps->num_units_in_tick));
+		}
+		break;
+	case NALU_TYPE_PPS:
+		if((id=h264_parse_pps(ctx,nal,len))<0)
+			sprintf(info,"bad PPS");
+		else
+			sprintf(info,"id:%d sps:%d %s",id,ctx->pps[id].sps_id,ctx->pps[id].entropy_coding_mode?"CABAC":"CAVLC");
+		break;
+	case NALU_TYPE_SLICE:
+	case NALU_TYPE_IDR:
+		if(h264_parse_slice(ctx,nal,len,&slice)<0){
+			sprintf(info,"bad slice header");
+		}else{
+			sprintf(info,"%s frame_num:%d poc:%d",slice_str[slice.slice_type],slice.frame_num,slice.poc);
+			if(slice.first_mb_in_slice)
+				sprintf(info+strlen(info)," first_mb:%d",slice.first_mb_in_slice);
+		}
+		break;
+	}
 }
 
 /**
@@ -163,13 +797,13 @@ int GetAnnexbNALU (NALU_t *nalu){
 int simplest_h264_parser(char *url){
 
 	NALU_t *n;
-	int buffersize=100000;
+	H264_CONTEXT *ctx;
+	char info[128];
 
 	//FILE *myout=fopen("output_log.txt","wb+");
 	FILE *myout=stdout;
 
-	h264bitstream=fopen(url, "rb+");
-	if (h264bitstream==NULL){
+	if (h264_scanner_open(&h264scanner,url)<0){
 		printf("Open file error\n");
 		return 0;
 	}
@@ -180,24 +814,22 @@ int simplest_h264_parser(char *url){
 		return 0;
 	}
 
-	n->max_size=buffersize;
-	n->buf = (char*)calloc (buffersize, sizeof (char));
-	if (n->buf == NULL){
+	ctx = (H264_CONTEXT*)calloc (1, sizeof (H264_CONTEXT));
+	if (ctx == NULL){
 		free (n);
-		printf ("AllocNALU: n->buf");
+		printf("Alloc H264 Context Error\n");
 		return 0;
 	}
 
-	int data_offset=0;
+	long long data_offset=0;
 	int nal_num=0;
-	printf("-----+-------- NALU Table ------+---------+\n");
-	printf(" NUM |    POS  |    IDC |  TYPE |   LEN   |\n");
-	printf("-----+---------+--------+-------+---------+\n");
+	printf("-----+-------- NALU Table ------+---------+---------------\n");
+	printf(" NUM |    POS  |    IDC |  TYPE |   LEN   | INFO\n");
+	printf("-----+---------+--------+-------+---------+---------------\n");
 
-	while(!feof(h264bitstream)) 
+	int data_lenth;
+	while((data_lenth=GetAnnexbNALU(n))>0) 
 	{
-		int data_lenth;
-		data_lenth=GetAnnexbNALU(n);
 
 		char type_str[20]={0};
 		switch(n->nal_unit_type){
@@ -222,7 +854,8 @@ int simplest_h264_parser(char *url){
 			case NALU_PRIORITY_HIGHEST:sprintf(idc_str,"HIGHEST");break;
 		}
 
-		fprintf(myout,"%5d| %8d| %7s| %6s| %8d|\n",nal_num,data_offset,idc_str,type_str,n->len);
+		h264_describe(ctx,(const unsigned char *)n->buf,n->len,info);
+		fprintf(myout,"%5d| %8lld| %7s| %6s| %8d| %s\n",nal_num,data_offset,idc_str,type_str,n->len,info);
 
 		data_offset=data_offset+data_lenth;
 
@@ -230,13 +863,1107 @@ int simplest_h264_parser(char *url){
 	}
 
 	//Free
+	h264_scanner_close(&h264scanner);
+	free (ctx);
 	if (n){
-		if (n->buf){
-			free(n->buf);
-			n->buf=NULL;
-		}
 		free (n);
 	}
 	return 0;
 }
 
+/**
+ * One record of NALU index.
+ */
+typedef struct
+{
+	long long offset;             //! Offset of the start code in file
+	unsigned len;                 //! Length of the NAL unit (Excluding the start code)
+	unsigned char startcodeprefix_len;
+	unsigned char nal_reference_idc;  //! 0..3
+	unsigned char nal_unit_type;
+	unsigned char flags;          //! NALU_FLAG_xxx
+} NALU_ENTRY;
+
+//Slice with first_mb_in_slice 0
+#define NALU_FLAG_FIRST_MB_ZERO 0x01
+
+typedef struct
+{
+	NALU_ENTRY *entry;
+	int num;
+	int size;
+} NALU_INDEX;
+
+static NALU_ENTRY *nalu_index_add(NALU_INDEX *index){
+	if(index->num==index->size){
+		index->size=index->size?index->size*2:1024;
+		index->entry=(NALU_ENTRY *)realloc(index->entry,index->size*sizeof(NALU_ENTRY));
+	}
+	return &index->entry[index->num++];
+}
+
+static void nalu_index_free(NALU_INDEX *index){
+	free(index->entry);
+	memset(index,0,sizeof(NALU_INDEX));
+}
+
+/**
+ * Build NALU index of H.264 file. The mapped file is cut into chunks
+ * which are searched for start codes by several threads. A NALU ends at
+ * the next start code, so NALUs crossing chunk borders need no special
+ * care once the start codes of all chunks are put together.
+ * @param start   Offset of a start code to index from (0 for the whole file).
+ * @param chunks  Output number of chunks (1 if the file can not be mapped).
+ */
+static int h264_index_build(const char *url,long long start,NALU_INDEX *index,int *chunks){
+	unsigned char *data=NULL;
+	long long size=0,total=0,**pos=NULL,*all=NULL;
+	int *num=NULL,c=0,i=0;
+
+	memset(index,0,sizeof(NALU_INDEX));
+	*chunks=1;
+	if((data=simplest_map_file(url,&size))==NULL){
+		//Sequential scan when the file can not be mapped
+		H264_SCANNER s;
+		NALU_VIEW v;
+		if(h264_scanner_open(&s,url)<0)
+			return -1;
+		if(s.fp!=NULL&&start>0){
+			simplest_fseek64(s.fp,start,SEEK_SET);
+			s.pos=s.scan=s.buf_offset=start;
+		}
+		while(h264_scanner_next(&s,&v)){
+			NALU_ENTRY *e=nalu_index_add(index);
+			e->offset=v.offset;
+			e->len=v.len;
+			e->startcodeprefix_len=(unsigned char)v.startcodeprefix_len;
+			e->nal_reference_idc=(unsigned char)(v.nal_reference_idc>>5);
+			e->nal_unit_type=(unsigned char)v.nal_unit_type;
+			e->flags=(v.len>1&&(v.data[1]&0x80))?NALU_FLAG_FIRST_MB_ZERO:0;
+		}
+		h264_scanner_close(&s);
+		return 0;
+	}
+
+	if(start>size)
+		start=size;
+	*chunks=(int)((size-start+H264_INDEX_CHUNK-1)/H264_INDEX_CHUNK);
+	pos=(long long **)calloc(*chunks,sizeof(long long *));
+	num=(int *)calloc(*chunks,sizeof(int));
+
+#pragma omp parallel for schedule(dynamic)
+	for(c=0;c<*chunks;c++){
+		long long begin=start+(long long)c*H264_INDEX_CHUNK;
+		//A start code beginning in this chunk may end in the next one
+		long long search_end=begin+H264_INDEX_CHUNK+2<size?begin+H264_INDEX_CHUNK+2:size;
+		const unsigned char *p=data+begin,*end=data+search_end;
+		int cap=0;
+		while((p=h264_find_startcode(p,end))!=end){
+			if(num[c]==cap){
+				cap=cap?cap*2:1024;
+				pos[c]=(long long *)realloc(pos[c],cap*sizeof(long long));
+			}
+			pos[c][num[c]++]=p-data;
+			p+=3;
+		}
+	}
+
+	for(c=0;c<*chunks;c++)
+		total+=num[c];
+	all=(long long *)malloc((total+1)*sizeof(long long));
+	total=0;
+	for(c=0;c<*chunks;c++){
+		//Chunks without start code have no array
+		if(num[c]>0)
+			memcpy(all+total,pos[c],num[c]*sizeof(long long));
+		total+=num[c];
+		free(pos[c]);
+	}
+	all[total]=size;
+	free(pos);
+	free(num);
+
+	index->num=index->size=(int)total;
+	index->entry=(NALU_ENTRY *)malloc((total?total:1)*sizeof(NALU_ENTRY));
+#pragma omp parallel for schedule(static)
+	for(i=0;i<(int)total;i++){
+		NALU_ENTRY *e=&index->entry[i];
+		long long sc=all[i],nal_end=all[i+1];
+		//0x00000001: the zero belongs to the next start code
+		if(i+1<total&&data[nal_end-1]==0)
+			nal_end--;
+		e->startcodeprefix_len=(sc>0&&data[sc-1]==0)?4:3;
+		e->offset=sc-(e->startcodeprefix_len-3);
+		e->len=(unsigned)(nal_end-sc-3);
+		e->nal_reference_idc=e->len?(data[sc+3]>>5)&3:0;
+		e->nal_unit_type=e->len?data[sc+3]&0x1f:0;
+		//ue(v) of first_mb_in_slice is 0 if its first bit is 1
+		e->flags=(e->len>1&&(data[sc+4]&0x80))?NALU_FLAG_FIRST_MB_ZERO:0;
+	}
+	free(all);
+	simplest_unmap_file(data,size);
+	return 0;
+}
+
+/**
+ * Sidecar index (<file>.h264idx): H264IDX_HEADER followed by one
+ * H264IDX_ENTRY per NALU. It is valid while size and mtime of the
+ * H.264 file stay the same. If the file only grew, the last access
+ * unit is indexed again together with the new data.
+ */
+typedef struct
+{
+	char tag[4];                  //! "HIDX"
+	unsigned version;
+	unsigned entry_size;
+	unsigned num;                 //! Number of entries
+	long long file_size;          //! Size of indexed file
+	long long file_mtime;         //! Modification time of indexed file
+	unsigned long long tail_hash; //! FNV-1a of the bytes before the last access unit
+	unsigned frames;              //! Number of access units
+	unsigned reserved;
+} H264IDX_HEADER;
+
+typedef struct
+{
+	long long offset;             //! Offset of the start code in file
+	unsigned len;                 //! Length of the NAL unit (Excluding the start code)
+	unsigned frame;               //! Access unit number in decoding order
+	unsigned char startcodeprefix_len;
+	unsigned char nal_unit_type;
+	unsigned char nal_reference_idc;
+	unsigned char flags;          //! H264IDX_IDR, H264IDX_AU_START
+	unsigned reserved;
+} H264IDX_ENTRY;
+
+static unsigned long long h264idx_tail_hash(FILE *fp,long long end){
+	unsigned char buf[H264IDX_HASH_BYTES];
+	unsigned long long hash=14695981039346656037ULL;
+	long long start=end>H264IDX_HASH_BYTES?end-H264IDX_HASH_BYTES:0;
+	long long n=simplest_pread(fp,buf,end-start,start),i=0;
+	for(i=0;i<n;i++){
+		hash^=buf[i];
+		hash*=1099511628211ULL;
+	}
+	return hash;
+}
+
+//Access unit starts at a slice with first_mb_in_slice 0, or at the AUD/SPS/PPS/SEI before it
+static int h264idx_is_au_prefix(int type){
+	return type==NALU_TYPE_SEI||type==NALU_TYPE_SPS||type==NALU_TYPE_PPS||type==NALU_TYPE_AUD||(type>=14&&type<=18);
+}
+
+/**
+ * Label NALUs with access unit numbers, starting from first_frame.
+ * @return  Number of access units including first_frame.
+ */
+static unsigned h264idx_label(const NALU_INDEX *index,H264IDX_ENTRY *out,unsigned first_frame){
+	unsigned frame=first_frame;
+	int started=0,pending=-1,i=0,j=0;
+
+	for(i=0;i<index->num;i++){
+		const NALU_ENTRY *e=&index->entry[i];
+		H264IDX_ENTRY *o=&out[i];
+		memset(o,0,sizeof(H264IDX_ENTRY));
+		o->offset=e->offset;
+		o->len=e->len;
+		o->startcodeprefix_len=e->startcodeprefix_len;
+		o->nal_unit_type=e->nal_unit_type;
+		o->nal_reference_idc=e->nal_reference_idc;
+		if(e->nal_unit_type==NALU_TYPE_IDR)
+			o->flags|=H264IDX_IDR;
+
+		if(h264idx_is_au_prefix(e->nal_unit_type)){
+			if(pending<0)
+				pending=i;
+			continue;
+		}
+		if(e->nal_unit_type>=NALU_TYPE_SLICE&&e->nal_unit_type<=NALU_TYPE_IDR){
+			int start=pending>=0?pending:i;
+			if((e->flags&NALU_FLAG_FIRST_MB_ZERO)||!started){
+				if(started)
+					frame++;
+				started=1;
+				out[start].flags|=H264IDX_AU_START;
+			}
+			for(j=start;j<=i;j++)
+				out[j].frame=frame;
+			pending=-1;
+		}else{
+			o->frame=frame;
+		}
+	}
+	//Parameter sets at the end open the next access unit
+	if(pending>=0){
+		if(started)
+			frame++;
+		out[pending].flags|=H264IDX_AU_START;
+		for(j=pending;j<index->num;j++)
+			out[j].frame=frame;
+	}
+	return index->num?frame+1:first_frame;
+}
+
+/**
+ * Open sidecar index of H.264 file, building or updating it if needed.
+ * @param status  Output, "up to date", "updated" or "built".
+ * @return        Mapped index (entries follow the header), NULL on error.
+ */
+static H264IDX_HEADER *h264idx_open(const char *url,long long *map_size,const char **status){
+	char idxpath[1024],tmppath[1040];
+	long long size=0,mtime=0,resume=0;
+	unsigned char *map=NULL;
+	H264IDX_HEADER *h=NULL,header;
+	H264IDX_ENTRY *entry=NULL,*out=NULL;
+	NALU_INDEX index;
+	unsigned keep=0,first_frame=0;
+	int chunks=0;
+	FILE *fp=NULL,*fp_idx=NULL;
+
+	if(strlen(url)+16>sizeof(idxpath)||simplest_file_stat(url,&size,&mtime)<0)
+		return NULL;
+	sprintf(idxpath,"%s.h264idx",url);
+	sprintf(tmppath,"%s.tmp",idxpath);
+
+	map=simplest_map_file(idxpath,map_size);
+	h=(H264IDX_HEADER *)map;
+	if(h!=NULL&&(*map_size<(long long)sizeof(H264IDX_HEADER)||memcmp(h->tag,"HIDX",4)!=0||h->version!=H264IDX_VERSION
+		||h->entry_size!=sizeof(H264IDX_ENTRY)||*map_size!=(long long)(sizeof(H264IDX_HEADER)+(long long)h->num*sizeof(H264IDX_ENTRY)))){
+		simplest_unmap_file(map,*map_size);
+		map=NULL;
+		h=NULL;
+	}
+	if(h!=NULL&&h->file_size==size&&h->file_mtime==mtime){
+		*status="up to date";
+		return h;
+	}
+	if((fp=fopen(url,"rb"))==NULL){
+		simplest_unmap_file(map,*map_size);
+		return NULL;
+	}
+
+	//The file grew: keep everything before its last access unit if the bytes there are unchanged.
+	//Same size with a new mtime means it was rewritten in place, so build it again
+	if(h!=NULL&&h->num>0&&size>h->file_size){
+		entry=(H264IDX_ENTRY *)(h+1);
+		keep=h->num;
+		while(keep>0&&entry[keep-1].frame==entry[h->num-1].frame)
+			keep--;
+		resume=keep<h->num?entry[keep].offset:0;
+		if(h264idx_tail_hash(fp,resume)==h->tail_hash){
+			first_frame=entry[h->num-1].frame;
+		}else{
+			keep=0;
+			resume=0;
+		}
+	}
+	*status=keep>0?"updated":"built";
+
+	if(h264_index_build(url,resume,&index,&chunks)<0){
+		simplest_unmap_file(map,*map_size);
+		fclose(fp);
+		return NULL;
+	}
+	out=(H264IDX_ENTRY *)malloc((index.num?index.num:1)*sizeof(H264IDX_ENTRY));
+	memset(&header,0,sizeof(header));
+	memcpy(header.tag,"HIDX",4);
+	header.version=H264IDX_VERSION;
+	header.entry_size=sizeof(H264IDX_ENTRY);
+	header.num=keep+index.num;
+	header.file_size=size;
+	header.file_mtime=mtime;
+	header.frames=h264idx_label(&index,out,first_frame);
+	if(index.num==0&&keep>0)
+		header.frames=entry[keep-1].frame+1;
+	//Hash the bytes before the last access unit, for the next update
+	{
+		unsigned last=index.num;
+		while(last>0&&out[last-1].frame==out[index.num-1].frame)
+			last--;
+		resume=index.num==0?0:(last<(unsigned)index.num?out[last].offset:0);
+		header.tail_hash=h264idx_tail_hash(fp,resume);
+	}
+	fclose(fp);
+
+	if((fp_idx=fopen(tmppath,"wb"))!=NULL){
+		fwrite(&header,sizeof(header),1,fp_idx);
+		if(keep>0)
+			fwrite(entry,sizeof(H264IDX_ENTRY),keep,fp_idx);
+		fwrite(out,sizeof(H264IDX_ENTRY),index.num,fp_idx);
+		fclose(fp_idx);
+	}
+	free(out);
+	nalu_index_free(&index);
+	simplest_unmap_file(map,*map_size);
+	if(fp_idx==NULL)
+		return NULL;
+	remove(idxpath);
+	rename(tmppath,idxpath);
+
+	return (H264IDX_HEADER *)simplest_map_file(idxpath,map_size);
+}
+
+/**
+ * First entry of the access unit frame (entries are sorted by frame).
+ */
+static unsigned h264idx_find_frame(const H264IDX_HEADER *h,unsigned frame){
+	const H264IDX_ENTRY *entry=(const H264IDX_ENTRY *)(h+1);
+	unsigned lo=0,hi=h->num;
+	while(lo<hi){
+		unsigned mid=lo+(hi-lo)/2;
+		if(entry[mid].frame<frame)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return lo;
+}
+
+/**
+ * Parse the SPS or PPS of an index entry, and remember the entry as the
+ * last parameter set of its id.
+ * @param active  Entry of the last SPS (0-31) and PPS (32+id) of each id.
+ * @return  Parameter set id, or -1 if the entry is not a valid SPS/PPS.
+ */
+static int h264idx_track_param(H264_CONTEXT *ctx,FILE *fp,const H264IDX_ENTRY *entry,int i,int *active){
+	unsigned char nal[H264_HEADER_MAX];
+	const H264IDX_ENTRY *e=&entry[i];
+	int n=e->len<H264_HEADER_MAX?e->len:H264_HEADER_MAX,id=-1;
+
+	if(e->nal_unit_type!=NALU_TYPE_SPS&&e->nal_unit_type!=NALU_TYPE_PPS)
+		return -1;
+	if(simplest_pread(fp,nal,n,e->offset+e->startcodeprefix_len)!=n)
+		return -1;
+	if(e->nal_unit_type==NALU_TYPE_SPS){
+		if((id=h264_parse_sps(ctx,nal,n))>=0)
+			active[id]=i;
+	}else if((id=h264_parse_pps(ctx,nal,n))>=0){
+		active[32+id]=i;
+	}
+	return id;
+}
+
+/**
+ * Parameter sets a stream starting at entry first has to carry: the last
+ * ones of each id sent before it. The ones sent again inside the access
+ * unit (at first or later) are already in the stream.
+ * @param carry   Output, index entries to write before the stream.
+ * @return  Number of entries in carry.
+ */
+static int h264idx_carry(const int *active,int first,int *carry){
+	int j=0,num=0;
+	for(j=0;j<32+256;j++){
+		if(active[j]>=0&&active[j]<first)
+			carry[num++]=active[j];
+	}
+	return num;
+}
+
+/**
+ * Extract frames from H.264 file, starting at the nearest IDR access unit at
+ * or before the given frame. The SPS/PPS sent before that access unit are
+ * written first, so the output can be decoded alone. The sidecar index is
+ * used (and built if needed).
+ * @param url         Location of input H.264 bitstream file.
+ * @param frame       First frame wanted (decoding order).
+ * @param num_frames  Number of frames wanted after it.
+ * @param url_out     Location of Output H.264 file.
+ */
+int simplest_h264_seek(char *url,int frame,int num_frames,const char *url_out){
+	long long map_size=0,start=0,end=0;
+	const char *status=NULL;
+	H264IDX_HEADER *h=h264idx_open(url,&map_size,&status);
+	const H264IDX_ENTRY *entry=NULL;
+	H264_CONTEXT *ctx=NULL;
+	int active[32+256];           //Index entry of the last SPS/PPS of each id
+	int carry[32+256];
+	unsigned i=0,first=0,idr=0,idr_frame=0,last=0;
+	int j=0,num_carry=0,ret=0;
+	FILE *fp=NULL,*fp_out=NULL;
+
+	if(h==NULL){
+		printf("Error: Cannot index %s.\n",url);
+		return -1;
+	}
+	entry=(const H264IDX_ENTRY *)(h+1);
+	if(frame<0||(unsigned)frame>=h->frames||num_frames<1){
+		printf("Error: Frame %d out of range (%u frames).\n",frame,h->frames);
+		simplest_unmap_file((unsigned char *)h,map_size);
+		return -1;
+	}
+
+	//Walk back from the frame to the nearest IDR
+	i=h264idx_find_frame(h,frame+1);
+	while(i>0&&!(entry[i-1].flags&H264IDX_IDR))
+		i--;
+	if(i==0){
+		printf("Error: No IDR before frame %d.\n",frame);
+		simplest_unmap_file((unsigned char *)h,map_size);
+		return -1;
+	}
+	idr=i-1;
+	idr_frame=entry[idr].frame;
+	first=h264idx_find_frame(h,idr_frame);
+	start=entry[first].offset;
+	last=h264idx_find_frame(h,frame+num_frames);
+	end=last<h->num?entry[last].offset:h->file_size;
+
+	if((fp=fopen(url,"rb"))==NULL||(fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot open file.\n");
+		if(fp)
+			fclose(fp);
+		simplest_unmap_file((unsigned char *)h,map_size);
+		return -1;
+	}
+
+	//Parameter sets up to the IDR slice, including the ones of its access unit
+	ctx=(H264_CONTEXT *)calloc(1,sizeof(H264_CONTEXT));
+	for(j=0;j<32+256;j++)
+		active[j]=-1;
+	for(i=0;i<idr;i++)
+		h264idx_track_param(ctx,fp,entry,i,active);
+	num_carry=h264idx_carry(active,first,carry);
+	for(j=0;j<num_carry;j++){
+		const H264IDX_ENTRY *e=&entry[carry[j]];
+		simplest_copy_range(fp,e->offset,e->startcodeprefix_len+e->len,fp_out);
+	}
+	printf("Index:%s Frame:%d IDR Frame:%u Offset:%lld Size:%lld Carried SPS/PPS:%d\n",status,frame,idr_frame,start,end-start,num_carry);
+	if(simplest_copy_range(fp,start,end-start,fp_out)!=end-start){
+		printf("Error: Cannot write %s.\n",url_out);
+		ret=-1;
+	}
+	free(ctx);
+	fclose(fp);
+	fclose(fp_out);
+	simplest_unmap_file((unsigned char *)h,map_size);
+	return ret;
+}
+
+/**
+ * One output segment of simplest_h264_split().
+ */
+typedef struct
+{
+	unsigned first_frame;
+	unsigned frames;
+	long long start;              //! Offset of the first access unit
+	long long end;
+	int num_carry;
+	int carry[32+256];            //! Index entries of SPS/PPS sent before the segment
+} H264_SEGMENT;
+
+/**
+ * Split H.264 file at IDR access units into segments of at least the given
+ * duration. Each segment starts with the SPS/PPS it needs, so it can be
+ * decoded alone. Segments are written in parallel without re-encoding.
+ * Frames before the first IDR cannot be decoded alone, they are left out.
+ * @param url         Location of input H.264 bitstream file.
+ * @param seconds     Minimum segment duration, 0 to split at every IDR.
+ * @param fps         Frame rate used if SPS has no timing info.
+ * @param url_out     Prefix of output files, <prefix>NNN.h264.
+ */
+int simplest_h264_split(char *url,double seconds,double fps,const char *url_out){
+	long long map_size=0;
+	const char *status=NULL;
+	H264IDX_HEADER *h=h264idx_open(url,&map_size,&status);
+	const H264IDX_ENTRY *entry=NULL;
+	H264_CONTEXT *ctx=NULL;
+	H264_SEGMENT *seg=NULL;
+	int active[32+256];           //Index entry of the last SPS/PPS of each id
+	int num_seg=0,size_seg=0,fps_known=0,failed=0,i=0,k=0;
+	FILE *fp=NULL;
+
+	if(h==NULL||(fp=fopen(url,"rb"))==NULL){
+		printf("Error: Cannot index %s.\n",url);
+		if(h)
+			simplest_unmap_file((unsigned char *)h,map_size);
+		return -1;
+	}
+	entry=(const H264IDX_ENTRY *)(h+1);
+	ctx=(H264_CONTEXT *)calloc(1,sizeof(H264_CONTEXT));
+	if(fps<=0)
+		fps=25;
+	for(i=0;i<32+256;i++)
+		active[i]=-1;
+
+	for(i=0;i<(int)h->num;i++){
+		const H264IDX_ENTRY *e=&entry[i];
+		int first=0;
+		if(e->nal_unit_type==NALU_TYPE_SPS||e->nal_unit_type==NALU_TYPE_PPS){
+			int id=h264idx_track_param(ctx,fp,entry,i,active);
+			if(e->nal_unit_type==NALU_TYPE_SPS&&id>=0){
+				if(!fps_known&&ctx->sps[id].timing_info_present&&ctx->sps[id].num_units_in_tick)
+					fps=ctx->sps[id].time_scale/(2.0*ctx->sps[id].num_units_in_tick);
+				fps_known=1;
+			}
+			continue;
+		}
+		if(!(e->flags&H264IDX_IDR))
+			continue;
+		if(num_seg>0&&(e->frame==seg[num_seg-1].first_frame||e->frame-seg[num_seg-1].first_frame<seconds*fps))
+			continue;
+
+		//A new segment starts with the access unit of this IDR
+		if(num_seg==size_seg){
+			size_seg=size_seg?size_seg*2:64;
+			seg=(H264_SEGMENT *)realloc(seg,size_seg*sizeof(H264_SEGMENT));
+		}
+		first=(int)h264idx_find_frame(h,e->frame);
+		seg[num_seg].first_frame=e->frame;
+		seg[num_seg].start=entry[first].offset;
+		seg[num_seg].num_carry=h264idx_carry(active,first,seg[num_seg].carry);
+		if(num_seg>0){
+			seg[num_seg-1].end=seg[num_seg].start;
+			seg[num_seg-1].frames=e->frame-seg[num_seg-1].first_frame;
+		}
+		num_seg++;
+	}
+	fclose(fp);
+	if(num_seg>0){
+		seg[num_seg-1].end=h->file_size;
+		seg[num_seg-1].frames=h->frames-seg[num_seg-1].first_frame;
+	}
+
+#pragma omp parallel for schedule(dynamic) reduction(+:failed)
+	for(k=0;k<num_seg;k++){
+		char path[1024];
+		FILE *fp_in=NULL,*fp_out=NULL;
+		int j=0;
+		sprintf(path,"%.1000s%03d.h264",url_out,k);
+		if((fp_in=fopen(url,"rb"))==NULL||(fp_out=fopen(path,"wb"))==NULL){
+			if(fp_in)
+				fclose(fp_in);
+			failed++;
+			continue;
+		}
+		for(j=0;j<seg[k].num_carry;j++){
+			const H264IDX_ENTRY *e=&entry[seg[k].carry[j]];
+			simplest_copy_range(fp_in,e->offset,e->startcodeprefix_len+e->len,fp_out);
+		}
+		if(simplest_copy_range(fp_in,seg[k].start,seg[k].end-seg[k].start,fp_out)!=seg[k].end-seg[k].start)
+			failed++;
+		fclose(fp_in);
+		fclose(fp_out);
+	}
+
+	printf("Index:%s FPS:%.3f Segments:%d\n",status,fps,num_seg);
+	for(k=0;k<num_seg;k++){
+		printf("%3d| Frame:%6u Frames:%5u Offset:%10lld Size:%9lld Carried SPS/PPS:%d\n",k,seg[k].first_frame,seg[k].frames,
+			seg[k].start,seg[k].end-seg[k].start,seg[k].num_carry);
+	}
+	if(num_seg==0)
+		printf("Error: No IDR access unit, nothing to split.\n");
+	else if(seg[0].first_frame>0)
+		printf("Warning: %u frames before the first IDR are left out.\n",seg[0].first_frame);
+	if(failed)
+		printf("Error: %d segments not written.\n",failed);
+
+	free(seg);
+	free(ctx);
+	simplest_unmap_file((unsigned char *)h,map_size);
+	return failed||num_seg==0?-1:0;
+}
+
+/**
+ * Count, min, max, mean and variance (Welford) of frame sizes.
+ */
+typedef struct
+{
+	int count;
+	long long min;
+	long long max;
+	double mean;
+	double m2;
+} H264_SIZE_STAT;
+
+static void h264_size_stat_add(H264_SIZE_STAT *s,long long v){
+	double d=v-s->mean;
+	if(s->count==0||v<s->min)
+		s->min=v;
+	if(s->count==0||v>s->max)
+		s->max=v;
+	s->count++;
+	s->mean+=d/s->count;
+	s->m2+=d*(v-s->mean);
+}
+
+/**
+ * Access unit being assembled, and statistics of finished ones.
+ */
+typedef struct
+{
+	//Current access unit
+	int has_slice;
+	H264_SLICE first;             //! First slice of the primary picture
+	int first_ref_idc;
+	int slice_types;              //! Bit (1<<slice_type) for each slice
+	long long bytes;
+	//Statistics
+	double fps;
+	long long frames;
+	long long total_bytes;
+	H264_SIZE_STAT size[3];       //! I, P, B
+	int gop_len;                  //! Frames since the last IDR, -1 before the first IDR
+	int gop_expected;
+	int gop_count;
+	int gop_min;
+	int gop_max;
+	int gop_violations;
+	long long second;             //! Current second
+	long long second_bytes;
+	long long second_min;
+	long long second_max;
+	FILE *fp_csv;
+} H264_AU_STAT;
+
+//7.4.1.2.4 of H.264: first VCL NALU of a new primary coded picture
+static int h264_new_picture(const H264_SLICE *a,int a_ref,const H264_SLICE *b,int b_ref){
+	if(b->first_mb_in_slice==0)
+		return 1;
+	if(a->frame_num!=b->frame_num||a->pps_id!=b->pps_id||a->field_pic!=b->field_pic||a->bottom_field!=b->bottom_field)
+		return 1;
+	if((a_ref==0)!=(b_ref==0)||a->idr!=b->idr||(a->idr&&a->idr_pic_id!=b->idr_pic_id))
+		return 1;
+	if(a->poc_lsb!=b->poc_lsb||a->delta_poc_bottom!=b->delta_poc_bottom||a->delta_poc[0]!=b->delta_poc[0]||a->delta_poc[1]!=b->delta_poc[1])
+		return 1;
+	return 0;
+}
+
+//partial: the last second of stream, not counted in min/max
+static void h264_flush_second(H264_AU_STAT *st,int partial){
+	if(st->second<0)
+		return;
+	if(st->fp_csv)
+		fprintf(st->fp_csv,"%lld,%.1f\n",st->second,st->second_bytes*8/1000.0);
+	if(partial&&st->second>0)
+		return;
+	if(st->second==0||st->second_bytes<st->second_min)
+		st->second_min=st->second_bytes;
+	if(st->second_bytes>st->second_max)
+		st->second_max=st->second_bytes;
+	st->second_bytes=0;
+}
+
+static void h264_finish_au(H264_AU_STAT *st){
+	long long sec=0;
+	int type=0;
+
+	if(!st->has_slice)
+		return;
+	//B if any slice is B, else P if any slice is P (or SP), else I
+	if(st->slice_types&(1<<1))
+		type=2;
+	else if(st->slice_types&((1<<0)|(1<<3)))
+		type=1;
+	h264_size_stat_add(&st->size[type],st->bytes);
+
+	if(st->first.idr){
+		if(st->gop_len>0){
+			if(st->gop_count==0||st->gop_len<st->gop_min)
+				st->gop_min=st->gop_len;
+			if(st->gop_len>st->gop_max)
+				st->gop_max=st->gop_len;
+			if(st->gop_expected==0)
+				st->gop_expected=st->gop_len;
+			else if(st->gop_len!=st->gop_expected)
+				st->gop_violations++;
+			st->gop_count++;
+		}
+		st->gop_len=0;
+	}
+	if(st->gop_len>=0)
+		st->gop_len++;
+
+	sec=(long long)(st->frames/st->fps);
+	if(sec!=st->second){
+		h264_flush_second(st,0);
+		st->second=sec;
+	}
+	st->second_bytes+=st->bytes;
+	st->total_bytes+=st->bytes;
+	st->frames++;
+
+	st->has_slice=0;
+	st->slice_types=0;
+	st->bytes=0;
+}
+
+/**
+ * Assemble access units of H.264 file in one pass, and print frame size,
+ * bitrate and GOP statistics. Memory use does not depend on file size.
+ * @param url       Location of input H.264 bitstream file.
+ * @param fps       Frame rate used if SPS has no timing info.
+ * @param gop       Expected GOP length, 0 to take the length of the first GOP.
+ * @param url_out   Location of Output per-second bitrate CSV file, or NULL.
+ */
+int simplest_h264_stat(char *url,double fps,int gop,const char *url_out){
+	const char *type_str[3]={"I","P","B"};
+	H264_SCANNER s;
+	NALU_VIEW v;
+	H264_CONTEXT *ctx=NULL;
+	H264_AU_STAT st;
+	H264_SLICE slice;
+	int i=0;
+
+	if(h264_scanner_open(&s,url)<0){
+		printf("Open file error\n");
+		return -1;
+	}
+	ctx=(H264_CONTEXT *)calloc(1,sizeof(H264_CONTEXT));
+	memset(&st,0,sizeof(st));
+	st.fps=fps>0?fps:25;
+	st.gop_len=-1;
+	st.gop_expected=gop;
+	st.second=-1;
+	if(url_out!=NULL&&(st.fp_csv=fopen(url_out,"wb"))!=NULL)
+		fprintf(st.fp_csv,"second,kbps\n");
+
+	while(h264_scanner_next(&s,&v)){
+		int type=v.nal_unit_type,bytes=v.startcodeprefix_len+v.len;
+		if(v.len<2){
+			st.bytes+=bytes;
+			continue;
+		}
+		if(h264idx_is_au_prefix(type)){
+			//AUD/SPS/PPS/SEI after a picture start the next access unit
+			h264_finish_au(&st);
+			if(type==NALU_TYPE_SPS){
+				int id=h264_parse_sps(ctx,v.data,v.len);
+				if(id>=0&&ctx->sps[id].timing_info_present&&ctx->sps[id].num_units_in_tick&&st.frames==0)
+					st.fps=ctx->sps[id].time_scale/(2.0*ctx->sps[id].num_units_in_tick);
+			}else if(type==NALU_TYPE_PPS){
+				h264_parse_pps(ctx,v.data,v.len);
+			}
+		}else if(type>=NALU_TYPE_SLICE&&type<=NALU_TYPE_IDR){
+			int ref_idc=v.nal_reference_idc>>5;
+			if(h264_parse_slice(ctx,v.data,v.len,&slice)<0){
+				st.bytes+=bytes;
+				continue;
+			}
+			if(st.has_slice&&h264_new_picture(&st.first,st.first_ref_idc,&slice,ref_idc))
+				h264_finish_au(&st);
+			if(!st.has_slice){
+				st.first=slice;
+				st.first_ref_idc=ref_idc;
+				st.has_slice=1;
+			}
+			st.slice_types|=1<<slice.slice_type;
+		}
+		st.bytes+=bytes;
+	}
+	h264_finish_au(&st);
+	h264_flush_second(&st,(st.second+1)*st.fps>st.frames+0.5);
+
+	printf("Frames:%lld FPS:%.3f Duration:%.3fs Bitrate:%.1fkbps\n",st.frames,st.fps,st.frames/st.fps,
+		st.frames?st.total_bytes*8/1000.0*st.fps/st.frames:0.0);
+	printf("Per-second Bitrate: min %.1fkbps max %.1fkbps\n",st.second_min*8/1000.0,st.second_max*8/1000.0);
+	for(i=0;i<3;i++){
+		const H264_SIZE_STAT *z=&st.size[i];
+		if(z->count==0)
+			continue;
+		printf("%s Frames:%6d Size min %8lld avg %10.1f max %8lld stddev %10.1f\n",type_str[i],z->count,z->min,z->mean,z->max,
+			z->count>1?sqrt(z->m2/(z->count-1)):0.0);
+	}
+	printf("GOP Cnt:%d Length min %d max %d expected %d Violations:%d\n",st.gop_count,st.gop_min,st.gop_max,st.gop_expected,
+		st.gop_violations);
+
+	if(st.fp_csv)
+		fclose(st.fp_csv);
+	free(ctx);
+	h264_scanner_close(&s);
+	return 0;
+}
+
+/**
+ * Pending scatter-gather write: length/start code headers and pointers
+ * to the NALU payloads in the mapped file.
+ */
+typedef struct
+{
+	const void *base[2*H264_IOV_BATCH];
+	long long len[2*H264_IOV_BATCH];
+	unsigned char header[H264_IOV_BATCH][4];
+	int num;
+} H264_IOV;
+
+//Write the pending buffers, return -1 on write error
+static int h264_iov_flush(FILE *fp,H264_IOV *iov){
+	long long w=0;
+	if(iov->num>0)
+		w=simplest_writev(fp,iov->base,iov->len,iov->num);
+	iov->num=0;
+	return w<0?-1:0;
+}
+
+//Queue a 4 byte header (copied) and a payload (referenced), return -1 on write error
+static int h264_iov_add(FILE *fp,H264_IOV *iov,const unsigned char *header,const unsigned char *data,long long len){
+	unsigned char *h=iov->header[iov->num/2];
+	memcpy(h,header,4);
+	iov->base[iov->num]=h;
+	iov->len[iov->num]=4;
+	iov->base[iov->num+1]=data;
+	iov->len[iov->num+1]=len;
+	iov->num+=2;
+	if(iov->num==2*H264_IOV_BATCH)
+		return h264_iov_flush(fp,iov);
+	return 0;
+}
+
+/**
+ * Build AVCDecoderConfigurationRecord (avcC) from parameter sets.
+ * @return  Size of avcC in out.
+ */
+static int h264_build_avcc(H264_CONTEXT *ctx,unsigned char **ps,const int *ps_len,unsigned char *out){
+	const unsigned char *first=NULL;
+	const H264_SPS *sps=NULL;
+	int i=0,pos=6,num_sps=0,num_pps=0,pps_count=0;
+
+	//At most 31 SPS (5 bit count) and 255 PPS
+	for(i=0;i<32;i++){
+		if(ps[i]==NULL||num_sps==31)
+			continue;
+		if(first==NULL){
+			first=ps[i];
+			sps=&ctx->sps[i];
+		}
+		out[pos]=(unsigned char)(ps_len[i]>>8);
+		out[pos+1]=(unsigned char)ps_len[i];
+		memcpy(out+pos+2,ps[i],ps_len[i]);
+		pos+=2+ps_len[i];
+		num_sps++;
+	}
+	if(first==NULL)
+		return 0;
+	out[0]=1;                     //configurationVersion
+	out[1]=first[1];              //AVCProfileIndication
+	out[2]=first[2];              //profile_compatibility
+	out[3]=first[3];              //AVCLevelIndication
+	out[4]=0xFC|3;                //lengthSizeMinusOne
+	out[5]=(unsigned char)(0xE0|num_sps);
+	pps_count=pos++;
+	for(i=32;i<32+256;i++){
+		if(ps[i]==NULL||num_pps==255)
+			continue;
+		out[pos]=(unsigned char)(ps_len[i]>>8);
+		out[pos+1]=(unsigned char)ps_len[i];
+		memcpy(out+pos+2,ps[i],ps_len[i]);
+		pos+=2+ps_len[i];
+		num_pps++;
+	}
+	out[pps_count]=(unsigned char)num_pps;
+	//High profiles carry chroma format and bit depth
+	if(sps->profile_idc==100||sps->profile_idc==110||sps->profile_idc==122||sps->profile_idc==144){
+		out[pos++]=(unsigned char)(0xFC|sps->chroma_format_idc);
+		out[pos++]=(unsigned char)(0xF8|(sps->bit_depth_luma-8));
+		out[pos++]=(unsigned char)(0xF8|(sps->bit_depth_chroma-8));
+		out[pos++]=0;             //numOfSequenceParameterSetExt
+	}
+	return pos;
+}
+
+/**
+ * Convert H.264 Annex B stream to AVCC (4 byte big-endian NALU length
+ * instead of start code), as stored in MP4/FLV. Parameter sets stay in
+ * the stream, and are also written to avcC.
+ * @param url        Location of input H.264 Annex B file.
+ * @param url_out    Location of output AVCC file.
+ * @param url_avcc   Location of output avcC (AVCDecoderConfigurationRecord).
+ */
+int simplest_h264_annexb_to_avcc(char *url,const char *url_out,const char *url_avcc){
+	H264_SCANNER s;
+	NALU_VIEW v;
+	H264_CONTEXT *ctx=NULL;
+	H264_IOV *iov=NULL;
+	FILE *fp_out=NULL,*fp_avcc=NULL;
+	unsigned char *ps[32+256]={0};        //SPS by id, then PPS by id
+	int ps_len[32+256]={0};
+	unsigned char *avcc=NULL;
+	int i=0,avcc_size=0,nal_num=0,ret=0;
+	long long bytes=0;
+
+	if(h264_scanner_open(&s,url)<0){
+		printf("Open file error\n");
+		return -1;
+	}
+	if((fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot open output file.\n");
+		h264_scanner_close(&s);
+		return -1;
+	}
+	ctx=(H264_CONTEXT *)calloc(1,sizeof(H264_CONTEXT));
+	iov=(H264_IOV *)malloc(sizeof(H264_IOV));
+	iov->num=0;
+
+	while(h264_scanner_next(&s,&v)){
+		unsigned char header[4];
+		int id=-1,slot=-1;
+		if(v.len==0)
+			continue;
+		if(v.nal_unit_type==NALU_TYPE_SPS&&(id=h264_parse_sps(ctx,v.data,v.len))>=0)
+			slot=id;
+		else if(v.nal_unit_type==NALU_TYPE_PPS&&(id=h264_parse_pps(ctx,v.data,v.len))>=0)
+			slot=32+id;
+		//Parameter sets are small, keep the first one of each id
+		if(slot>=0&&ps[slot]==NULL&&v.len<=0xFFFF){
+			ps[slot]=(unsigned char *)malloc(v.len);
+			memcpy(ps[slot],v.data,v.len);
+			ps_len[slot]=v.len;
+		}
+		header[0]=(unsigned char)(v.len>>24);
+		header[1]=(unsigned char)(v.len>>16);
+		header[2]=(unsigned char)(v.len>>8);
+		header[3]=(unsigned char)v.len;
+		//In block mode the payload is only valid until the next NALU
+		if(h264_iov_add(fp_out,iov,header,v.data,v.len)<0||(s.map==NULL&&h264_iov_flush(fp_out,iov)<0)){
+			ret=-1;
+			break;
+		}
+		bytes+=4+v.len;
+		nal_num++;
+	}
+	if(h264_iov_flush(fp_out,iov)<0||ret<0){
+		printf("Error: Cannot write output file.\n");
+		ret=-1;
+	}
+	fclose(fp_out);
+
+	avcc_size=11;
+	for(i=0;i<32+256;i++)
+		avcc_size+=ps[i]?2+ps_len[i]:0;
+	avcc=(unsigned char *)malloc(avcc_size);
+	avcc_size=h264_build_avcc(ctx,ps,ps_len,avcc);
+	if(avcc_size==0){
+		printf("Error: No SPS found.\n");
+	}else if((fp_avcc=fopen(url_avcc,"wb"))!=NULL){
+		fwrite(avcc,1,avcc_size,fp_avcc);
+		fclose(fp_avcc);
+	}
+	printf("NALU Cnt:%d Output:%lld bytes avcC:%d bytes\n",nal_num,bytes,avcc_size);
+
+	for(i=0;i<32+256;i++)
+		free(ps[i]);
+	free(avcc);
+	free(iov);
+	free(ctx);
+	h264_scanner_close(&s);
+	return avcc_size>0?ret:-1;
+}
+
+/**
+ * Convert AVCC stream (big-endian NALU length prefix) to H.264 Annex B.
+ * @param url        Location of input AVCC file.
+ * @param url_avcc   Location of avcC. Its parameter sets are written first
+ *                   and it gives the length size. NULL for 4 byte lengths.
+ * @param url_out    Location of output H.264 Annex B file.
+ */
+int simplest_h264_avcc_to_annexb(char *url,const char *url_avcc,const char *url_out){
+	static const unsigned char startcode[4]={0,0,0,1};
+	unsigned char *map=NULL,*avcc=NULL;
+	long long map_size=0,avcc_size=0,pos=0;
+	H264_IOV *iov=NULL;
+	FILE *fp_out=NULL;
+	int length_size=4,nal_num=0,failed=0,ret=0;
+
+	if(url_avcc!=NULL){
+		int i=0,k=0,num=0;
+		long long p=6;
+		if((avcc=simplest_map_file(url_avcc,&avcc_size))==NULL||avcc_size<7||avcc[0]!=1){
+			printf("Error: Invalid avcC.\n");
+			simplest_unmap_file(avcc,avcc_size);
+			return -1;
+		}
+		length_size=(avcc[4]&0x03)+1;
+		if((fp_out=fopen(url_out,"wb"))==NULL){
+			printf("Error: Cannot open output file.\n");
+			simplest_unmap_file(avcc,avcc_size);
+			return -1;
+		}
+		//SPS, then PPS
+		num=avcc[5]&0x1f;
+		for(k=0;k<2;k++){
+			for(i=0;i<num&&p+2<=avcc_size;i++){
+				int len=(avcc[p]<<8)|avcc[p+1];
+				if(p+2+len>avcc_size)
+					break;
+				fwrite(startcode,1,4,fp_out);
+				fwrite(avcc+p+2,1,len,fp_out);
+				p+=2+len;
+				nal_num++;
+			}
+			if(p>=avcc_size)
+				break;
+			num=avcc[p++];
+		}
+		simplest_unmap_file(avcc,avcc_size);
+	}else if((fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot open output file.\n");
+		return -1;
+	}
+
+	if((map=simplest_map_file(url,&map_size))==NULL){
+		printf("Open file error\n");
+		fclose(fp_out);
+		return -1;
+	}
+	iov=(H264_IOV *)malloc(sizeof(H264_IOV));
+	iov->num=0;
+	while(pos+length_size<=map_size){
+		long long len=0;
+		int i=0;
+		for(i=0;i<length_size;i++)
+			len=(len<<8)|map[pos+i];
+		pos+=length_size;
+		if(len>map_size-pos){
+			printf("Error: NALU at %lld truncated.\n",pos-length_size);
+			ret=-1;
+			break;
+		}
+		if(h264_iov_add(fp_out,iov,startcode,map+pos,len)<0){
+			failed=1;
+			break;
+		}
+		pos+=len;
+		nal_num++;
+	}
+	if(h264_iov_flush(fp_out,iov)<0||failed){
+		printf("Error: Cannot write output file.\n");
+		ret=-1;
+	}
+	printf("NALU Cnt:%d Length Size:%d\n",nal_num,length_size);
+
+	free(iov);
+	fclose(fp_out);
+	simplest_unmap_file(map,map_size);
+	return ret;
+}
+
+/**
+ * Index NALUs of H.264 file with several threads, and print a summary.
+ * The index is kept in <url>.h264idx and only rebuilt (or extended) when
+ * the file changes.
+ * @param url    Location of input H.264 bitstream file.
+ */
+int simplest_h264_index(char *url){
+	long long map_size=0,bytes=0;
+	const char *status=NULL;
+	H264IDX_HEADER *h=h264idx_open(url,&map_size,&status);
+	const H264IDX_ENTRY *entry=NULL;
+	int count[32]={0};
+	unsigned i=0;
+
+	if(h==NULL){
+		printf("Open file error\n");
+		return -1;
+	}
+	entry=(const H264IDX_ENTRY *)(h+1);
+	for(i=0;i<h->num;i++){
+		count[entry[i].nal_unit_type]++;
+		bytes+=entry[i].len;
+	}
+	printf("Index:%s NALU Cnt:%u Frames:%u Payload:%lld bytes\n",status,h->num,h->frames,bytes);
+	printf("SPS:%d PPS:%d SEI:%d IDR:%d SLICE:%d AUD:%d\n",count[NALU_TYPE_SPS],count[NALU_TYPE_PPS],count[NALU_TYPE_SEI],
+		count[NALU_TYPE_IDR],count[NALU_TYPE_SLICE],count[NALU_TYPE_AUD]);
+	simplest_unmap_file((unsigned char *)h,map_size);
+	return 0;
+}
+
@@ -0,0 +1,304 @@
+/**
+ * 򵥵Ƶݴʾ
+ * Simplest MediaData Test
+ *
+ *  Lei Xiaohua
+ * leixiaohua1020@126.com
+ * йýѧ/ֵӼ
+ * Communication University of China / Digital TV Technology
+ * http://blog.csdn.net/leixiaohua1020
+ *
+ * Ŀ¼Ƶʾ
+ *  (1)ݴ򡣰RGBYUVظʽĺ
+ *  (2)Ƶݴ򡣰PCMƵʽĺ
+ *  (3)H.264򡣿Է벢NALU
+ *  (4)AAC򡣿Է벢ADTS֡
+ *  (5)FLVװʽ򡣿ԽFLVеMP3Ƶ
+ *  (6)UDP-RTPЭ򡣿ԽUDP/RTP/MPEG-TSݰ
+ *
+ * This project contains following samples to handling multimedia data:
+ *  (1) Video pixel data handling program. It contains several examples to handle RGB and YUV data.
+ *  (2) Audio sample data handling program. It contains several examples to handle PCM data.
+ *  (3) H.264 stream analysis program. It can parse H.264 bitstream and analysis NALU of stream.
+ *  (4) AAC stream analysis program. It can parse AAC bitstream and analysis ADTS frame of stream.
+ *  (5) FLV format analysis program. It can analysis FLV file and extract MP3 audio stream.
+ *  (6) UDP-RTP protocol analysis program. It can analysis UDP/RTP/MPEG-TS Packet.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * File helpers shared by the analysis programs:
+ * 64bit seek, file status, read-only file mapping, bulk copy between files
+ * and scatter-gather write.
+ */
+
+//Buffers per writev() call
+#define SIMPLEST_IOV_MAX 64
+
+/**
+ * Seek in file beyond 2GB.
+ * @param fp      File handle.
+ * @param offset  Offset to seek.
+ * @param whence  SEEK_SET, SEEK_CUR or SEEK_END.
+ */
+int simplest_fseek64(FILE *fp,long long offset,int whence){
+#ifdef _WIN32
+	return _fseeki64(fp,offset,whence);
+#else
+	return fseeko(fp,(off_t)offset,whence);
+#endif
+}
+
+/**
+ * Get position in file beyond 2GB.
+ * @param fp      File handle.
+ */
+long long simplest_ftell64(FILE *fp){
+#ifdef _WIN32
+	return _ftelli64(fp);
+#else
+	return (long long)ftello(fp);
+#endif
+}
+
+/**
+ * Get size and modification time of file.
+ * @param url     Location of file.
+ * @param size    Output, size of file.
+ * @param mtime   Output, modification time in seconds.
+ */
+int simplest_file_stat(const char *url,long long *size,long long *mtime){
+#ifdef _WIN32
+	struct _stat64 st;
+	if(_stat64(url,&st)!=0)
+		return -1;
+#else
+	struct stat st;
+	if(stat(url,&st)!=0)
+		return -1;
+#endif
+	*size=(long long)st.st_size;
+	*mtime=(long long)st.st_mtime;
+	return 0;
+}
+
+/**
+ * Map a whole file into memory (read only).
+ * @param url     Location of file.
+ * @param size    Output, size of file.
+ * @return        Start of mapped data, NULL if the file cannot be mapped.
+ */
+unsigned char *simplest_map_file(const char *url,long long *size){
+	unsigned char *data=NULL;
+	*size=0;
+#ifdef _WIN32
+	HANDLE file=CreateFileA(url,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+	HANDLE map=NULL;
+	LARGE_INTEGER file_size;
+	if(file==INVALID_HANDLE_VALUE)
+		return NULL;
+	if(!GetFileSizeEx(file,&file_size)||file_size.QuadPart==0){
+		CloseHandle(file);
+		return NULL;
+	}
+	map=CreateFileMappingA(file,NULL,PAGE_READONLY,0,0,NULL);
+	if(map!=NULL){
+		data=(unsigned char *)MapViewOfFile(map,FILE_MAP_READ,0,0,0);
+		//The view keeps the mapping alive
+		CloseHandle(map);
+	}
+	CloseHandle(file);
+	if(data!=NULL)
+		*size=file_size.QuadPart;
+#else
+	struct stat st;
+	void *p=NULL;
+	int fd=open(url,O_RDONLY);
+	if(fd<0)
+		return NULL;
+	if(fstat(fd,&st)!=0||st.st_size==0){
+		close(fd);
+		return NULL;
+	}
+	p=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(p==MAP_FAILED)
+		return NULL;
+	madvise(p,st.st_size,MADV_SEQUENTIAL);
+	data=(unsigned char *)p;
+	*size=st.st_size;
+#endif
+	return data;
+}
+
+/**
+ * Unmap a file mapped by simplest_map_file().
+ * @param data    Start of mapped data.
+ * @param size    Size of mapped data.
+ */
+void simplest_unmap_file(unsigned char *data,long long size){
+	if(data==NULL)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(data,size);
+#endif
+}
+
+/**
+ * Read a byte range of file at given position. The position of the
+ * file handle is not used, so threads can share one file handle.
+ * @param fp      File handle.
+ * @param buf     Output buffer.
+ * @param size    Bytes to read.
+ * @param offset  Position of the range in file.
+ * @return        Bytes read.
+ */
+long long simplest_pread(FILE *fp,void *buf,long long size,long long offset){
+	long long done=0;
+#ifdef _WIN32
+	HANDLE file=(HANDLE)_get_osfhandle(_fileno(fp));
+	while(done<size){
+		OVERLAPPED ov;
+		DWORD n=0;
+		DWORD want=(size-done)>0x40000000?0x40000000:(DWORD)(size-done);
+		memset(&ov,0,sizeof(ov));
+		ov.Offset=(DWORD)(offset+done);
+		ov.OffsetHigh=(DWORD)((offset+done)>>32);
+		if(!ReadFile(file,(char *)buf+done,want,&n,&ov)||n==0)
+			break;
+		done+=n;
+	}
+#else
+	int fd=fileno(fp);
+	while(done<size){
+		ssize_t n=pread(fd,(char *)buf+done,(size_t)(size-done),(off_t)(offset+done));
+		if(n<=0)
+			break;
+		done+=n;
+	}
+#endif
+	return done;
+}
+
+/**
+ * Copy a byte range of one file to the current position of another.
+ * Uses copy_file_range() on Linux, large block copy elsewhere.
+ * @param fp_in   Input file.
+ * @param offset  Position of the range in input file.
+ * @param size    Size of the range.
+ * @param fp_out  Output file.
+ * @return        Bytes copied.
+ */
+long long simplest_copy_range(FILE *fp_in,long long offset,long long size,FILE *fp_out){
+	const int block_size=1024*1024;
+	long long copied=0;
+	unsigned char *block=NULL;
+
+#if defined(__linux__)
+	{
+		int fd_in=fileno(fp_in);
+		int fd_out=fileno(fp_out);
+		loff_t off_in=offset;
+		fflush(fp_out);
+		while(copied<size){
+			ssize_t n=copy_file_range(fd_in,&off_in,fd_out,NULL,(size_t)(size-copied),0);
+			if(n<=0)
+				break;
+			copied+=n;
+		}
+		//stdio does not know the descriptor moved
+		simplest_fseek64(fp_out,(long long)lseek(fd_out,0,SEEK_CUR),SEEK_SET);
+		if(copied==size)
+			return copied;
+	}
+#endif
+	if(simplest_fseek64(fp_in,offset+copied,SEEK_SET)!=0)
+		return copied;
+	block=(unsigned char *)malloc(block_size);
+	while(copied<size){
+		int want=(size-copied)>block_size?block_size:(int)(size-copied);
+		int n=fread(block,1,want,fp_in);
+		int w=0;
+		if(n<=0)
+			break;
+		w=(int)fwrite(block,1,n,fp_out);
+		copied+=w;
+		if(w<n)
+			break;
+	}
+	free(block);
+	return copied;
+}
+
+/**
+ * Write several buffers at the current position of file, with writev()
+ * where available so that the buffers are not copied into one.
+ * @param fp      Output file.
+ * @param base    Start of each buffer.
+ * @param len     Length of each buffer.
+ * @param num     Number of buffers.
+ * @return        Bytes written, or -1 if not all of them could be written.
+ */
+long long simplest_writev(FILE *fp,const void **base,const long long *len,int num){
+	long long done=0;
+	int i=0;
+#ifdef _WIN32
+	//Gathered writes need unbuffered files on Win32, write the buffers one by one
+	for(i=0;i<num;i++){
+		if(fwrite(base[i],1,(size_t)len[i],fp)!=(size_t)len[i])
+			return -1;
+		done+=len[i];
+	}
+#else
+	struct iovec iov[SIMPLEST_IOV_MAX];
+	long long skip=0;   //Bytes of base[i] already written
+	int fd=fileno(fp);
+
+	if(fflush(fp)!=0)
+		return -1;
+	for(;;){
+		ssize_t w=0;
+		int n=0;
+		while(i<num&&skip>=len[i]){
+			skip-=len[i];
+			i++;
+		}
+		if(i>=num)
+			break;
+		for(n=0;n<SIMPLEST_IOV_MAX&&i+n<num;n++){
+			iov[n].iov_base=(char *)base[i+n]+(n==0?skip:0);
+			iov[n].iov_len=(size_t)(len[i+n]-(n==0?skip:0));
+		}
+		w=writev(fd,iov,n);
+		if(w<0&&errno==EINTR)
+			continue;
+		if(w<=0){
+			done=-1;
+			break;
+		}
+		done+=w;
+		skip+=w;
+	}
+	//stdio does not know the descriptor moved
+	simplest_fseek64(fp,(long long)lseek(fd,0,SEEK_CUR),SEEK_SET);
+#endif
+	return done;
+}
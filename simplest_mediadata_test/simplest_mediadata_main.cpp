@@ -36,18 +36,136 @@
  */
 int simplest_h264_parser(char *url);
 
+/**
+ * Index NALUs of H.264 file with several threads, and print a summary.
+ * @param url    Location of input H.264 bitstream file.
+ */
+int simplest_h264_index(char *url);
+
+/**
+ * Extract frames from H.264 file, starting at the nearest IDR access unit at
+ * or before the given frame. The SPS/PPS sent before that access unit are
+ * written first, so the output can be decoded alone. The sidecar index is
+ * used (and built if needed).
+ * @param url         Location of input H.264 bitstream file.
+ * @param frame       First frame wanted (decoding order).
+ * @param num_frames  Number of frames wanted after it.
+ * @param url_out     Location of Output H.264 file.
+ */
+int simplest_h264_seek(char *url,int frame,int num_frames,const char *url_out);
+
+/**
+ * Split H.264 file at IDR access units into segments of at least the given
+ * duration. SPS/PPS are carried into each segment. No re-encoding.
+ * Frames before the first IDR are left out.
+ * @param url         Location of input H.264 bitstream file.
+ * @param seconds     Minimum segment duration, 0 to split at every IDR.
+ * @param fps         Frame rate used if SPS has no timing info.
+ * @param url_out     Prefix of output files, <prefix>NNN.h264.
+ */
+int simplest_h264_split(char *url,double seconds,double fps,const char *url_out);
+
+/**
+ * Assemble access units of H.264 file in one pass, and print frame size,
+ * bitrate and GOP statistics. Memory use does not depend on file size.
+ * @param url       Location of input H.264 bitstream file.
+ * @param fps       Frame rate used if SPS has no timing info.
+ * @param gop       Expected GOP length, 0 to take the length of the first GOP.
+ * @param url_out   Location of Output per-second bitrate CSV file, or NULL.
+ */
+int simplest_h264_stat(char *url,double fps,int gop,const char *url_out);
+
+/**
+ * Convert H.264 Annex B stream to AVCC (4 byte NALU length), and write the
+ * avcC built from its SPS/PPS.
+ * @param url        Location of input H.264 Annex B file.
+ * @param url_out    Location of output AVCC file.
+ * @param url_avcc   Location of output avcC.
+ */
+int simplest_h264_annexb_to_avcc(char *url,const char *url_out,const char *url_avcc);
+
+/**
+ * Convert AVCC stream to H.264 Annex B.
+ * @param url        Location of input AVCC file.
+ * @param url_avcc   Location of avcC, or NULL for 4 byte lengths without parameter sets.
+ * @param url_out    Location of output H.264 Annex B file.
+ */
+int simplest_h264_avcc_to_annexb(char *url,const char *url_avcc,const char *url_out);
+
 /**
  * Analysis FLV file
  * @param url    Location of input FLV file.
  */
 int simplest_flv_parser(char *url);
 
+/**
+ * Add onMetaData with keyframe positions and times to FLV file. Old script
+ * data is replaced, keeping the properties of onMetaData that are not
+ * computed again.
+ * @param url        Location of input FLV file.
+ * @param url_out    Location of output FLV file.
+ * @param url_index  Location of output binary keyframe index, or NULL.
+ */
+int simplest_flv_inject_metadata(char *url,const char *url_out,const char *url_index);
+
+/**
+ * Print onMetaData of FLV file, reading only the file header and the
+ * first tag.
+ * @param url    Location of input FLV file.
+ */
+int simplest_flv_probe(char *url);
+
+/**
+ * Extract H.264 of FLV file (AVC video tags) as Annex B stream.
+ * @param url        Location of input FLV file.
+ * @param url_out    Location of output H.264 Annex B file.
+ * @param url_ts     Location of output CSV with DTS/PTS of each frame, or NULL.
+ */
+int simplest_flv_to_h264(char *url,const char *url_out,const char *url_ts);
+
 /**
  * Analysis AAC file
  * @param url    Location of input AAC file.
  */
 int simplest_aac_parser(char *url);
 
+/**
+ * Index ADTS frames of AAC file, and print duration, bitrate and whether
+ * it is VBR.
+ * @param url      Location of input AAC file.
+ * @param persist  Keep the index in <url>.aacidx for later calls.
+ */
+int simplest_aac_index(char *url,int persist);
+
+/**
+ * Extract a time range of AAC file, from the frame that contains the
+ * start time. The index is kept in <url>.aacidx.
+ * @param url        Location of input AAC file.
+ * @param start      Start time in seconds.
+ * @param duration   Duration in seconds.
+ * @param url_out    Location of output AAC file.
+ */
+int simplest_aac_seek(char *url,double start,double duration,const char *url_out);
+
+/**
+ * Convert ADTS to raw AAC access units (2 byte length prefix), and write
+ * the AudioSpecificConfig of the stream.
+ * Frames with several raw data blocks are split into one access unit per
+ * block, which needs the block positions of the CRC header.
+ * @param url        Location of input AAC (ADTS) file.
+ * @param url_out    Location of output raw AAC file.
+ * @param url_asc    Location of output AudioSpecificConfig.
+ */
+int simplest_aac_adts_to_raw(char *url,const char *url_out,const char *url_asc);
+
+/**
+ * Convert raw AAC access units (2 byte length prefix) to ADTS.
+ * @param url        Location of input raw AAC file.
+ * @param url_asc    Location of AudioSpecificConfig.
+ * @param url_out    Location of output AAC (ADTS) file.
+ */
+int simplest_aac_raw_to_adts(char *url,const char *url_asc,const char *url_out);
+
 /**
  * Analysis RTP stream
  * @param url    RTP URL
@@ -168,6 +286,19 @@ int simplest_yuv444_split(char *url, int w, int h,int num);
  */
 int simplest_pcm16le_cut_singlechannel(char *url,int start_num,int dur_num);
 
+/**
+ * Cut ranges of PCM file. Only the bytes of each range are read,
+ * and the ranges are cut in parallel.
+ * @param url           Location of PCM (or WAVE) file.
+ * @param channels      Channel number of PCM file.
+ * @param sample_bytes  Bytes per sample.
+ * @param start         First frame of each range.
+ * @param dur           Number of frames of each range.
+ * @param num           Number of ranges.
+ * @param url_out       Location of Output PCM file of each range.
+ */
+int simplest_pcm_cut(const char *url,int channels,int sample_bytes,const long long *start,const long long *dur,int num,const char **url_out);
+
 /**
  * Split Left and Right channel of 16LE PCM file.
  * @param url  Location of PCM file.
@@ -175,6 +306,24 @@ int simplest_pcm16le_cut_singlechannel(char *url,int start_num,int dur_num);
  */
 int simplest_pcm16le_split(char *url);
 
+/**
+ * Split channels of interleaved PCM file.
+ * @param url           Location of PCM file.
+ * @param channels      Channel number of PCM file (1~8).
+ * @param sample_bytes  Bytes per sample: 2 (s16), 3 (s24), 4 (s32/f32).
+ * @param url_out       Location of Output PCM file of each channel.
+ */
+int simplest_pcm_split(const char *url,int channels,int sample_bytes,const char **url_out);
+
+/**
+ * Merge single channel PCM files into one interleaved PCM file.
+ * @param url_in        Location of Input PCM file of each channel.
+ * @param channels      Channel number of Output PCM file (1~8).
+ * @param sample_bytes  Bytes per sample: 2 (s16), 3 (s24), 4 (s32/f32).
+ * @param url_out       Location of Output PCM file.
+ */
+int simplest_pcm_merge(const char **url_in,int channels,int sample_bytes,const char *url_out);
+
 /**
  * Halve volume of Left channel of 16LE PCM file
  * @param url  Location of PCM file.
@@ -193,6 +342,17 @@ int simplest_pcm16le_doublespeed(char *url);
  */
 int simplest_pcm16le_to_pcm8(char *url);
 
+/**
+ * Convert sample format of PCM file.
+ * @param url_in   Location of Input PCM file.
+ * @param fmt_in   Sample format of Input PCM file:
+ *                 u8, s16le, s16be, s24le, s24be, s32le, s32be, f32le, f32be.
+ * @param url_out  Location of Output PCM file.
+ * @param fmt_out  Sample format of Output PCM file.
+ * @param dither   Add TPDF dither when output is integer (1) or not (0).
+ */
+int simplest_pcm_convert(const char *url_in,const char *fmt_in,const char *url_out,const char *fmt_out,int dither);
+
 /**
  * Convert PCM16LE raw data to WAVE format
  * @param pcmpath      Input PCM file.
@@ -202,6 +362,145 @@ int simplest_pcm16le_to_pcm8(char *url);
  */
 int simplest_pcm16le_to_wave(const char *pcmpath,int channels,int sample_rate,const char *wavepath);
 
+/**
+ * Convert PCM raw data to WAVE format
+ * @param pcmpath      Input PCM file.
+ * @param fmt          Sample format of PCM file: u8, s16le, s24le, s32le, f32le.
+ * @param channels     Channel number of PCM file.
+ * @param sample_rate  Sample rate of PCM file.
+ * @param wavepath     Output WAVE file.
+ */
+int simplest_pcm_to_wave(const char *pcmpath,const char *fmt,int channels,int sample_rate,const char *wavepath);
+
+/**
+ * Measure loudness of PCM file (EBU R128 / ITU-R BS.1770).
+ * @param url          Location of PCM (or WAVE) file.
+ * @param fmt          Sample format of PCM file, such as s16le or f32le.
+ * @param channels     Channel number of PCM file (L, R, C, LFE, Ls, Rs order).
+ * @param sample_rate  Sample rate of PCM file.
+ */
+int simplest_pcm_loudness(const char *url,const char *fmt,int channels,int sample_rate);
+
+/**
+ * Measure loudness of several PCM files in parallel.
+ * @param url          Location of PCM (or WAVE) files.
+ * @param num          Number of files.
+ * @param fmt          Sample format of PCM files, such as s16le or f32le.
+ * @param channels     Channel number of PCM files.
+ * @param sample_rate  Sample rate of PCM files.
+ */
+int simplest_pcm_loudness_batch(const char **url,int num,const char *fmt,int channels,int sample_rate);
+
+/**
+ * Mix several 16LE PCM files into one.
+ * @param url_in        Location of Input PCM (or WAVE) files.
+ * @param num           Number of Input files.
+ * @param in_channels   Channel number of each Input file.
+ * @param gain          Gain of each Input file, 1.0 keeps the level (max 7.9).
+ * @param offset        Start of each Input file in Output, in frames.
+ * @param channel_map   Output channel of each channel of each Input file,
+ *                      PCM_MAX_CHANNELS(8) entries per file, -1 drops the channel.
+ *                      NULL maps channel c to channel c.
+ * @param out_channels  Channel number of Output PCM file.
+ * @param url_out       Location of Output PCM file.
+ */
+int simplest_pcm16le_mix(const char **url_in,int num,const int *in_channels,const float *gain,const int *offset,
+						 const int *channel_map,int out_channels,const char *url_out);
+
+/**
+ * Generate multi-resolution peak file (min/max/rms) of 16LE PCM file.
+ * @param url              Location of PCM (or WAVE) file.
+ * @param channels         Channel number of PCM file.
+ * @param sample_rate      Sample rate of PCM file.
+ * @param samples_per_bin  Frames per bin of each level, such as {256,1024,4096}.
+ *                         Each one must be a multiple of the previous one.
+ * @param levels           Number of levels.
+ * @param url_out          Location of Output peak file.
+ */
+int simplest_pcm16le_peak(const char *url,int channels,int sample_rate,const int *samples_per_bin,int levels,const char *url_out);
+
+/**
+ * Print bins of one level of peak file, the file is mapped and read in place.
+ * @param url        Location of peak file.
+ * @param level      Level to read.
+ * @param first_bin  First bin to print.
+ * @param num        Number of bins to print.
+ */
+int simplest_peak_dump(const char *url,int level,long long first_bin,int num);
+
+/**
+ * Detect silence and sound segments of 16LE PCM file.
+ * @param url             Location of PCM (or WAVE) file.
+ * @param channels        Channel number of PCM file.
+ * @param sample_rate     Sample rate of PCM file.
+ * @param window_ms       Length of analysis window in ms, such as 20.
+ * @param threshold_db    RMS level (dBFS) under which a window is silent, such as -45.
+ * @param hysteresis_db   Silence ends only when the level rises above threshold+hysteresis.
+ * @param min_silence_ms  Shorter silence stays inside the sound segment.
+ * @param url_out         Location of Output segment list, JSON if it ends with .json, else CSV.
+ */
+int simplest_pcm16le_silence(const char *url,int channels,int sample_rate,int window_ms,float threshold_db,float hysteresis_db,
+							 int min_silence_ms,const char *url_out);
+
+/**
+ * Detect silence and sound segments of several 16LE PCM files in parallel.
+ * @param url             Location of PCM (or WAVE) files.
+ * @param num             Number of files.
+ * @param url_out         Location of Output segment list of each file.
+ * Other parameters are the same as simplest_pcm16le_silence().
+ */
+int simplest_pcm16le_silence_batch(const char **url,int num,int channels,int sample_rate,int window_ms,float threshold_db,
+								   float hysteresis_db,int min_silence_ms,const char **url_out);
+
+/**
+ * Compute STFT spectrogram of 16LE PCM file.
+ * Channels are averaged. Every frame is saved as fft_size/2+1 float values of
+ * log-magnitude in dB (0dB is a full scale sine), from DC to Nyquist.
+ * @param url          Location of PCM (or WAVE) file.
+ * @param channels     Channel number of PCM file.
+ * @param sample_rate  Sample rate of PCM file.
+ * @param fft_size     FFT size, power of 2 from 16 to 65536.
+ * @param hop          Distance between frames in samples.
+ * @param window       Window function: "hann", "hamming", "blackman" or "rect".
+ * @param floor_db     Lower limit of output values, such as -120.
+ * @param url_out      Location of Output float file.
+ */
+int simplest_pcm16le_spectrogram(const char *url,int channels,int sample_rate,int fft_size,int hop,const char *window,
+								 float floor_db,const char *url_out);
+
+/**
+ * Convert spectrogram from simplest_pcm16le_spectrogram() to grayscale BMP file.
+ * Time goes from left to right, frequency from bottom to top.
+ * @param url       Location of spectrogram float file.
+ * @param fft_size  FFT size used to compute the spectrogram.
+ * @param floor_db  Value shown as black (0dB is white).
+ * @param bmppath   Location of Output BMP file.
+ */
+int simplest_spectrogram_to_bmp(const char *url,int fft_size,float floor_db,const char *bmppath);
+
+/**
+ * Encode 16LE PCM file to G.711 A-law or mu-law.
+ * @param url      Location of PCM (or WAVE) file.
+ * @param ulaw     0 for A-law, 1 for mu-law.
+ * @param url_out  Location of Output G.711 file.
+ */
+int simplest_pcm16le_to_g711(const char *url,int ulaw,const char *url_out);
+
+/**
+ * Decode G.711 A-law or mu-law file to 16LE PCM.
+ * @param url      Location of G.711 file.
+ * @param ulaw     0 for A-law, 1 for mu-law.
+ * @param url_out  Location of Output PCM file.
+ */
+int simplest_g711_to_pcm16le(const char *url,int ulaw,const char *url_out);
+
+/**
+ * Extract sample data of WAVE file to PCM raw data.
+ * @param wavepath     Input WAVE file.
+ * @param pcmpath      Output PCM file.
+ */
+int simplest_wave_to_pcm(const char *wavepath,const char *pcmpath);
+
 
 
 int main(int argc, char* argv[]){
@@ -231,22 +530,102 @@ int main(int argc, char* argv[]){
 
 	simplest_pcm16le_split("NocturneNo2inEflat_44.1k_s16le.pcm");
 
+	const char *pcm_planes[2]={"output_l.pcm","output_r.pcm"};
+	simplest_pcm_merge(pcm_planes,2,2,"output_merge.pcm");
+
 	simplest_pcm16le_halfvolumeleft("NocturneNo2inEflat_44.1k_s16le.pcm");
 
 	simplest_pcm16le_doublespeed("NocturneNo2inEflat_44.1k_s16le.pcm");
 
 	simplest_pcm16le_to_pcm8("NocturneNo2inEflat_44.1k_s16le.pcm");
 
+	simplest_pcm_convert("NocturneNo2inEflat_44.1k_s16le.pcm","s16le","output_f32.pcm","f32le",0);
+
+	simplest_pcm_convert("output_f32.pcm","f32le","output_16.pcm","s16le",1);
+
 	simplest_pcm16le_cut_singlechannel("drum.pcm",2360,120);
 
 	simplest_pcm16le_to_wave("NocturneNo2inEflat_44.1k_s16le.pcm",2,44100,"output_nocturne.wav");
 
+	simplest_wave_to_pcm("output_nocturne.wav","output_nocturne.pcm");
+
+	long long cut_start[3]={0,44100,441000};
+	long long cut_dur[3]={44100,22050,88200};
+	const char *cut_out[3]={"output_cut_0.pcm","output_cut_1.pcm","output_cut_2.pcm"};
+	simplest_pcm_cut("output_nocturne.wav",2,2,cut_start,cut_dur,3,cut_out);
+
+	simplest_pcm_loudness("output_nocturne.wav","s16le",2,44100);
+
+	const char *pcm_files[2]={"NocturneNo2inEflat_44.1k_s16le.pcm","output_16.pcm"};
+	simplest_pcm_loudness_batch(pcm_files,2,"s16le",2,44100);
+
+	//Music bed at -6dB, plus the left channel of a second copy one second later
+	const char *mix_in[2]={"NocturneNo2inEflat_44.1k_s16le.pcm","NocturneNo2inEflat_44.1k_s16le.pcm"};
+	int mix_channels[2]={2,2};
+	float mix_gain[2]={0.5f,0.5f};
+	int mix_offset[2]={0,44100};
+	int mix_map[2*8]={0,1,-1,-1,-1,-1,-1,-1, 0,-1,-1,-1,-1,-1,-1,-1};
+	simplest_pcm16le_mix(mix_in,2,mix_channels,mix_gain,mix_offset,mix_map,2,"output_mix.pcm");
+
+	int peak_bins[3]={256,1024,4096};
+	simplest_pcm16le_peak("NocturneNo2inEflat_44.1k_s16le.pcm",2,44100,peak_bins,3,"output_nocturne.peak");
+
+	simplest_peak_dump("output_nocturne.peak",2,100,4);
+
+	simplest_pcm16le_silence("output_mix.pcm",2,44100,20,-45.0f,3.0f,300,"output_silence.json");
+
+	const char *silence_in[2]={"drum.pcm","output_cut_2.pcm"};
+	const char *silence_out[2]={"output_silence_drum.csv","output_silence_cut.csv"};
+	simplest_pcm16le_silence_batch(silence_in,2,1,44100,20,-45.0f,3.0f,300,silence_out);
+
+	simplest_pcm16le_spectrogram("NocturneNo2inEflat_44.1k_s16le.pcm",2,44100,1024,512,"hann",-120.0f,"output_spectrogram.raw");
+
+	simplest_spectrogram_to_bmp("output_spectrogram.raw",1024,-120.0f,"output_spectrogram.bmp");
+
+	simplest_pcm16le_to_g711("NocturneNo2inEflat_44.1k_s16le.pcm",0,"output_alaw.g711");
+
+	simplest_g711_to_pcm16le("output_alaw.g711",0,"output_alaw.pcm");
+
+	simplest_pcm16le_to_g711("NocturneNo2inEflat_44.1k_s16le.pcm",1,"output_ulaw.g711");
+
+	simplest_g711_to_pcm16le("output_ulaw.g711",1,"output_ulaw.pcm");
+
 	simplest_h264_parser("sintel.h264");
+
+	simplest_h264_index("sintel.h264");
+
+	simplest_h264_seek("sintel.h264",200,10,"output_seek.h264");
+
+	simplest_h264_split("sintel.h264",5,25,"output_split_");
+
+	simplest_h264_stat("sintel.h264",25,0,"output_h264_bitrate.csv");
+
+	simplest_h264_annexb_to_avcc("sintel.h264","output_sintel.avcc","output_sintel.avcC");
+
+	simplest_h264_avcc_to_annexb("output_sintel.avcc","output_sintel.avcC","output_sintel_annexb.h264");
 	
 	simplest_flv_parser("cuc_ieschool.flv");
 
+	simplest_flv_inject_metadata("cuc_ieschool.flv","output_meta.flv","output_meta.flvidx");
+
+	simplest_flv_probe("cuc_ieschool.flv");
+
+	simplest_flv_probe("output_meta.flv");
+
+	simplest_flv_to_h264("cuc_ieschool.flv","output_flv.h264","output_flv_ts.csv");
+
+	simplest_h264_stat("output_flv.h264",25,0,NULL);
+
 	simplest_aac_parser("nocturne.aac");
 
+	simplest_aac_index("nocturne.aac",1);
+
+	simplest_aac_seek("nocturne.aac",10,5,"output_seek.aac");
+
+	simplest_aac_adts_to_raw("nocturne.aac","output_nocturne.raw","output_nocturne.asc");
+
+	simplest_aac_raw_to_adts("output_nocturne.raw","output_nocturne.asc","output_nocturne_adts.aac");
+
 	simplest_udp_parser(8880);
 
 	return 0;
@@ -30,6 +30,11 @@
 #include <string.h>
 #include <math.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PCM_USE_SSE2 1
+#endif
+
 /**
  * Analysis H.264 Bitstream
  * @param url    Location of input H.264 bitstream file.
@@ -54,6 +59,19 @@ extern int simplest_aac_parser(char *url);
  */
 extern int simplest_udp_parser(int port);
 
+/**
+ * File helpers, see simplest_mediadata_io.cpp
+ */
+extern int simplest_fseek64(FILE *fp,long long offset,int whence);
+extern long long simplest_ftell64(FILE *fp);
+extern unsigned char *simplest_map_file(const char *url,long long *size);
+extern void simplest_unmap_file(unsigned char *data,long long size);
+extern long long simplest_copy_range(FILE *fp_in,long long offset,long long size,FILE *fp_out);
+extern long long simplest_pread(FILE *fp,void *buf,long long size,long long offset);
+
+static FILE *pcm_open_input(const char *url,long long *size);
+static int pcm_read(void *buf,int size,int count,FILE *fp,long long *remain);
+
 /**
  * Generate RGB24 colorbar.
  * @param width    Width of Output RGB file.
@@ -606,6 +624,81 @@ int simplest_yuv444_split(char *url, int w, int h,int num){
 	return 0;
 }
 
+/**
+ * Cut ranges of PCM file. Only the bytes of each range are read,
+ * and the ranges are cut in parallel.
+ * @param url           Location of PCM (or WAVE) file.
+ * @param channels      Channel number of PCM file.
+ * @param sample_bytes  Bytes per sample.
+ * @param start         First frame of each range.
+ * @param dur           Number of frames of each range.
+ * @param num           Number of ranges.
+ * @param url_out       Location of Output PCM file of each range.
+ */
+int simplest_pcm_cut(const char *url,int channels,int sample_bytes,const long long *start,const long long *dur,int num,const char **url_out){
+	const long long block_size=1024*1024;
+	int frame_size=channels*sample_bytes;
+	long long data_offset=0,data_size=-1;
+	FILE *fp=NULL;
+	int i=0,failed=0;
+
+	if(channels<1||sample_bytes<1){
+		printf("Error: Unsupported PCM layout.\n");
+		return -1;
+	}
+	for(i=0;i<num;i++){
+		if(start[i]<0||dur[i]<0){
+			printf("Error: Invalid range %d (start %lld, duration %lld).\n",i,start[i],dur[i]);
+			return -1;
+		}
+	}
+	if((fp=pcm_open_input(url,&data_size))==NULL){
+		printf("Error: Cannot open input PCM file.\n");
+		return -1;
+	}
+	data_offset=simplest_ftell64(fp);
+	if(data_size<0){
+		simplest_fseek64(fp,0,SEEK_END);
+		data_size=simplest_ftell64(fp)-data_offset;
+	}
+
+#pragma omp parallel for schedule(dynamic) reduction(+:failed)
+	for(i=0;i<num;i++){
+		long long first=start[i]*frame_size;
+		long long size=dur[i]*frame_size;
+		long long done=0;
+		unsigned char *block=NULL;
+		FILE *fp1=NULL;
+
+		if(first>data_size)
+			first=data_size;
+		if(size>data_size-first)
+			size=data_size-first;
+		if((fp1=fopen(url_out[i],"wb"))==NULL){
+			printf("Error: Cannot create %s.\n",url_out[i]);
+			failed++;
+			continue;
+		}
+		block=(unsigned char *)malloc(size<block_size?(size_t)size+1:(size_t)block_size);
+		while(done<size){
+			long long want=(size-done)<block_size?(size-done):block_size;
+			long long n=simplest_pread(fp,block,want,data_offset+first+done);
+			if(n<=0||fwrite(block,1,(size_t)n,fp1)!=(size_t)n)
+				break;
+			done+=n;
+		}
+		if(done<size)
+			failed++;
+		free(block);
+		fclose(fp1);
+	}
+
+	fclose(fp);
+	if(failed)
+		printf("Error: %d ranges not written.\n",failed);
+	return failed?-1:0;
+}
+
 /**
  * Cut a 16LE PCM single channel file.
  * @param url        Location of PCM file.
@@ -613,29 +706,33 @@ int simplest_yuv444_split(char *url, int w, int h,int num){
  * @param dur_num    how much point to cut
  */
 int simplest_pcm16le_cut_singlechannel(char *url,int start_num,int dur_num){
-	FILE *fp=fopen(url,"rb+");
+	FILE *fp=NULL;
 	FILE *fp1=fopen("output_cut.pcm","wb+");
 	FILE *fp_stat=fopen("output_cut.txt","wb+");
-
-	unsigned char *sample=(unsigned char *)malloc(2);
-
-	int cnt=0;
-	while(!feof(fp)){
-		fread(sample,1,2,fp);
-		if(cnt>start_num&&cnt<=(start_num+dur_num)){
-			fwrite(sample,1,2,fp1);
-
-			short samplenum=sample[1];
-			samplenum=samplenum*256;
-			samplenum=samplenum+sample[0];
-
-			fprintf(fp_stat,"%6d,",samplenum);
-			if(cnt%10==0)
-				fprintf(fp_stat,"\n",samplenum);
-		}
-		cnt++;
+	long long data_offset=0,data_size=-1;
+	short *sample=NULL;
+	char *text=NULL;
+	int len=0,num=0,i=0;
+
+	fp=pcm_open_input(url,&data_size);
+	data_offset=simplest_ftell64(fp);
+
+	//Point start_num+1 ... start_num+dur_num, read in one go
+	sample=(short *)malloc((dur_num+1)*sizeof(short));
+	num=(int)(simplest_pread(fp,sample,(long long)dur_num*2,data_offset+(long long)(start_num+1)*2)/2);
+	if(data_size>=0&&(long long)(start_num+1+num)*2>data_size)
+		num=data_size/2>start_num+1?(int)(data_size/2-(start_num+1)):0;
+	fwrite(sample,2,num,fp1);
+
+	text=(char *)malloc(num*8+num/10+2);
+	for(i=0;i<num;i++){
+		len+=sprintf(text+len,"%6d,",sample[i]);
+		if((start_num+1+i)%10==0)
+			text[len++]='\n';
 	}
+	fwrite(text,1,len,fp_stat);
 
+	free(text);
 	free(sample);
 	fclose(fp);
 	fclose(fp1);
@@ -643,32 +740,259 @@ int simplest_pcm16le_cut_singlechannel(char *url,int start_num,int dur_num){
 	return 0;
 }
 
+#define PCM_MAX_CHANNELS 8
+#define PCM_BLOCK_FRAMES 4096
+
+//Interleaved (c0,c1,..,cN) frames -> one planar buffer per channel
+static void pcm_deinterleave(const unsigned char *src,unsigned char **dst,int frames,int channels,int sample_bytes){
+	int i=0,c=0;
+
+	if(channels==1){
+		memcpy(dst[0],src,frames*sample_bytes);
+		return;
+	}
+#ifdef PCM_USE_SSE2
+	if(sample_bytes==2&&channels==2){
+		//L|R|L|R...: low 16bit is L, high 16bit is R
+		for(;i+8<=frames;i+=8){
+			__m128i a=_mm_loadu_si128((const __m128i *)(src+i*4));
+			__m128i b=_mm_loadu_si128((const __m128i *)(src+i*4+16));
+			__m128i l=_mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a,16),16),_mm_srai_epi32(_mm_slli_epi32(b,16),16));
+			__m128i r=_mm_packs_epi32(_mm_srai_epi32(a,16),_mm_srai_epi32(b,16));
+			_mm_storeu_si128((__m128i *)(dst[0]+i*2),l);
+			_mm_storeu_si128((__m128i *)(dst[1]+i*2),r);
+		}
+	}else if(sample_bytes==4&&channels==2){
+		for(;i+4<=frames;i+=4){
+			__m128 a=_mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(src+i*8)));
+			__m128 b=_mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(src+i*8+16)));
+			_mm_storeu_si128((__m128i *)(dst[0]+i*4),_mm_castps_si128(_mm_shuffle_ps(a,b,_MM_SHUFFLE(2,0,2,0))));
+			_mm_storeu_si128((__m128i *)(dst[1]+i*4),_mm_castps_si128(_mm_shuffle_ps(a,b,_MM_SHUFFLE(3,1,3,1))));
+		}
+	}else if(sample_bytes==2&&channels==8){
+		//7.1: 8 frames x 8 channels is a 8x8 transpose of 16bit words
+		for(;i+8<=frames;i+=8){
+			__m128i a[8],b[8],t[8];
+			for(c=0;c<8;c++)
+				a[c]=_mm_loadu_si128((const __m128i *)(src+(i+c)*16));
+			for(c=0;c<8;c+=2){
+				b[c]=_mm_unpacklo_epi16(a[c],a[c+1]);
+				b[c+1]=_mm_unpackhi_epi16(a[c],a[c+1]);
+			}
+			t[0]=_mm_unpacklo_epi32(b[0],b[2]); t[1]=_mm_unpackhi_epi32(b[0],b[2]);
+			t[2]=_mm_unpacklo_epi32(b[1],b[3]); t[3]=_mm_unpackhi_epi32(b[1],b[3]);
+			t[4]=_mm_unpacklo_epi32(b[4],b[6]); t[5]=_mm_unpackhi_epi32(b[4],b[6]);
+			t[6]=_mm_unpacklo_epi32(b[5],b[7]); t[7]=_mm_unpackhi_epi32(b[5],b[7]);
+			for(c=0;c<4;c++){
+				_mm_storeu_si128((__m128i *)(dst[c*2]+i*2),_mm_unpacklo_epi64(t[c],t[c+4]));
+				_mm_storeu_si128((__m128i *)(dst[c*2+1]+i*2),_mm_unpackhi_epi64(t[c],t[c+4]));
+			}
+		}
+	}
+#endif
+	for(c=0;c<channels;c++){
+		const unsigned char *s=src+c*sample_bytes;
+		unsigned char *d=dst[c];
+		int j=0;
+		switch(sample_bytes){
+		case 2:
+			for(j=i;j<frames;j++)
+				((short *)d)[j]=*(const short *)(s+j*channels*2);
+			break;
+		case 4:
+			for(j=i;j<frames;j++)
+				((int *)d)[j]=*(const int *)(s+j*channels*4);
+			break;
+		default:
+			for(j=i;j<frames;j++)
+				memcpy(d+j*sample_bytes,s+j*channels*sample_bytes,sample_bytes);
+			break;
+		}
+	}
+}
+
+//One planar buffer per channel -> interleaved (c0,c1,..,cN) frames
+static void pcm_interleave(unsigned char **src,unsigned char *dst,int frames,int channels,int sample_bytes){
+	int i=0,c=0;
+
+	if(channels==1){
+		memcpy(dst,src[0],frames*sample_bytes);
+		return;
+	}
+#ifdef PCM_USE_SSE2
+	if(sample_bytes==2&&channels==2){
+		for(;i+8<=frames;i+=8){
+			__m128i l=_mm_loadu_si128((const __m128i *)(src[0]+i*2));
+			__m128i r=_mm_loadu_si128((const __m128i *)(src[1]+i*2));
+			_mm_storeu_si128((__m128i *)(dst+i*4),_mm_unpacklo_epi16(l,r));
+			_mm_storeu_si128((__m128i *)(dst+i*4+16),_mm_unpackhi_epi16(l,r));
+		}
+	}else if(sample_bytes==4&&channels==2){
+		for(;i+4<=frames;i+=4){
+			__m128i l=_mm_loadu_si128((const __m128i *)(src[0]+i*4));
+			__m128i r=_mm_loadu_si128((const __m128i *)(src[1]+i*4));
+			_mm_storeu_si128((__m128i *)(dst+i*8),_mm_unpacklo_epi32(l,r));
+			_mm_storeu_si128((__m128i *)(dst+i*8+16),_mm_unpackhi_epi32(l,r));
+		}
+	}else if(sample_bytes==2&&channels==8){
+		//The 8x8 transpose is its own inverse
+		for(;i+8<=frames;i+=8){
+			__m128i a[8],b[8],t[8];
+			for(c=0;c<8;c++)
+				a[c]=_mm_loadu_si128((const __m128i *)(src[c]+i*2));
+			for(c=0;c<8;c+=2){
+				b[c]=_mm_unpacklo_epi16(a[c],a[c+1]);
+				b[c+1]=_mm_unpackhi_epi16(a[c],a[c+1]);
+			}
+			t[0]=_mm_unpacklo_epi32(b[0],b[2]); t[1]=_mm_unpackhi_epi32(b[0],b[2]);
+			t[2]=_mm_unpacklo_epi32(b[1],b[3]); t[3]=_mm_unpackhi_epi32(b[1],b[3]);
+			t[4]=_mm_unpacklo_epi32(b[4],b[6]); t[5]=_mm_unpackhi_epi32(b[4],b[6]);
+			t[6]=_mm_unpacklo_epi32(b[5],b[7]); t[7]=_mm_unpackhi_epi32(b[5],b[7]);
+			for(c=0;c<4;c++){
+				_mm_storeu_si128((__m128i *)(dst+(i+c*2)*16),_mm_unpacklo_epi64(t[c],t[c+4]));
+				_mm_storeu_si128((__m128i *)(dst+(i+c*2+1)*16),_mm_unpackhi_epi64(t[c],t[c+4]));
+			}
+		}
+	}
+#endif
+	for(c=0;c<channels;c++){
+		const unsigned char *s=src[c];
+		unsigned char *d=dst+c*sample_bytes;
+		int j=0;
+		switch(sample_bytes){
+		case 2:
+			for(j=i;j<frames;j++)
+				*(short *)(d+j*channels*2)=((const short *)s)[j];
+			break;
+		case 4:
+			for(j=i;j<frames;j++)
+				*(int *)(d+j*channels*4)=((const int *)s)[j];
+			break;
+		default:
+			for(j=i;j<frames;j++)
+				memcpy(d+j*channels*sample_bytes,s+j*sample_bytes,sample_bytes);
+			break;
+		}
+	}
+}
 
 /**
- * Split Left and Right channel of 16LE PCM file.
- * @param url  Location of PCM file.
- *
+ * Split channels of interleaved PCM file.
+ * @param url           Location of PCM file.
+ * @param channels      Channel number of PCM file (1~8).
+ * @param sample_bytes  Bytes per sample: 2 (s16), 3 (s24), 4 (s32/f32).
+ * @param url_out       Location of Output PCM file of each channel.
  */
-int simplest_pcm16le_split(char *url){
-	FILE *fp=fopen(url,"rb+");
-	FILE *fp1=fopen("output_l.pcm","wb+");
-	FILE *fp2=fopen("output_r.pcm","wb+");
+int simplest_pcm_split(const char *url,int channels,int sample_bytes,const char **url_out){
+	FILE *fp=NULL;
+	FILE *fp_out[PCM_MAX_CHANNELS]={0};
+	unsigned char *block=NULL;
+	unsigned char *plane[PCM_MAX_CHANNELS]={0};
+	int frame_size=channels*sample_bytes;
+	int c=0,frames=0,ret=0;
+	long long remain=-1;
+
+	if(channels<1||channels>PCM_MAX_CHANNELS||sample_bytes<2||sample_bytes>4){
+		printf("Error: Unsupported PCM layout.\n");
+		return -1;
+	}
+	if((fp=pcm_open_input(url,&remain))==NULL){
+		printf("Error: Cannot open input PCM file.\n");
+		return -1;
+	}
+	for(c=0;c<channels;c++){
+		if((fp_out[c]=fopen(url_out[c],"wb"))==NULL){
+			printf("Error: Cannot create output PCM file.\n");
+			ret=-1;
+			goto end;
+		}
+		plane[c]=(unsigned char *)malloc(PCM_BLOCK_FRAMES*sample_bytes);
+	}
+	block=(unsigned char *)malloc(PCM_BLOCK_FRAMES*frame_size);
 
-	unsigned char *sample=(unsigned char *)malloc(4);
+	while((frames=pcm_read(block,frame_size,PCM_BLOCK_FRAMES,fp,&remain))>0){
+		pcm_deinterleave(block,plane,frames,channels,sample_bytes);
+		for(c=0;c<channels;c++)
+			fwrite(plane[c],sample_bytes,frames,fp_out[c]);
+	}
 
-	while(!feof(fp)){
-		fread(sample,1,4,fp);
-		//L
-		fwrite(sample,1,2,fp1);
-		//R
-		fwrite(sample+2,1,2,fp2);
+end:
+	for(c=0;c<channels;c++){
+		if(fp_out[c])
+			fclose(fp_out[c]);
+		free(plane[c]);
 	}
+	free(block);
+	fclose(fp);
+	return ret;
+}
 
-	free(sample);
+/**
+ * Merge single channel PCM files into one interleaved PCM file.
+ * @param url_in        Location of Input PCM file of each channel.
+ * @param channels      Channel number of Output PCM file (1~8).
+ * @param sample_bytes  Bytes per sample: 2 (s16), 3 (s24), 4 (s32/f32).
+ * @param url_out       Location of Output PCM file.
+ */
+int simplest_pcm_merge(const char **url_in,int channels,int sample_bytes,const char *url_out){
+	FILE *fp_in[PCM_MAX_CHANNELS]={0};
+	FILE *fp=NULL;
+	unsigned char *block=NULL;
+	unsigned char *plane[PCM_MAX_CHANNELS]={0};
+	long long remain[PCM_MAX_CHANNELS]={0};
+	int c=0,ret=0;
+
+	if(channels<1||channels>PCM_MAX_CHANNELS||sample_bytes<2||sample_bytes>4){
+		printf("Error: Unsupported PCM layout.\n");
+		return -1;
+	}
+	if((fp=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot create output PCM file.\n");
+		return -1;
+	}
+	for(c=0;c<channels;c++){
+		if((fp_in[c]=pcm_open_input(url_in[c],&remain[c]))==NULL){
+			printf("Error: Cannot open input PCM file.\n");
+			ret=-1;
+			goto end;
+		}
+		plane[c]=(unsigned char *)malloc(PCM_BLOCK_FRAMES*sample_bytes);
+	}
+	block=(unsigned char *)malloc(PCM_BLOCK_FRAMES*channels*sample_bytes);
+
+	while(1){
+		//Stop at the end of the shortest channel
+		int frames=PCM_BLOCK_FRAMES;
+		for(c=0;c<channels;c++){
+			int n=pcm_read(plane[c],sample_bytes,frames,fp_in[c],&remain[c]);
+			if(n<frames)
+				frames=n;
+		}
+		if(frames<=0)
+			break;
+		pcm_interleave(plane,block,frames,channels,sample_bytes);
+		fwrite(block,channels*sample_bytes,frames,fp);
+	}
+
+end:
+	for(c=0;c<channels;c++){
+		if(fp_in[c])
+			fclose(fp_in[c]);
+		free(plane[c]);
+	}
+	free(block);
 	fclose(fp);
-	fclose(fp1);
-	fclose(fp2);
-	return 0;
+	return ret;
+}
+
+/**
+ * Split Left and Right channel of 16LE PCM file.
+ * @param url  Location of PCM file.
+ *
+ */
+int simplest_pcm16le_split(char *url){
+	const char *url_out[2]={"output_l.pcm","output_r.pcm"};
+	return simplest_pcm_split(url,2,2,url_out);
 }
 
 /**
@@ -676,16 +1000,28 @@ int simplest_pcm16le_split(char *url){
  * @param url  Location of PCM file.
  */
 int simplest_pcm16le_halfvolumeleft(char *url){
-	FILE *fp=fopen(url,"rb+");
-	FILE *fp1=fopen("output_halfleft.pcm","wb+");
+	long long remain=-1;
+	FILE *fp=pcm_open_input(url,&remain);
+	FILE *fp1=NULL;
 
 	int cnt=0;
 
-	unsigned char *sample=(unsigned char *)malloc(4);
+	unsigned char *sample=NULL;
 
-	while(!feof(fp)){
+	if(fp==NULL){
+		printf("Error: Cannot open input PCM file.\n");
+		return -1;
+	}
+	if((fp1=fopen("output_halfleft.pcm","wb+"))==NULL){
+		printf("Error: Cannot create output PCM file.\n");
+		fclose(fp);
+		return -1;
+	}
+	sample=(unsigned char *)malloc(4);
+
+	//Only whole L/R frames of sample data, WAVE chunks after it are not samples
+	while(pcm_read(sample,4,1,fp,&remain)==1){
 		short *samplenum=NULL;
-		fread(sample,1,4,fp);
 
 		samplenum=(short *)sample;
 		*samplenum=*samplenum/2;
@@ -709,16 +1045,26 @@ int simplest_pcm16le_halfvolumeleft(char *url){
  * @param url  Location of PCM file.
  */
 int simplest_pcm16le_doublespeed(char *url){
-	FILE *fp=fopen(url,"rb+");
-	FILE *fp1=fopen("output_doublespeed.pcm","wb+");
+	long long remain=-1;
+	FILE *fp=pcm_open_input(url,&remain);
+	FILE *fp1=NULL;
 
 	int cnt=0;
 
-	unsigned char *sample=(unsigned char *)malloc(4);
+	unsigned char *sample=NULL;
 
-	while(!feof(fp)){
+	if(fp==NULL){
+		printf("Error: Cannot open input PCM file.\n");
+		return -1;
+	}
+	if((fp1=fopen("output_doublespeed.pcm","wb+"))==NULL){
+		printf("Error: Cannot create output PCM file.\n");
+		fclose(fp);
+		return -1;
+	}
+	sample=(unsigned char *)malloc(4);
 
-		fread(sample,1,4,fp);
+	while(pcm_read(sample,4,1,fp,&remain)==1){
 
 		if(cnt%2!=0){
 			//L
@@ -736,44 +1082,396 @@ int simplest_pcm16le_doublespeed(char *url){
 	return 0;
 }
 
+typedef struct PCM_FORMAT{
+	const char *name;
+	int bytes;
+	int big_endian;
+	int is_float;
+}PCM_FORMAT;
+
+static const PCM_FORMAT pcm_format_table[]={
+	{"u8",   1,0,0},
+	{"s16le",2,0,0},
+	{"s16be",2,1,0},
+	{"s24le",3,0,0},
+	{"s24be",3,1,0},
+	{"s32le",4,0,0},
+	{"s32be",4,1,0},
+	{"f32le",4,0,1},
+	{"f32be",4,1,1},
+};
+
+static const PCM_FORMAT *pcm_find_format(const char *name){
+	int i=0;
+	for(i=0;i<(int)(sizeof(pcm_format_table)/sizeof(pcm_format_table[0]));i++){
+		if(strcmp(pcm_format_table[i].name,name)==0)
+			return &pcm_format_table[i];
+	}
+	return NULL;
+}
+
+//Fast PRNG (xorshift32), each caller keeps its own state
+static unsigned int pcm_rand(unsigned int *state){
+	unsigned int x=*state;
+	x^=x<<13;
+	x^=x>>17;
+	x^=x<<5;
+	*state=x;
+	return x;
+}
+
+//Samples in any format -> float in [-1.0,1.0)
+static void pcm_decode_float(const PCM_FORMAT *fmt,const unsigned char *src,float *dst,int num){
+	int i=0;
+
+	if(fmt->bytes==1){
+		for(i=0;i<num;i++)
+			dst[i]=(src[i]-128)*(1.0f/128.0f);
+		return;
+	}
+	if(fmt->is_float){
+		if(!fmt->big_endian){
+			memcpy(dst,src,num*4);
+			return;
+		}
+		for(i=0;i<num;i++){
+			const unsigned char *p=src+i*4;
+			unsigned int v=((unsigned int)p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+			memcpy(&dst[i],&v,4);
+		}
+		return;
+	}
+#ifdef PCM_USE_SSE2
+	if(fmt->bytes==2&&!fmt->big_endian){
+		const __m128 scale=_mm_set1_ps(1.0f/32768.0f);
+		for(;i+8<=num;i+=8){
+			__m128i v=_mm_loadu_si128((const __m128i *)(src+i*2));
+			__m128i lo=_mm_srai_epi32(_mm_unpacklo_epi16(v,v),16);
+			__m128i hi=_mm_srai_epi32(_mm_unpackhi_epi16(v,v),16);
+			_mm_storeu_ps(dst+i,_mm_mul_ps(_mm_cvtepi32_ps(lo),scale));
+			_mm_storeu_ps(dst+i+4,_mm_mul_ps(_mm_cvtepi32_ps(hi),scale));
+		}
+	}
+#endif
+	//Integer samples are left-aligned to 32bit, then scaled by 1/2^31
+	for(;i<num;i++){
+		const unsigned char *p=src+i*fmt->bytes;
+		unsigned int v=0;
+		int k=0;
+		for(k=0;k<fmt->bytes;k++){
+			unsigned int byte=fmt->big_endian?p[k]:p[fmt->bytes-1-k];
+			v|=byte<<(24-8*k);
+		}
+		dst[i]=(float)((int)v*(1.0/2147483648.0));
+	}
+}
+
+//Float in [-1.0,1.0) -> samples in any format, returns number of clipped samples
+static int pcm_encode_float(const PCM_FORMAT *fmt,const float *src,const float *dither,unsigned char *dst,int num){
+	int i=0,clip=0;
+
+	if(fmt->is_float){
+		for(i=0;i<num;i++){
+			unsigned char *p=dst+i*4;
+			unsigned int v=0;
+			memcpy(&v,&src[i],4);
+			if(fmt->big_endian){
+				p[0]=v>>24; p[1]=v>>16; p[2]=v>>8; p[3]=v;
+			}else{
+				memcpy(p,&v,4);
+			}
+		}
+		return 0;
+	}
+#ifdef PCM_USE_SSE2
+	if(fmt->bytes==2&&!fmt->big_endian){
+		//Same arithmetic as the scalar path: floor(x*scale+dither+0.5) in double
+		const __m128d scale=_mm_set1_pd(32768.0),half=_mm_set1_pd(0.5),one=_mm_set1_pd(1.0);
+		const __m128d vmax=_mm_set1_pd(32767.0),vmin=_mm_set1_pd(-32768.0);
+		//Keeps cvttpd_epi32 away from its INT_MIN overflow result
+		const __m128d lim_max=_mm_set1_pd(65536.0),lim_min=_mm_set1_pd(-65536.0);
+		for(;i+8<=num;i+=8){
+			__m128i v[4];
+			int k=0,mask=0;
+			for(k=0;k<4;k++){
+				__m128d s=_mm_mul_pd(_mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(src+i+2*k)))),scale);
+				__m128d t;
+				if(dither)
+					s=_mm_add_pd(s,_mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(dither+i+2*k)))));
+				s=_mm_add_pd(s,half);
+				//NaN becomes 0 (not clipped), as in the scalar path
+				s=_mm_andnot_pd(_mm_cmpunord_pd(s,s),s);
+				s=_mm_min_pd(_mm_max_pd(s,lim_min),lim_max);
+				t=_mm_cvtepi32_pd(_mm_cvttpd_epi32(s));
+				t=_mm_sub_pd(t,_mm_and_pd(_mm_cmplt_pd(s,t),one));
+				mask=_mm_movemask_pd(_mm_or_pd(_mm_cmpgt_pd(t,vmax),_mm_cmplt_pd(t,vmin)));
+				clip+=(mask&1)+(mask>>1);
+				v[k]=_mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(t,vmin),vmax));
+			}
+			_mm_storeu_si128((__m128i *)(dst+i*2),_mm_packs_epi32(_mm_unpacklo_epi64(v[0],v[1]),_mm_unpacklo_epi64(v[2],v[3])));
+		}
+	}
+#endif
+	{
+		int bits=fmt->bytes*8;
+		double scale=ldexp(1.0,bits-1);
+		double vmax=scale-1.0,vmin=-scale;
+		for(;i<num;i++){
+			unsigned char *p=dst+i*fmt->bytes;
+			double s=floor(src[i]*scale+(dither?dither[i]:0.0f)+0.5);
+			int v=0,k=0;
+			//NaN passes both comparisons, and (int)NaN is undefined
+			if(s!=s){
+				s=0;
+			}else if(s>vmax){
+				s=vmax;
+				clip++;
+			}else if(s<vmin){
+				s=vmin;
+				clip++;
+			}
+			v=(int)s;
+			if(fmt->bytes==1){
+				p[0]=(unsigned char)(v+128);
+				continue;
+			}
+			for(k=0;k<fmt->bytes;k++){
+				unsigned char byte=(unsigned char)(v>>(8*k));
+				if(fmt->big_endian)
+					p[fmt->bytes-1-k]=byte;
+				else
+					p[k]=byte;
+			}
+		}
+	}
+	return clip;
+}
+
+/**
+ * Convert sample format of PCM file.
+ * @param url_in   Location of Input PCM file.
+ * @param fmt_in   Sample format of Input PCM file:
+ *                 u8, s16le, s16be, s24le, s24be, s32le, s32be, f32le, f32be.
+ * @param url_out  Location of Output PCM file.
+ * @param fmt_out  Sample format of Output PCM file.
+ * @param dither   Add TPDF dither when output is integer (1) or not (0).
+ */
+int simplest_pcm_convert(const char *url_in,const char *fmt_in,const char *url_out,const char *fmt_out,int dither){
+	const PCM_FORMAT *in=pcm_find_format(fmt_in);
+	const PCM_FORMAT *out=pcm_find_format(fmt_out);
+	const int block_num=PCM_BLOCK_FRAMES*PCM_MAX_CHANNELS;
+	unsigned char *buf_in=NULL,*buf_out=NULL;
+	float *buf_float=NULL,*buf_dither=NULL;
+	unsigned int seed=0x12345678;
+	FILE *fp=NULL,*fp1=NULL;
+	long long cnt=0,clip=0,remain=-1;
+	float peak=0;
+	int num=0,i=0;
+
+	if(in==NULL||out==NULL){
+		printf("Error: Unsupported sample format.\n");
+		return -1;
+	}
+	if((fp=pcm_open_input(url_in,&remain))==NULL){
+		printf("Error: Cannot open input PCM file.\n");
+		return -1;
+	}
+	if((fp1=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot create output PCM file.\n");
+		fclose(fp);
+		return -1;
+	}
+	//Dither only makes sense when quantizing to integer
+	if(out->is_float)
+		dither=0;
+
+	buf_in=(unsigned char *)malloc(block_num*in->bytes);
+	buf_out=(unsigned char *)malloc(block_num*out->bytes);
+	buf_float=(float *)malloc(block_num*sizeof(float));
+	if(dither)
+		buf_dither=(float *)malloc(block_num*sizeof(float));
+
+	while((num=pcm_read(buf_in,in->bytes,block_num,fp,&remain))>0){
+		pcm_decode_float(in,buf_in,buf_float,num);
+		for(i=0;i<num;i++){
+			float a=fabs(buf_float[i]);
+			if(a>peak)
+				peak=a;
+		}
+		if(dither){
+			//TPDF: difference of two uniform variables, +-1 LSB
+			for(i=0;i<num;i++)
+				buf_dither[i]=((int)(pcm_rand(&seed)>>8)-(int)(pcm_rand(&seed)>>8))*(1.0f/16777216.0f);
+		}
+		clip+=pcm_encode_float(out,buf_float,buf_dither,buf_out,num);
+		fwrite(buf_out,out->bytes,num,fp1);
+		cnt+=num;
+	}
+
+	printf("Sample Cnt:%lld\n",cnt);
+	printf("Clipped Cnt:%lld\n",clip);
+	printf("Peak:%.2f dBFS\n",peak>0?20*log10(peak):-144.0);
+
+	free(buf_in);
+	free(buf_out);
+	free(buf_float);
+	free(buf_dither);
+	fclose(fp);
+	fclose(fp1);
+	return 0;
+}
+
 /**
  * Convert PCM-16 data to PCM-8 data.
  * @param url  Location of PCM file.
  */
 int simplest_pcm16le_to_pcm8(char *url){
-	FILE *fp=fopen(url,"rb+");
-	FILE *fp1=fopen("output_8.pcm","wb+");
-
-	int cnt=0;
+	return simplest_pcm_convert(url,"s16le","output_8.pcm","u8",1);
+}
 
-	unsigned char *sample=(unsigned char *)malloc(4);
+//WAVE headers are little endian with fixed width fields
+#pragma pack(push,1)
+typedef struct WAVE_HEADER{
+	char fccID[4];                //"RIFF", or "RF64" beyond 4GB
+	unsigned int dwSize;
+	char fccType[4];              //"WAVE"
+}WAVE_HEADER;
+
+typedef struct WAVE_CHUNK{
+	char fccID[4];
+	unsigned int dwSize;
+}WAVE_CHUNK;
+
+typedef struct WAVE_FMT{
+	unsigned short wFormatTag;
+	unsigned short wChannels;
+	unsigned int dwSamplesPerSec;
+	unsigned int dwAvgBytesPerSec;
+	unsigned short wBlockAlign;
+	unsigned short uiBitsPerSample;
+}WAVE_FMT;
+
+typedef struct WAVE_DS64{
+	unsigned long long riffSize;
+	unsigned long long dataSize;
+	unsigned long long sampleCount;
+	unsigned int tableLength;
+}WAVE_DS64;
+#pragma pack(pop)
+
+#define WAVE_FORMAT_PCM        1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+typedef struct WAVE_WRITER{
+	FILE *fp;
+	WAVE_FMT fmt;
+	long long data_size;
+}WAVE_WRITER;
+
+/*
+ * Layout: RIFF | JUNK (ds64 sized) | fmt | data.
+ * The JUNK chunk is turned into ds64 when the file grows beyond 4GB,
+ * so the header never has to move.
+ */
+static void wave_writer_header(WAVE_WRITER *w){
+	WAVE_HEADER header;
+	WAVE_CHUNK chunk;
+	WAVE_DS64 ds64;
+	long long pad=w->data_size&1;
+	long long riff_size=4+(sizeof(WAVE_CHUNK)+sizeof(WAVE_DS64))+(sizeof(WAVE_CHUNK)+sizeof(WAVE_FMT))
+		+sizeof(WAVE_CHUNK)+w->data_size+pad;
+	int rf64=riff_size>0xFFFFFFFFLL;
+
+	memset(&ds64,0,sizeof(ds64));
+	memcpy(header.fccID,rf64?"RF64":"RIFF",4);
+	header.dwSize=rf64?0xFFFFFFFF:(unsigned int)riff_size;
+	memcpy(header.fccType,"WAVE",4);
+	fwrite(&header,sizeof(header),1,w->fp);
+
+	memcpy(chunk.fccID,rf64?"ds64":"JUNK",4);
+	chunk.dwSize=sizeof(WAVE_DS64);
+	fwrite(&chunk,sizeof(chunk),1,w->fp);
+	if(rf64){
+		ds64.riffSize=riff_size;
+		ds64.dataSize=w->data_size;
+		ds64.sampleCount=w->data_size/w->fmt.wBlockAlign;
+	}
+	fwrite(&ds64,sizeof(ds64),1,w->fp);
 
-	while(!feof(fp)){
+	memcpy(chunk.fccID,"fmt ",4);
+	chunk.dwSize=sizeof(WAVE_FMT);
+	fwrite(&chunk,sizeof(chunk),1,w->fp);
+	fwrite(&w->fmt,sizeof(WAVE_FMT),1,w->fp);
 
-		short *samplenum16=NULL;
-		char samplenum8=0;
-		unsigned char samplenum8_u=0;
-		fread(sample,1,4,fp);
-		//(-32768-32767)
-		samplenum16=(short *)sample;
-		samplenum8=(*samplenum16)>>8;
-		//(0-255)
-		samplenum8_u=samplenum8+128;
-		//L
-		fwrite(&samplenum8_u,1,1,fp1);
+	memcpy(chunk.fccID,"data",4);
+	chunk.dwSize=rf64?0xFFFFFFFF:(unsigned int)w->data_size;
+	fwrite(&chunk,sizeof(chunk),1,w->fp);
+}
 
-		samplenum16=(short *)(sample+2);
-		samplenum8=(*samplenum16)>>8;
-		samplenum8_u=samplenum8+128;
-		//R
-		fwrite(&samplenum8_u,1,1,fp1);
-		cnt++;
+static int wave_writer_open(WAVE_WRITER *w,const char *wavepath,const PCM_FORMAT *pcm,int channels,int sample_rate){
+	memset(w,0,sizeof(WAVE_WRITER));
+	if(pcm->big_endian){
+		printf("Error: WAVE does not store big endian samples.\n");
+		return -1;
 	}
-	printf("Sample Cnt:%d\n",cnt);
+	if((w->fp=fopen(wavepath,"wb"))==NULL){
+		printf("Create wav file error\n");
+		return -1;
+	}
+	w->fmt.wFormatTag=pcm->is_float?WAVE_FORMAT_IEEE_FLOAT:WAVE_FORMAT_PCM;
+	w->fmt.wChannels=channels;
+	w->fmt.dwSamplesPerSec=sample_rate;
+	w->fmt.uiBitsPerSample=pcm->bytes*8;
+	w->fmt.wBlockAlign=channels*pcm->bytes;
+	w->fmt.dwAvgBytesPerSec=sample_rate*w->fmt.wBlockAlign;
+	wave_writer_header(w);
+	return 0;
+}
 
-	free(sample);
+static void wave_writer_close(WAVE_WRITER *w){
+	if(w->data_size&1)
+		fputc(0,w->fp);
+	rewind(w->fp);
+	wave_writer_header(w);
+	fclose(w->fp);
+	w->fp=NULL;
+}
+
+/**
+ * Convert PCM raw data to WAVE format
+ * @param pcmpath      Input PCM file.
+ * @param fmt          Sample format of PCM file: u8, s16le, s24le, s32le, f32le.
+ * @param channels     Channel number of PCM file.
+ * @param sample_rate  Sample rate of PCM file.
+ * @param wavepath     Output WAVE file.
+ */
+int simplest_pcm_to_wave(const char *pcmpath,const char *fmt,int channels,int sample_rate,const char *wavepath){
+	const PCM_FORMAT *pcm=pcm_find_format(fmt);
+	WAVE_WRITER writer;
+	FILE *fp=NULL;
+	long long size=0;
+
+	if(pcm==NULL||channels<1||sample_rate<1){
+		printf("Error: Unsupported PCM layout.\n");
+		return -1;
+	}
+	fp=fopen(pcmpath,"rb");
+	if(fp==NULL){
+		printf("Open pcm file error\n");
+		return -1;
+	}
+	if(wave_writer_open(&writer,wavepath,pcm,channels,sample_rate)<0){
+		fclose(fp);
+		return -1;
+	}
+	simplest_fseek64(fp,0,SEEK_END);
+	size=simplest_ftell64(fp);
+	//Whole frames only
+	size-=size%writer.fmt.wBlockAlign;
+	writer.data_size=simplest_copy_range(fp,0,size,writer.fp);
+	wave_writer_close(&writer);
 	fclose(fp);
-	fclose(fp1);
 	return 0;
 }
 
@@ -786,91 +1484,1687 @@ int simplest_pcm16le_to_pcm8(char *url){
  */
 int simplest_pcm16le_to_wave(const char *pcmpath,int channels,int sample_rate,const char *wavepath)
 {
-	typedef struct WAVE_HEADER{
-		char fccID[4];
-		unsigned long dwSize;
-		char fccType[4];
-	}WAVE_HEADER;
-
-	typedef struct WAVE_FMT{
-		char  fccID[4];
-		unsigned long dwSize;
-		unsigned short wFormatTag;
-		unsigned short wChannels;
-		unsigned long dwSamplesPerSec;
-		unsigned long dwAvgBytesPerSec;
-		unsigned short wBlockAlign;
-		unsigned short uiBitsPerSample;
-	}WAVE_FMT;
-
-	typedef struct WAVE_DATA{
-		char       fccID[4];
-		unsigned long dwSize;
-	}WAVE_DATA;
-
-
 	if(channels==0||sample_rate==0){
 		channels = 2;
 		sample_rate = 44100;
 	}
-	int bits = 16;
-
-    WAVE_HEADER pcmHEADER;
-    WAVE_FMT pcmFMT;
-    WAVE_DATA pcmDATA;
-
-    unsigned short m_pcmData;
-    FILE *fp,*fpout;
-
-	fp=fopen(pcmpath,"rb+");
-    if(fp == NULL) {
-        printf("Open pcm file error\n");
-        return -1;
-    }
-	fpout=fopen(wavepath,"wb+");
-    if(fpout == NULL) {
-        printf("Create wav file error\n");
-        return -1;
-    }
-	//WAVE_HEADER
-    memcpy(pcmHEADER.fccID,"RIFF",strlen("RIFF"));
-    memcpy(pcmHEADER.fccType,"WAVE",strlen("WAVE"));
-    fseek(fpout,sizeof(WAVE_HEADER),1);
-	//WAVE_FMT
-    pcmFMT.dwSamplesPerSec=sample_rate;
-    pcmFMT.dwAvgBytesPerSec=pcmFMT.dwSamplesPerSec*sizeof(m_pcmData);
-    pcmFMT.uiBitsPerSample=bits;
-    memcpy(pcmFMT.fccID,"fmt ",strlen("fmt "));
-    pcmFMT.dwSize=16;
-    pcmFMT.wBlockAlign=2;
-    pcmFMT.wChannels=channels;
-    pcmFMT.wFormatTag=1;
-
-    fwrite(&pcmFMT,sizeof(WAVE_FMT),1,fpout);
-
-    //WAVE_DATA;
-    memcpy(pcmDATA.fccID,"data",strlen("data"));
-    pcmDATA.dwSize=0;
-    fseek(fpout,sizeof(WAVE_DATA),SEEK_CUR);
-
-    fread(&m_pcmData,sizeof(unsigned short),1,fp);
-    while(!feof(fp)){
-        pcmDATA.dwSize+=2;
-        fwrite(&m_pcmData,sizeof(unsigned short),1,fpout);
-        fread(&m_pcmData,sizeof(unsigned short),1,fp);
-    }
-
-    pcmHEADER.dwSize=44+pcmDATA.dwSize;
-
-    rewind(fpout);
-    fwrite(&pcmHEADER,sizeof(WAVE_HEADER),1,fpout);
-    fseek(fpout,sizeof(WAVE_FMT),SEEK_CUR);
-    fwrite(&pcmDATA,sizeof(WAVE_DATA),1,fpout);
-	
+	return simplest_pcm_to_wave(pcmpath,"s16le",channels,sample_rate,wavepath);
+}
+
+static unsigned int wave_rl16(const unsigned char *p){
+	return p[0]|(p[1]<<8);
+}
+
+static unsigned int wave_rl32(const unsigned char *p){
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((unsigned int)p[3]<<24);
+}
+
+/**
+ * Parse header of WAVE file.
+ * @param wavepath     Location of WAVE file.
+ * @param channels     Output, channel number.
+ * @param sample_rate  Output, sample rate.
+ * @param fmt          Output, sample format: u8, s16le, s24le, s32le, f32le.
+ * @param data_offset  Output, position of sample data.
+ * @param data_size    Output, size of sample data.
+ * @return             0 on success, -1 if it is not a WAVE file.
+ */
+int simplest_wave_probe(const char *wavepath,int *channels,int *sample_rate,const char **fmt,long long *data_offset,long long *data_size){
+	long long size=0,avail=0,pos=12,ds64_data_size=-1;
+	unsigned char *data=simplest_map_file(wavepath,&size);
+	unsigned char *head=NULL;
+	int tag=0,bits=0,found_fmt=0,found_data=0,rf64=0;
+
+	avail=size;
+	if(data==NULL){
+		//Cannot be mapped (e.g. too large for 32bit address space), parse the first 64KB
+		FILE *fp=fopen(wavepath,"rb");
+		if(fp==NULL)
+			return -1;
+		head=(unsigned char *)malloc(64*1024);
+		avail=fread(head,1,64*1024,fp);
+		simplest_fseek64(fp,0,SEEK_END);
+		size=simplest_ftell64(fp);
+		fclose(fp);
+		data=head;
+	}
+	if(avail>=12&&(memcmp(data,"RIFF",4)==0||memcmp(data,"RF64",4)==0)&&memcmp(data+8,"WAVE",4)==0)
+		rf64=memcmp(data,"RF64",4)==0;
+	else
+		pos=avail;
+
+	while(pos+8<=avail&&!found_data){
+		const unsigned char *chunk=data+pos;
+		long long chunk_size=wave_rl32(chunk+4);
+		if(memcmp(chunk,"ds64",4)==0&&pos+8+16<=avail){
+			ds64_data_size=wave_rl32(chunk+16)|((long long)wave_rl32(chunk+20)<<32);
+		}else if(memcmp(chunk,"fmt ",4)==0&&chunk_size>=16&&pos+8+chunk_size<=avail){
+			tag=wave_rl16(chunk+8);
+			*channels=wave_rl16(chunk+10);
+			*sample_rate=wave_rl32(chunk+12);
+			bits=wave_rl16(chunk+22);
+			//WAVE_FORMAT_EXTENSIBLE: the real tag starts the SubFormat GUID
+			if(tag==WAVE_FORMAT_EXTENSIBLE&&chunk_size>=40)
+				tag=wave_rl16(chunk+8+24);
+			found_fmt=1;
+		}else if(memcmp(chunk,"data",4)==0){
+			*data_offset=pos+8;
+			if(rf64&&chunk_size==0xFFFFFFFFLL&&ds64_data_size>=0)
+				chunk_size=ds64_data_size;
+			//Truncated file
+			if(chunk_size>size-*data_offset)
+				chunk_size=size-*data_offset;
+			*data_size=chunk_size;
+			found_data=1;
+		}
+		pos+=8+chunk_size+(chunk_size&1);
+	}
+	if(head)
+		free(head);
+	else
+		simplest_unmap_file(data,size);
+
+	if(!found_fmt||!found_data)
+		return -1;
+	if(tag==WAVE_FORMAT_PCM&&bits==8)
+		*fmt="u8";
+	else if(tag==WAVE_FORMAT_PCM&&bits==16)
+		*fmt="s16le";
+	else if(tag==WAVE_FORMAT_PCM&&bits==24)
+		*fmt="s24le";
+	else if(tag==WAVE_FORMAT_PCM&&bits==32)
+		*fmt="s32le";
+	else if(tag==WAVE_FORMAT_IEEE_FLOAT&&bits==32)
+		*fmt="f32le";
+	else
+		return -1;
+	return 0;
+}
+
+/**
+ * Extract sample data of WAVE file to PCM raw data.
+ * @param wavepath     Input WAVE file.
+ * @param pcmpath      Output PCM file.
+ */
+int simplest_wave_to_pcm(const char *wavepath,const char *pcmpath){
+	int channels=0,sample_rate=0;
+	const char *fmt=NULL;
+	long long data_offset=0,data_size=0;
+	FILE *fp=NULL,*fp1=NULL;
+
+	if(simplest_wave_probe(wavepath,&channels,&sample_rate,&fmt,&data_offset,&data_size)<0){
+		printf("Error: Not a WAVE file.\n");
+		return -1;
+	}
+	if((fp=fopen(wavepath,"rb"))==NULL||(fp1=fopen(pcmpath,"wb"))==NULL){
+		printf("Error: Cannot open file.\n");
+		if(fp)
+			fclose(fp);
+		return -1;
+	}
+	simplest_copy_range(fp,data_offset,data_size,fp1);
+	printf("WAVE: %d channels, %d Hz, %s, %lld bytes\n",channels,sample_rate,fmt,data_size);
+
 	fclose(fp);
-    fclose(fpout);
+	fclose(fp1);
+	return 0;
+}
+
+//Open PCM input. WAVE file is positioned at its sample data.
+//size: bytes of sample data, -1 for raw PCM (read until end of file).
+static FILE *pcm_open_input(const char *url,long long *size){
+	int channels=0,sample_rate=0;
+	const char *fmt=NULL;
+	long long data_offset=0,data_size=-1;
+	FILE *fp=fopen(url,"rb");
+
+	if(fp!=NULL&&simplest_wave_probe(url,&channels,&sample_rate,&fmt,&data_offset,&data_size)==0)
+		simplest_fseek64(fp,data_offset,SEEK_SET);
+	else
+		data_size=-1;
+	if(size)
+		*size=data_size;
+	return fp;
+}
+
+//fread() which stops at the end of sample data
+static int pcm_read(void *buf,int size,int count,FILE *fp,long long *remain){
+	int n=0;
+	if(*remain>=0&&count>*remain/size)
+		count=(int)(*remain/size);
+	if(count<=0)
+		return 0;
+	n=fread(buf,size,count,fp);
+	if(*remain>=0)
+		*remain-=(long long)n*size;
+	return n;
+}
+
+#define LOUDNESS_HIST_MIN   -70.0
+#define LOUDNESS_HIST_STEP  0.1
+#define LOUDNESS_HIST_BINS  1000
+#define TRUEPEAK_TAPS       12
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+typedef struct LOUDNESS_RESULT{
+	double integrated;          //LUFS
+	double range;               //LU
+	double max_momentary;       //LUFS
+	double max_shortterm;       //LUFS
+	double true_peak;           //dBTP
+	long long frames;
+	int sample_rate;
+}LOUDNESS_RESULT;
+
+typedef struct LOUDNESS_METER{
+	int channels;
+	int subblock_len;           //100ms
+	int subblock_pos;
+	long long subblock_cnt;
+	//K-weighting: high shelf then high pass, transposed direct form II
+	double b[2][3],a[2][3];
+	double z[PCM_MAX_CHANNELS][2][2];
+	double weight[PCM_MAX_CHANNELS];
+	double sumsq[PCM_MAX_CHANNELS];
+	//Energy of the last 30 sub-blocks (3s)
+	double ring[30];
+	//Gating histograms: constant memory for any duration
+	long long m_count[LOUDNESS_HIST_BINS];
+	double m_energy[LOUDNESS_HIST_BINS];
+	long long s_count[LOUDNESS_HIST_BINS];
+	double s_energy[LOUDNESS_HIST_BINS];
+	double max_momentary,max_shortterm;
+	//True peak: 4x oversampling polyphase FIR
+	float tp_coef[4][TRUEPEAK_TAPS];
+	//History stored twice, so the newest TRUEPEAK_TAPS samples are always contiguous
+	float tp_hist[PCM_MAX_CHANNELS][TRUEPEAK_TAPS*2];
+	int tp_pos[PCM_MAX_CHANNELS];
+	float true_peak;
+}LOUDNESS_METER;
+
+static double loudness_lufs(double energy){
+	return energy>0?-0.691+10*log10(energy):-HUGE_VAL;
+}
+
+static void loudness_init(LOUDNESS_METER *m,int channels,int sample_rate){
+	double f0,q,k,vh,vb,a0;
+	int c=0,p=0,j=0;
+
+	memset(m,0,sizeof(LOUDNESS_METER));
+	m->channels=channels;
+	m->subblock_len=sample_rate/10;
+	m->max_momentary=m->max_shortterm=-HUGE_VAL;
+
+	//BS.1770 filters, recomputed for the actual sample rate
+	f0=1681.974450955533;
+	q=0.7071752369554196;
+	k=tan(M_PI*f0/sample_rate);
+	vh=pow(10.0,3.999843853973347/20.0);
+	vb=pow(vh,0.4996667741545416);
+	a0=1.0+k/q+k*k;
+	m->b[0][0]=(vh+vb*k/q+k*k)/a0;
+	m->b[0][1]=2.0*(k*k-vh)/a0;
+	m->b[0][2]=(vh-vb*k/q+k*k)/a0;
+	m->a[0][1]=2.0*(k*k-1.0)/a0;
+	m->a[0][2]=(1.0-k/q+k*k)/a0;
+
+	f0=38.13547087602444;
+	q=0.5003270373238773;
+	k=tan(M_PI*f0/sample_rate);
+	a0=1.0+k/q+k*k;
+	m->b[1][0]=1.0;
+	m->b[1][1]=-2.0;
+	m->b[1][2]=1.0;
+	m->a[1][1]=2.0*(k*k-1.0)/a0;
+	m->a[1][2]=(1.0-k/q+k*k)/a0;
+
+	//L, R, C, LFE, Ls, Rs, ...: LFE is excluded, surrounds get +1.5dB
+	for(c=0;c<channels;c++){
+		m->weight[c]=1.0;
+		if(channels>=6&&c==3)
+			m->weight[c]=0.0;
+		else if(channels>=6&&c>=4)
+			m->weight[c]=1.41;
+	}
+
+	//Blackman-windowed sinc, 48 taps split into 4 phases
+	for(p=0;p<4;p++){
+		for(j=0;j<TRUEPEAK_TAPS;j++){
+			double t=(j*4+p)-(TRUEPEAK_TAPS*4-1)/2.0;
+			double x=t/4.0;
+			double sinc=fabs(x)<1e-9?1.0:sin(M_PI*x)/(M_PI*x);
+			double r=t/((TRUEPEAK_TAPS*4)/2.0);
+			double w=0.42+0.5*cos(M_PI*r)+0.08*cos(2*M_PI*r);
+			m->tp_coef[p][j]=(float)(sinc*w);
+		}
+	}
+}
+
+static void loudness_histogram_add(long long *count,double *energy,double e){
+	double l=loudness_lufs(e);
+	int bin=0;
+	if(l<LOUDNESS_HIST_MIN)
+		return;
+	bin=(int)((l-LOUDNESS_HIST_MIN)/LOUDNESS_HIST_STEP);
+	if(bin>=LOUDNESS_HIST_BINS)
+		bin=LOUDNESS_HIST_BINS-1;
+	count[bin]++;
+	energy[bin]+=e;
+}
+
+static void loudness_subblock_end(LOUDNESS_METER *m){
+	double e=0;
+	int c=0,i=0;
 
-    return 0;
+	for(c=0;c<m->channels;c++){
+		e+=m->weight[c]*m->sumsq[c]/m->subblock_len;
+		m->sumsq[c]=0;
+	}
+	m->ring[m->subblock_cnt%30]=e;
+	m->subblock_cnt++;
+	m->subblock_pos=0;
+
+	//Momentary: 400ms window, 100ms step
+	if(m->subblock_cnt>=4){
+		double em=0;
+		for(i=1;i<=4;i++)
+			em+=m->ring[(m->subblock_cnt-i)%30];
+		em/=4;
+		loudness_histogram_add(m->m_count,m->m_energy,em);
+		if(loudness_lufs(em)>m->max_momentary)
+			m->max_momentary=loudness_lufs(em);
+	}
+	//Short-term: 3s window, 100ms step
+	if(m->subblock_cnt>=30){
+		double es=0;
+		for(i=0;i<30;i++)
+			es+=m->ring[i];
+		es/=30;
+		loudness_histogram_add(m->s_count,m->s_energy,es);
+		if(loudness_lufs(es)>m->max_shortterm)
+			m->max_shortterm=loudness_lufs(es);
+	}
+}
+
+//Filter 'frames' interleaved float frames (no sub-block boundary inside)
+static void loudness_filter(LOUDNESS_METER *m,const float *x,int frames){
+	int c=0,i=0;
+	for(c=0;c<m->channels;c+=2){
+#ifdef PCM_USE_SSE2
+		//Two channels per SSE2 register, the missing lane of an odd channel count stays zero
+		int two=(c+1<m->channels);
+		__m128d b0=_mm_set1_pd(m->b[0][0]),b1=_mm_set1_pd(m->b[0][1]),b2=_mm_set1_pd(m->b[0][2]);
+		__m128d a1=_mm_set1_pd(m->a[0][1]),a2=_mm_set1_pd(m->a[0][2]);
+		__m128d hb0=_mm_set1_pd(m->b[1][0]),hb1=_mm_set1_pd(m->b[1][1]),hb2=_mm_set1_pd(m->b[1][2]);
+		__m128d ha1=_mm_set1_pd(m->a[1][1]),ha2=_mm_set1_pd(m->a[1][2]);
+		__m128d z00=_mm_set_pd(two?m->z[c+1][0][0]:0,m->z[c][0][0]);
+		__m128d z01=_mm_set_pd(two?m->z[c+1][0][1]:0,m->z[c][0][1]);
+		__m128d z10=_mm_set_pd(two?m->z[c+1][1][0]:0,m->z[c][1][0]);
+		__m128d z11=_mm_set_pd(two?m->z[c+1][1][1]:0,m->z[c][1][1]);
+		__m128d acc=_mm_setzero_pd();
+		double out[2];
+		for(i=0;i<frames;i++){
+			const float *f=x+i*m->channels+c;
+			__m128d in=_mm_set_pd(two?f[1]:0.0,f[0]);
+			__m128d y=_mm_add_pd(_mm_mul_pd(b0,in),z00);
+			__m128d v;
+			z00=_mm_sub_pd(_mm_add_pd(_mm_mul_pd(b1,in),z01),_mm_mul_pd(a1,y));
+			z01=_mm_sub_pd(_mm_mul_pd(b2,in),_mm_mul_pd(a2,y));
+			v=_mm_add_pd(_mm_mul_pd(hb0,y),z10);
+			z10=_mm_sub_pd(_mm_add_pd(_mm_mul_pd(hb1,y),z11),_mm_mul_pd(ha1,v));
+			z11=_mm_sub_pd(_mm_mul_pd(hb2,y),_mm_mul_pd(ha2,v));
+			acc=_mm_add_pd(acc,_mm_mul_pd(v,v));
+		}
+		_mm_storeu_pd(out,z00); m->z[c][0][0]=out[0]; if(two) m->z[c+1][0][0]=out[1];
+		_mm_storeu_pd(out,z01); m->z[c][0][1]=out[0]; if(two) m->z[c+1][0][1]=out[1];
+		_mm_storeu_pd(out,z10); m->z[c][1][0]=out[0]; if(two) m->z[c+1][1][0]=out[1];
+		_mm_storeu_pd(out,z11); m->z[c][1][1]=out[0]; if(two) m->z[c+1][1][1]=out[1];
+		_mm_storeu_pd(out,acc); m->sumsq[c]+=out[0]; if(two) m->sumsq[c+1]+=out[1];
+#else
+		int k=0;
+		for(k=c;k<c+2&&k<m->channels;k++){
+			double *z0=m->z[k][0],*z1=m->z[k][1];
+			double acc=0;
+			for(i=0;i<frames;i++){
+				double in=x[i*m->channels+k];
+				double y=m->b[0][0]*in+z0[0];
+				double v=0;
+				z0[0]=m->b[0][1]*in+z0[1]-m->a[0][1]*y;
+				z0[1]=m->b[0][2]*in-m->a[0][2]*y;
+				v=m->b[1][0]*y+z1[0];
+				z1[0]=m->b[1][1]*y+z1[1]-m->a[1][1]*v;
+				z1[1]=m->b[1][2]*y-m->a[1][2]*v;
+				acc+=v*v;
+			}
+			m->sumsq[k]+=acc;
+		}
+#endif
+	}
+}
+
+static void loudness_truepeak(LOUDNESS_METER *m,const float *x,int frames){
+	int c=0,i=0,p=0,j=0;
+	for(c=0;c<m->channels;c++){
+		float peak=m->true_peak;
+		int pos=m->tp_pos[c];
+		for(i=0;i<frames;i++){
+			const float *h=NULL;
+			float s=x[i*m->channels+c];
+			pos=(pos==0)?TRUEPEAK_TAPS-1:pos-1;
+			m->tp_hist[c][pos]=m->tp_hist[c][pos+TRUEPEAK_TAPS]=s;
+			h=m->tp_hist[c]+pos;
+			for(p=0;p<4;p++){
+				float y=0;
+				for(j=0;j<TRUEPEAK_TAPS;j++)
+					y+=m->tp_coef[p][j]*h[j];
+				if(fabs(y)>peak)
+					peak=fabs(y);
+			}
+			if(fabs(s)>peak)
+				peak=fabs(s);
+		}
+		m->tp_pos[c]=pos;
+		m->true_peak=peak;
+	}
 }
 
+static void loudness_process(LOUDNESS_METER *m,const float *x,int frames){
+	while(frames>0){
+		int n=m->subblock_len-m->subblock_pos;
+		if(n>frames)
+			n=frames;
+		loudness_filter(m,x,n);
+		loudness_truepeak(m,x,n);
+		m->subblock_pos+=n;
+		if(m->subblock_pos==m->subblock_len)
+			loudness_subblock_end(m);
+		x+=n*m->channels;
+		frames-=n;
+	}
+}
+
+static double loudness_gated_mean(const long long *count,const double *energy,double gate){
+	long long n=0;
+	double e=0;
+	int i=0;
+	for(i=0;i<LOUDNESS_HIST_BINS;i++){
+		if(LOUDNESS_HIST_MIN+(i+0.5)*LOUDNESS_HIST_STEP>=gate){
+			n+=count[i];
+			e+=energy[i];
+		}
+	}
+	return n>0?e/n:0;
+}
+
+static void loudness_result(LOUDNESS_METER *m,LOUDNESS_RESULT *r){
+	double gate=0;
+	long long n=0,k=0,lo=-1,hi=-1;
+	int i=0,start=0;
+
+	//Integrated: absolute gate -70 LUFS, then relative gate -10 LU
+	gate=loudness_lufs(loudness_gated_mean(m->m_count,m->m_energy,LOUDNESS_HIST_MIN))-10.0;
+	r->integrated=loudness_lufs(loudness_gated_mean(m->m_count,m->m_energy,gate));
+
+	//Loudness range: short-term values above relative gate -20 LU, 10% to 95%
+	gate=loudness_lufs(loudness_gated_mean(m->s_count,m->s_energy,LOUDNESS_HIST_MIN))-20.0;
+	start=(int)ceil((gate-LOUDNESS_HIST_MIN)/LOUDNESS_HIST_STEP-0.5);
+	if(start<0)
+		start=0;
+	for(i=start;i<LOUDNESS_HIST_BINS;i++)
+		n+=m->s_count[i];
+	for(i=start;i<LOUDNESS_HIST_BINS&&n>0;i++){
+		k+=m->s_count[i];
+		if(lo<0&&k>n*0.10)
+			lo=i;
+		if(hi<0&&k>=n*0.95)
+			hi=i;
+	}
+	r->range=(lo>=0&&hi>=0)?(hi-lo)*LOUDNESS_HIST_STEP:0;
+
+	r->max_momentary=m->max_momentary;
+	r->max_shortterm=m->max_shortterm;
+	r->true_peak=m->true_peak>0?20*log10(m->true_peak):-HUGE_VAL;
+}
+
+static int loudness_measure(const char *url,const char *fmt,int channels,int sample_rate,LOUDNESS_RESULT *r){
+	const PCM_FORMAT *in=pcm_find_format(fmt);
+	LOUDNESS_METER *m=NULL;
+	unsigned char *buf_in=NULL;
+	float *buf_float=NULL;
+	long long remain=-1;
+	FILE *fp=NULL;
+	int frames=0;
+
+	memset(r,0,sizeof(LOUDNESS_RESULT));
+	r->sample_rate=sample_rate;
+	if(in==NULL||channels<1||channels>PCM_MAX_CHANNELS||sample_rate<10)
+		return -1;
+	if((fp=pcm_open_input(url,&remain))==NULL)
+		return -1;
+
+	m=(LOUDNESS_METER *)malloc(sizeof(LOUDNESS_METER));
+	loudness_init(m,channels,sample_rate);
+	buf_in=(unsigned char *)malloc(PCM_BLOCK_FRAMES*channels*in->bytes);
+	buf_float=(float *)malloc(PCM_BLOCK_FRAMES*channels*sizeof(float));
+
+	while((frames=pcm_read(buf_in,channels*in->bytes,PCM_BLOCK_FRAMES,fp,&remain))>0){
+		pcm_decode_float(in,buf_in,buf_float,frames*channels);
+		loudness_process(m,buf_float,frames);
+		r->frames+=frames;
+	}
+	loudness_result(m,r);
+
+	free(buf_in);
+	free(buf_float);
+	free(m);
+	fclose(fp);
+	return 0;
+}
+
+static void loudness_print(const char *url,const LOUDNESS_RESULT *r){
+	printf("============ Loudness: %s ============\n",url);
+	printf("Duration:        %.3f s\n",(double)r->frames/r->sample_rate);
+	printf("Integrated:      %.1f LUFS\n",r->integrated);
+	printf("Loudness Range:  %.1f LU\n",r->range);
+	printf("Max Momentary:   %.1f LUFS\n",r->max_momentary);
+	printf("Max Short-term:  %.1f LUFS\n",r->max_shortterm);
+	printf("True Peak:       %.1f dBTP\n",r->true_peak);
+}
+
+/**
+ * Measure loudness of PCM file (EBU R128 / ITU-R BS.1770).
+ * @param url          Location of PCM (or WAVE) file.
+ * @param fmt          Sample format of PCM file, such as s16le or f32le.
+ * @param channels     Channel number of PCM file (L, R, C, LFE, Ls, Rs order).
+ * @param sample_rate  Sample rate of PCM file.
+ */
+int simplest_pcm_loudness(const char *url,const char *fmt,int channels,int sample_rate){
+	LOUDNESS_RESULT r;
+	if(loudness_measure(url,fmt,channels,sample_rate,&r)<0){
+		printf("Error: Cannot measure %s.\n",url);
+		return -1;
+	}
+	loudness_print(url,&r);
+	return 0;
+}
+
+/**
+ * Measure loudness of several PCM files in parallel.
+ * @param url          Location of PCM (or WAVE) files.
+ * @param num          Number of files.
+ * @param fmt          Sample format of PCM files, such as s16le or f32le.
+ * @param channels     Channel number of PCM files.
+ * @param sample_rate  Sample rate of PCM files.
+ */
+int simplest_pcm_loudness_batch(const char **url,int num,const char *fmt,int channels,int sample_rate){
+	LOUDNESS_RESULT *r=(LOUDNESS_RESULT *)malloc(num*sizeof(LOUDNESS_RESULT));
+	int *ret=(int *)malloc(num*sizeof(int));
+	int i=0;
+
+#pragma omp parallel for schedule(dynamic)
+	for(i=0;i<num;i++)
+		ret[i]=loudness_measure(url[i],fmt,channels,sample_rate,&r[i]);
+
+	for(i=0;i<num;i++){
+		if(ret[i]<0)
+			printf("Error: Cannot measure %s.\n",url[i]);
+		else
+			loudness_print(url[i],&r[i]);
+	}
+	free(r);
+	free(ret);
+	return 0;
+}
+
+#define MIX_GAIN_SHIFT 12
+
+//acc[i]+=(x[i]*gain)>>MIX_GAIN_SHIFT, identical channel layout of input and output
+static void mix_accumulate(int *acc,const short *x,int num,int gain){
+	int i=0;
+#ifdef PCM_USE_SSE2
+	const __m128i g=_mm_set1_epi16((short)gain);
+	for(;i+8<=num;i+=8){
+		__m128i v=_mm_loadu_si128((const __m128i *)(x+i));
+		__m128i lo=_mm_mullo_epi16(v,g);
+		__m128i hi=_mm_mulhi_epi16(v,g);
+		__m128i p0=_mm_srai_epi32(_mm_unpacklo_epi16(lo,hi),MIX_GAIN_SHIFT);
+		__m128i p1=_mm_srai_epi32(_mm_unpackhi_epi16(lo,hi),MIX_GAIN_SHIFT);
+		_mm_storeu_si128((__m128i *)(acc+i),_mm_add_epi32(_mm_loadu_si128((const __m128i *)(acc+i)),p0));
+		_mm_storeu_si128((__m128i *)(acc+i+4),_mm_add_epi32(_mm_loadu_si128((const __m128i *)(acc+i+4)),p1));
+	}
+#endif
+	for(;i<num;i++)
+		acc[i]+=(x[i]*gain)>>MIX_GAIN_SHIFT;
+}
+
+//32bit accumulator -> 16bit samples with saturation
+static void mix_writeback(const int *acc,short *y,int num){
+	int i=0;
+#ifdef PCM_USE_SSE2
+	for(;i+8<=num;i+=8){
+		__m128i a=_mm_loadu_si128((const __m128i *)(acc+i));
+		__m128i b=_mm_loadu_si128((const __m128i *)(acc+i+4));
+		_mm_storeu_si128((__m128i *)(y+i),_mm_packs_epi32(a,b));
+	}
+#endif
+	for(;i<num;i++)
+		y[i]=acc[i]>32767?32767:(acc[i]<-32768?-32768:acc[i]);
+}
+
+/**
+ * Mix several 16LE PCM files into one.
+ * @param url_in        Location of Input PCM (or WAVE) files.
+ * @param num           Number of Input files.
+ * @param in_channels   Channel number of each Input file.
+ * @param gain          Gain of each Input file, 1.0 keeps the level (max 7.9).
+ * @param offset        Start of each Input file in Output, in frames.
+ * @param channel_map   Output channel of each channel of each Input file,
+ *                      PCM_MAX_CHANNELS(8) entries per file, -1 drops the channel.
+ *                      NULL maps channel c to channel c.
+ * @param out_channels  Channel number of Output PCM file.
+ * @param url_out       Location of Output PCM file.
+ */
+int simplest_pcm16le_mix(const char **url_in,int num,const int *in_channels,const float *gain,const int *offset,
+						 const int *channel_map,int out_channels,const char *url_out){
+	FILE **fp_in=NULL;
+	FILE *fp=NULL;
+	long long *remain=NULL;
+	int *finished=NULL;
+	short *buf_in=NULL,*buf_out=NULL;
+	int *acc=NULL;
+	long long pos=0;
+	int i=0,c=0,ret=0,active=0;
+
+	if(out_channels<1||out_channels>PCM_MAX_CHANNELS){
+		printf("Error: Unsupported PCM layout.\n");
+		return -1;
+	}
+	if((fp=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot create output PCM file.\n");
+		return -1;
+	}
+	fp_in=(FILE **)calloc(num,sizeof(FILE *));
+	remain=(long long *)calloc(num,sizeof(long long));
+	finished=(int *)calloc(num,sizeof(int));
+	for(i=0;i<num;i++){
+		if(in_channels[i]<1||in_channels[i]>PCM_MAX_CHANNELS||(fp_in[i]=pcm_open_input(url_in[i],&remain[i]))==NULL){
+			printf("Error: Cannot open input PCM file %s.\n",url_in[i]);
+			ret=-1;
+			goto end;
+		}
+	}
+	buf_in=(short *)malloc(PCM_BLOCK_FRAMES*PCM_MAX_CHANNELS*sizeof(short));
+	buf_out=(short *)malloc(PCM_BLOCK_FRAMES*out_channels*sizeof(short));
+	acc=(int *)malloc(PCM_BLOCK_FRAMES*out_channels*sizeof(int));
+
+	active=num;
+	while(active>0){
+		int used=0;
+		memset(acc,0,PCM_BLOCK_FRAMES*out_channels*sizeof(int));
+
+		//Every input contributes to the same block of output
+		for(i=0;i<num;i++){
+			int start=0,frames=0,n=0,k=0;
+			int g=(int)(gain[i]*(1<<MIX_GAIN_SHIFT)+0.5);
+			const int *map=channel_map?channel_map+i*PCM_MAX_CHANNELS:NULL;
+			int identity=(in_channels[i]==out_channels);
+
+			if(finished[i]||pos+PCM_BLOCK_FRAMES<=offset[i])
+				continue;
+			start=offset[i]>pos?(int)(offset[i]-pos):0;
+			frames=PCM_BLOCK_FRAMES-start;
+			n=pcm_read(buf_in,in_channels[i]*2,frames,fp_in[i],&remain[i]);
+			if(n<frames){
+				finished[i]=1;
+				active--;
+			}
+			if(start+n>used)
+				used=start+n;
+			if(g>32767)
+				g=32767;
+
+			for(c=0;map&&c<in_channels[i];c++){
+				if(map[c]!=c)
+					identity=0;
+			}
+			if(identity){
+				mix_accumulate(acc+start*out_channels,buf_in,n*out_channels,g);
+				continue;
+			}
+			for(k=0;k<n;k++){
+				for(c=0;c<in_channels[i];c++){
+					int dst=map?map[c]:c;
+					if(dst<0||dst>=out_channels)
+						continue;
+					acc[(start+k)*out_channels+dst]+=(buf_in[k*in_channels[i]+c]*g)>>MIX_GAIN_SHIFT;
+				}
+			}
+		}
+		//Inputs which start later keep the whole block alive
+		if(active>0)
+			used=PCM_BLOCK_FRAMES;
+		mix_writeback(acc,buf_out,used*out_channels);
+		fwrite(buf_out,out_channels*sizeof(short),used,fp);
+		pos+=PCM_BLOCK_FRAMES;
+	}
+	printf("Mix Cnt:%lld\n",(simplest_ftell64(fp))/(out_channels*2));
+
+end:
+	for(i=0;i<num;i++){
+		if(fp_in[i])
+			fclose(fp_in[i]);
+	}
+	free(fp_in);
+	free(remain);
+	free(finished);
+	free(buf_in);
+	free(buf_out);
+	free(acc);
+	fclose(fp);
+	return ret;
+}
+
+#define PEAK_MAX_LEVELS 8
+#define PEAK_FLUSH_BINS 1024
+
+/*
+ * Peak file: PEAK_HEADER, one PEAK_LEVEL per level, then the bins of each level.
+ * A bin holds one PEAK_BIN per channel. All fields are little endian and
+ * every section starts on an 8 byte boundary, so the file can be mapped directly.
+ */
+#pragma pack(push,1)
+typedef struct PEAK_HEADER{
+	char tag[4];                  //"PEAK"
+	unsigned short version;       //1
+	unsigned short channels;
+	unsigned int sample_rate;
+	unsigned int levels;
+	unsigned long long frames;
+}PEAK_HEADER;
+
+typedef struct PEAK_LEVEL{
+	unsigned int samples_per_bin;
+	unsigned int reserved;
+	unsigned long long bins;
+	unsigned long long offset;    //position of first bin
+}PEAK_LEVEL;
+
+typedef struct PEAK_BIN{
+	short min;
+	short max;
+	unsigned short rms;
+}PEAK_BIN;
+#pragma pack(pop)
+
+typedef struct PEAK_ACC{
+	int min[PCM_MAX_CHANNELS];
+	int max[PCM_MAX_CHANNELS];
+	double sumsq[PCM_MAX_CHANNELS];
+	int count;                    //frames
+	PEAK_BIN *pending;            //bins not yet written
+	int pending_num;
+	unsigned long long written;
+}PEAK_ACC;
+
+static void peak_acc_reset(PEAK_ACC *a,int channels){
+	int c=0;
+	for(c=0;c<channels;c++){
+		a->min[c]=32767;
+		a->max[c]=-32768;
+		a->sumsq[c]=0;
+	}
+	a->count=0;
+}
+
+static void peak_acc_flush(FILE *fp,const PEAK_LEVEL *level,PEAK_ACC *a,int channels){
+	if(a->pending_num==0)
+		return;
+	simplest_fseek64(fp,level->offset+a->written*channels*sizeof(PEAK_BIN),SEEK_SET);
+	fwrite(a->pending,sizeof(PEAK_BIN)*channels,a->pending_num,fp);
+	a->written+=a->pending_num;
+	a->pending_num=0;
+}
+
+//Close the current bin of level l and feed it to level l+1
+static void peak_acc_emit(FILE *fp,const PEAK_LEVEL *level,PEAK_ACC *acc,int l,int levels,int channels){
+	PEAK_ACC *a=&acc[l];
+	PEAK_BIN *bin=a->pending+a->pending_num*channels;
+	int c=0;
+
+	for(c=0;c<channels;c++){
+		double rms=sqrt(a->sumsq[c]/a->count);
+		bin[c].min=a->min[c];
+		bin[c].max=a->max[c];
+		bin[c].rms=(unsigned short)(rms>65535?65535:rms+0.5);
+		if(l+1<levels){
+			PEAK_ACC *up=&acc[l+1];
+			if(a->min[c]<up->min[c])
+				up->min[c]=a->min[c];
+			if(a->max[c]>up->max[c])
+				up->max[c]=a->max[c];
+			up->sumsq[c]+=a->sumsq[c];
+		}
+	}
+	if(l+1<levels){
+		acc[l+1].count+=a->count;
+		if(acc[l+1].count==(int)level[l+1].samples_per_bin)
+			peak_acc_emit(fp,level,acc,l+1,levels,channels);
+	}
+	if(++a->pending_num==PEAK_FLUSH_BINS)
+		peak_acc_flush(fp,&level[l],a,channels);
+	peak_acc_reset(a,channels);
+}
+
+//Min/Max/Sum of squares of 'frames' interleaved frames
+static void peak_scan(const short *x,int frames,int channels,int *vmin,int *vmax,double *sumsq){
+	int c=0,i=0,num=frames*channels;
+	long long sq[PCM_MAX_CHANNELS]={0};
+#ifdef PCM_USE_SSE2
+	if(8%channels==0&&num>=8){
+		//Lane k of a register always holds channel k%channels
+		short lmin[8],lmax[8];
+		__m128i mn=_mm_set1_epi16(32767),mx=_mm_set1_epi16(-32768);
+		for(i=0;i+8<=num;i+=8){
+			__m128i v=_mm_loadu_si128((const __m128i *)(x+i));
+			mn=_mm_min_epi16(mn,v);
+			mx=_mm_max_epi16(mx,v);
+		}
+		_mm_storeu_si128((__m128i *)lmin,mn);
+		_mm_storeu_si128((__m128i *)lmax,mx);
+		for(c=0;c<8;c++){
+			if(lmin[c]<vmin[c%channels])
+				vmin[c%channels]=lmin[c];
+			if(lmax[c]>vmax[c%channels])
+				vmax[c%channels]=lmax[c];
+		}
+		for(;i<num;i++){
+			c=i%channels;
+			if(x[i]<vmin[c])
+				vmin[c]=x[i];
+			if(x[i]>vmax[c])
+				vmax[c]=x[i];
+		}
+		for(i=0;i<num;i++)
+			sq[i%channels]+=x[i]*x[i];
+		for(c=0;c<channels;c++)
+			sumsq[c]+=(double)sq[c];
+		return;
+	}
+#endif
+	for(i=0;i<frames;i++){
+		for(c=0;c<channels;c++){
+			int s=x[i*channels+c];
+			if(s<vmin[c])
+				vmin[c]=s;
+			if(s>vmax[c])
+				vmax[c]=s;
+			sq[c]+=s*s;
+		}
+	}
+	for(c=0;c<channels;c++)
+		sumsq[c]+=(double)sq[c];
+}
+
+/**
+ * Generate multi-resolution peak file (min/max/rms) of 16LE PCM file.
+ * @param url              Location of PCM (or WAVE) file.
+ * @param channels         Channel number of PCM file.
+ * @param sample_rate      Sample rate of PCM file.
+ * @param samples_per_bin  Frames per bin of each level, such as {256,1024,4096}.
+ *                         Each one must be a multiple of the previous one.
+ * @param levels           Number of levels.
+ * @param url_out          Location of Output peak file.
+ */
+int simplest_pcm16le_peak(const char *url,int channels,int sample_rate,const int *samples_per_bin,int levels,const char *url_out){
+	PEAK_HEADER header;
+	PEAK_LEVEL level[PEAK_MAX_LEVELS];
+	PEAK_ACC acc[PEAK_MAX_LEVELS];
+	FILE *fp=NULL,*fp1=NULL;
+	short *buf=NULL;
+	long long remain=-1,frames_total=0,offset=0;
+	int l=0,frames=0;
+
+	if(channels<1||channels>PCM_MAX_CHANNELS||levels<1||levels>PEAK_MAX_LEVELS){
+		printf("Error: Unsupported peak layout.\n");
+		return -1;
+	}
+	for(l=0;l<levels;l++){
+		if(samples_per_bin[l]<1||(l>0&&samples_per_bin[l]%samples_per_bin[l-1]!=0)){
+			printf("Error: Bin size of level %d is not a multiple of level %d.\n",l,l-1);
+			return -1;
+		}
+	}
+	if((fp=pcm_open_input(url,&remain))==NULL){
+		printf("Error: Cannot open input PCM file.\n");
+		return -1;
+	}
+	if((fp1=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot create peak file.\n");
+		fclose(fp);
+		return -1;
+	}
+	//Size of every level is known up front, so all levels are written in one pass
+	if(remain<0){
+		long long start=simplest_ftell64(fp);
+		simplest_fseek64(fp,0,SEEK_END);
+		remain=simplest_ftell64(fp)-start;
+		simplest_fseek64(fp,start,SEEK_SET);
+	}
+	frames_total=remain/(channels*2);
+
+	memset(&header,0,sizeof(header));
+	memcpy(header.tag,"PEAK",4);
+	header.version=1;
+	header.channels=channels;
+	header.sample_rate=sample_rate;
+	header.levels=levels;
+	header.frames=frames_total;
+	offset=sizeof(PEAK_HEADER)+levels*sizeof(PEAK_LEVEL);
+	memset(level,0,sizeof(level));
+	memset(acc,0,sizeof(acc));
+	for(l=0;l<levels;l++){
+		level[l].samples_per_bin=samples_per_bin[l];
+		level[l].bins=(frames_total+samples_per_bin[l]-1)/samples_per_bin[l];
+		level[l].offset=offset;
+		offset+=level[l].bins*channels*sizeof(PEAK_BIN);
+		offset=(offset+7)&~7LL;
+		acc[l].pending=(PEAK_BIN *)malloc(PEAK_FLUSH_BINS*channels*sizeof(PEAK_BIN));
+		peak_acc_reset(&acc[l],channels);
+	}
+	fwrite(&header,sizeof(header),1,fp1);
+	fwrite(level,sizeof(PEAK_LEVEL),levels,fp1);
+
+	buf=(short *)malloc(PCM_BLOCK_FRAMES*channels*sizeof(short));
+	while((frames=pcm_read(buf,channels*2,PCM_BLOCK_FRAMES,fp,&remain))>0){
+		const short *x=buf;
+		while(frames>0){
+			int n=samples_per_bin[0]-acc[0].count;
+			if(n>frames)
+				n=frames;
+			peak_scan(x,n,channels,acc[0].min,acc[0].max,acc[0].sumsq);
+			acc[0].count+=n;
+			if(acc[0].count==samples_per_bin[0])
+				peak_acc_emit(fp1,level,acc,0,levels,channels);
+			x+=n*channels;
+			frames-=n;
+		}
+	}
+	//Partial bins at the end, each one also feeds the partial bin above it
+	for(l=0;l<levels;l++){
+		if(acc[l].count>0)
+			peak_acc_emit(fp1,level,acc,l,levels,channels);
+		peak_acc_flush(fp1,&level[l],&acc[l],channels);
+	}
+	printf("Peak Levels:%d Frames:%lld\n",levels,frames_total);
+
+	for(l=0;l<levels;l++)
+		free(acc[l].pending);
+	free(buf);
+	fclose(fp);
+	fclose(fp1);
+	return 0;
+}
+
+/**
+ * Print bins of one level of peak file, the file is mapped and read in place.
+ * @param url        Location of peak file.
+ * @param level      Level to read.
+ * @param first_bin  First bin to print.
+ * @param num        Number of bins to print.
+ */
+int simplest_peak_dump(const char *url,int level,long long first_bin,int num){
+	long long size=0,i=0;
+	unsigned char *data=simplest_map_file(url,&size);
+	const PEAK_HEADER *header=(const PEAK_HEADER *)data;
+	const PEAK_LEVEL *lv=NULL;
+	const PEAK_BIN *bin=NULL;
+	int c=0;
+
+	if(data==NULL||size<(long long)sizeof(PEAK_HEADER)||memcmp(header->tag,"PEAK",4)!=0||header->version!=1
+		||level<0||level>=(int)header->levels
+		||size<(long long)(sizeof(PEAK_HEADER)+header->levels*sizeof(PEAK_LEVEL))){
+		printf("Error: Invalid peak file.\n");
+		simplest_unmap_file(data,size);
+		return -1;
+	}
+	lv=(const PEAK_LEVEL *)(data+sizeof(PEAK_HEADER))+level;
+	if(lv->offset+lv->bins*header->channels*sizeof(PEAK_BIN)>(unsigned long long)size){
+		printf("Error: Truncated peak file.\n");
+		simplest_unmap_file(data,size);
+		return -1;
+	}
+	bin=(const PEAK_BIN *)(data+lv->offset);
+
+	printf("-----+- Peak Level %d: %u frames/bin -+\n",level,lv->samples_per_bin);
+	printf("   BIN | CH |    MIN |    MAX |   RMS |\n");
+	printf("-------+----+--------+--------+-------+\n");
+	for(i=first_bin;i<first_bin+num&&i<(long long)lv->bins;i++){
+		for(c=0;c<header->channels;c++){
+			const PEAK_BIN *b=bin+i*header->channels+c;
+			printf("%6lld | %2d | %6d | %6d | %5d |\n",i,c,b->min,b->max,b->rms);
+		}
+	}
+	simplest_unmap_file(data,size);
+	return 0;
+}
+
+typedef struct SILENCE_WRITER{
+	FILE *fp;
+	int json;
+	int count;
+	int sample_rate;
+}SILENCE_WRITER;
+
+static void silence_emit(SILENCE_WRITER *w,int silent,long long start,long long end){
+	double s=(double)start/w->sample_rate,e=(double)end/w->sample_rate;
+	if(end<=start)
+		return;
+	if(w->json)
+		fprintf(w->fp,"%s  {\"type\": \"%s\", \"start\": %.3f, \"end\": %.3f, \"duration\": %.3f}",
+			w->count?",\n":"",silent?"silence":"sound",s,e,e-s);
+	else
+		fprintf(w->fp,"%s,%.3f,%.3f,%.3f\n",silent?"silence":"sound",s,e,e-s);
+	w->count++;
+}
+
+//Sum of squares of interleaved 16bit samples (all channels together)
+static double silence_energy(const short *x,int num){
+	long long sum=0;
+	int i=0;
+#ifdef PCM_USE_SSE2
+	__m128i acc=_mm_setzero_si128();
+	const __m128i zero=_mm_setzero_si128();
+	long long part[2];
+	for(;i+8<=num;i+=8){
+		__m128i v=_mm_loadu_si128((const __m128i *)(x+i));
+		//Each pair sum is at most 2^31, so it is taken as unsigned
+		__m128i m=_mm_madd_epi16(v,v);
+		acc=_mm_add_epi64(acc,_mm_unpacklo_epi32(m,zero));
+		acc=_mm_add_epi64(acc,_mm_unpackhi_epi32(m,zero));
+	}
+	_mm_storeu_si128((__m128i *)part,acc);
+	sum=part[0]+part[1];
+#endif
+	for(;i<num;i++)
+		sum+=x[i]*x[i];
+	return (double)sum;
+}
+
+static int silence_detect(const char *url,int channels,int sample_rate,int window_ms,float threshold_db,float hysteresis_db,
+						  int min_silence_ms,const char *url_out,long long *segments){
+	SILENCE_WRITER w;
+	FILE *fp=NULL;
+	short *buf=NULL;
+	long long remain=-1,pos=0,seg_start=0,run_start=-1;
+	long long min_silence=(long long)min_silence_ms*sample_rate/1000;
+	int window=sample_rate*window_ms/1000;
+	int silent_state=0,frames=0;
+	const char *ext=strrchr(url_out,'.');
+
+	*segments=0;
+	if(channels<1||window<1)
+		return -1;
+	if((fp=pcm_open_input(url,&remain))==NULL)
+		return -1;
+	memset(&w,0,sizeof(w));
+	if((w.fp=fopen(url_out,"wb"))==NULL){
+		fclose(fp);
+		return -1;
+	}
+	w.json=(ext!=NULL&&strcmp(ext,".json")==0);
+	w.sample_rate=sample_rate;
+	fprintf(w.fp,w.json?"[\n":"type,start,end,duration\n");
+
+	buf=(short *)malloc(window*channels*sizeof(short));
+	while((frames=pcm_read(buf,channels*2,window,fp,&remain))>0){
+		double rms=sqrt(silence_energy(buf,frames*channels)/(frames*channels));
+		double level=rms>0?20*log10(rms/32768.0):-200.0;
+		//Hysteresis: once silent, the level has to rise above threshold+hysteresis
+		int silent=silent_state?(level<=threshold_db+hysteresis_db):(level<threshold_db);
+
+		if(!silent_state){
+			if(silent){
+				if(run_start<0)
+					run_start=pos;
+				if(pos+frames-run_start>=min_silence){
+					silence_emit(&w,0,seg_start,run_start);
+					seg_start=run_start;
+					silent_state=1;
+				}
+			}else{
+				run_start=-1;
+			}
+		}else if(!silent){
+			silence_emit(&w,1,seg_start,pos);
+			seg_start=pos;
+			silent_state=0;
+			run_start=-1;
+		}
+		pos+=frames;
+	}
+	silence_emit(&w,silent_state,seg_start,pos);
+	if(w.json)
+		fprintf(w.fp,"\n]\n");
+	*segments=w.count;
+
+	free(buf);
+	fclose(w.fp);
+	fclose(fp);
+	return 0;
+}
+
+/**
+ * Detect silence and sound segments of 16LE PCM file.
+ * @param url             Location of PCM (or WAVE) file.
+ * @param channels        Channel number of PCM file.
+ * @param sample_rate     Sample rate of PCM file.
+ * @param window_ms       Length of analysis window in ms, such as 20.
+ * @param threshold_db    RMS level (dBFS) under which a window is silent, such as -45.
+ * @param hysteresis_db   Silence ends only when the level rises above threshold+hysteresis.
+ * @param min_silence_ms  Shorter silence stays inside the sound segment.
+ * @param url_out         Location of Output segment list, JSON if it ends with .json, else CSV.
+ */
+int simplest_pcm16le_silence(const char *url,int channels,int sample_rate,int window_ms,float threshold_db,float hysteresis_db,
+							 int min_silence_ms,const char *url_out){
+	long long segments=0;
+	if(silence_detect(url,channels,sample_rate,window_ms,threshold_db,hysteresis_db,min_silence_ms,url_out,&segments)<0){
+		printf("Error: Cannot detect silence of %s.\n",url);
+		return -1;
+	}
+	printf("Segment Cnt:%lld\n",segments);
+	return 0;
+}
+
+/**
+ * Detect silence and sound segments of several 16LE PCM files in parallel.
+ * @param url             Location of PCM (or WAVE) files.
+ * @param num             Number of files.
+ * @param url_out         Location of Output segment list of each file.
+ * Other parameters are the same as simplest_pcm16le_silence().
+ */
+int simplest_pcm16le_silence_batch(const char **url,int num,int channels,int sample_rate,int window_ms,float threshold_db,
+								   float hysteresis_db,int min_silence_ms,const char **url_out){
+	long long *segments=(long long *)malloc(num*sizeof(long long));
+	int *ret=(int *)malloc(num*sizeof(int));
+	int i=0;
+
+#pragma omp parallel for schedule(dynamic)
+	for(i=0;i<num;i++)
+		ret[i]=silence_detect(url[i],channels,sample_rate,window_ms,threshold_db,hysteresis_db,min_silence_ms,url_out[i],&segments[i]);
+
+	for(i=0;i<num;i++){
+		if(ret[i]<0)
+			printf("Error: Cannot detect silence of %s.\n",url[i]);
+		else
+			printf("%s: Segment Cnt:%lld\n",url[i],segments[i]);
+	}
+	free(segments);
+	free(ret);
+	return 0;
+}
+
+#define FFT_MAX_BITS 16
+#define SPEC_BLOCK_FRAMES 64
+
+typedef struct FFT_PLAN{
+	int size;              //Size of real transform
+	int half;              //Size of complex transform (size/2)
+	int bits;              //log2(half)
+	int *rev;              //Bit reversed index
+	float *tw_re,*tw_im;   //w, w^2, w^3 of every radix-4 stage
+	float *rt_re,*rt_im;   //exp(-2*pi*i*k/size), k=0..half
+}FFT_PLAN;
+
+static void fft_plan_free(FFT_PLAN *p){
+	free(p->rev);
+	free(p->tw_re);
+	free(p->tw_im);
+	free(p->rt_re);
+	free(p->rt_im);
+	memset(p,0,sizeof(FFT_PLAN));
+}
+
+static int fft_plan_init(FFT_PLAN *p,int size){
+	int i=0,j=0,m=0,L=0,pos=0,b=0;
+
+	memset(p,0,sizeof(FFT_PLAN));
+	while((1<<p->bits)<size)
+		p->bits++;
+	if(size<16||(1<<p->bits)!=size||p->bits>FFT_MAX_BITS)
+		return -1;
+	p->size=size;
+	p->half=size/2;
+	p->bits--;
+
+	p->rev=(int *)malloc(p->half*sizeof(int));
+	for(i=0;i<p->half;i++){
+		int r=0;
+		for(b=0;b<p->bits;b++)
+			if(i&(1<<b))
+				r|=1<<(p->bits-1-b);
+		p->rev[i]=r;
+	}
+
+	//Stage twiddles are stored as w[0..L), w^2[0..L), w^3[0..L), so that SIMD loads are contiguous
+	p->tw_re=(float *)malloc(p->half*sizeof(float));
+	p->tw_im=(float *)malloc(p->half*sizeof(float));
+	for(L=(p->bits&1)?2:1;L*4<=p->half;L*=4){
+		for(m=1;m<=3;m++){
+			for(j=0;j<L;j++){
+				double a=-2*M_PI*m*j/(4.0*L);
+				p->tw_re[pos]=(float)cos(a);
+				p->tw_im[pos]=(float)sin(a);
+				pos++;
+			}
+		}
+	}
+
+	p->rt_re=(float *)malloc((p->half+1)*sizeof(float));
+	p->rt_im=(float *)malloc((p->half+1)*sizeof(float));
+	for(i=0;i<=p->half;i++){
+		double a=-2*M_PI*i/size;
+		p->rt_re[i]=(float)cos(a);
+		p->rt_im[i]=(float)sin(a);
+	}
+	return 0;
+}
+
+/**
+ * In-place complex FFT of bit reversed input (split real/imaginary arrays).
+ * A radix-2 stage comes first when log2(half) is odd, the rest are radix-4.
+ */
+static void fft_complex(const FFT_PLAN *p,float *re,float *im){
+	int half=p->half,L=1,k=0,j=0,pos=0;
+
+	if(p->bits&1){
+		for(k=0;k<half;k+=2){
+			float ar=re[k],ai=im[k],br=re[k+1],bi=im[k+1];
+			re[k]=ar+br;
+			im[k]=ai+bi;
+			re[k+1]=ar-br;
+			im[k+1]=ai-bi;
+		}
+		L=2;
+	}
+
+	for(;L*4<=half;L*=4){
+		const float *w1r=p->tw_re+pos,*w1i=p->tw_im+pos;
+		const float *w2r=w1r+L,*w2i=w1i+L;
+		const float *w3r=w2r+L,*w3i=w2i+L;
+		for(k=0;k<half;k+=4*L){
+			float *r0=re+k,*r1=r0+L,*r2=r1+L,*r3=r2+L;
+			float *i0=im+k,*i1=i0+L,*i2=i1+L,*i3=i2+L;
+			j=0;
+#ifdef PCM_USE_SSE2
+			for(;j+4<=L;j+=4){
+				__m128 x0r=_mm_loadu_ps(r0+j),x0i=_mm_loadu_ps(i0+j);
+				__m128 x1r=_mm_loadu_ps(r1+j),x1i=_mm_loadu_ps(i1+j);
+				__m128 x2r=_mm_loadu_ps(r2+j),x2i=_mm_loadu_ps(i2+j);
+				__m128 x3r=_mm_loadu_ps(r3+j),x3i=_mm_loadu_ps(i3+j);
+				__m128 a=_mm_loadu_ps(w2r+j),b=_mm_loadu_ps(w2i+j);
+				__m128 t1r=_mm_sub_ps(_mm_mul_ps(a,x1r),_mm_mul_ps(b,x1i));
+				__m128 t1i=_mm_add_ps(_mm_mul_ps(a,x1i),_mm_mul_ps(b,x1r));
+				__m128 t2r,t2i,t3r,t3i,y0r,y0i,y1r,y1i,sr,si,dr,di;
+				a=_mm_loadu_ps(w1r+j);
+				b=_mm_loadu_ps(w1i+j);
+				t2r=_mm_sub_ps(_mm_mul_ps(a,x2r),_mm_mul_ps(b,x2i));
+				t2i=_mm_add_ps(_mm_mul_ps(a,x2i),_mm_mul_ps(b,x2r));
+				a=_mm_loadu_ps(w3r+j);
+				b=_mm_loadu_ps(w3i+j);
+				t3r=_mm_sub_ps(_mm_mul_ps(a,x3r),_mm_mul_ps(b,x3i));
+				t3i=_mm_add_ps(_mm_mul_ps(a,x3i),_mm_mul_ps(b,x3r));
+				y0r=_mm_add_ps(x0r,t1r);
+				y0i=_mm_add_ps(x0i,t1i);
+				y1r=_mm_sub_ps(x0r,t1r);
+				y1i=_mm_sub_ps(x0i,t1i);
+				sr=_mm_add_ps(t2r,t3r);
+				si=_mm_add_ps(t2i,t3i);
+				dr=_mm_sub_ps(t2r,t3r);
+				di=_mm_sub_ps(t2i,t3i);
+				_mm_storeu_ps(r0+j,_mm_add_ps(y0r,sr));
+				_mm_storeu_ps(i0+j,_mm_add_ps(y0i,si));
+				_mm_storeu_ps(r2+j,_mm_sub_ps(y0r,sr));
+				_mm_storeu_ps(i2+j,_mm_sub_ps(y0i,si));
+				_mm_storeu_ps(r1+j,_mm_add_ps(y1r,di));
+				_mm_storeu_ps(i1+j,_mm_sub_ps(y1i,dr));
+				_mm_storeu_ps(r3+j,_mm_sub_ps(y1r,di));
+				_mm_storeu_ps(i3+j,_mm_add_ps(y1i,dr));
+			}
+#endif
+			for(;j<L;j++){
+				float t1r=w2r[j]*r1[j]-w2i[j]*i1[j],t1i=w2r[j]*i1[j]+w2i[j]*r1[j];
+				float t2r=w1r[j]*r2[j]-w1i[j]*i2[j],t2i=w1r[j]*i2[j]+w1i[j]*r2[j];
+				float t3r=w3r[j]*r3[j]-w3i[j]*i3[j],t3i=w3r[j]*i3[j]+w3i[j]*r3[j];
+				float y0r=r0[j]+t1r,y0i=i0[j]+t1i,y1r=r0[j]-t1r,y1i=i0[j]-t1i;
+				float sr=t2r+t3r,si=t2i+t3i,dr=t2r-t3r,di=t2i-t3i;
+				r0[j]=y0r+sr;
+				i0[j]=y0i+si;
+				r2[j]=y0r-sr;
+				i2[j]=y0i-si;
+				//-i*d for the second output, +i*d for the fourth
+				r1[j]=y1r+di;
+				i1[j]=y1i-dr;
+				r3[j]=y1r-di;
+				i3[j]=y1i+dr;
+			}
+		}
+		pos+=3*L;
+	}
+}
+
+/**
+ * Power spectrum of one windowed real frame.
+ * @param in     size samples.
+ * @param win    size window coefficients.
+ * @param re,im  half floats of scratch each.
+ * @param power  Output half+1 bins.
+ */
+static void fft_real_power(const FFT_PLAN *p,const float *in,const float *win,float *re,float *im,float *power){
+	int half=p->half,k=0;
+
+	//Pack even/odd samples as real/imaginary part of a half size complex FFT
+	for(k=0;k<half;k++){
+		re[p->rev[k]]=in[2*k]*win[2*k];
+		im[p->rev[k]]=in[2*k+1]*win[2*k+1];
+	}
+	fft_complex(p,re,im);
+
+	for(k=0;k<=half;k++){
+		int a=k%half,b=(half-k)%half;
+		float zr=re[a],zi=im[a],cr=re[b],ci=-im[b];
+		float er=0.5f*(zr+cr),ei=0.5f*(zi+ci);
+		//(Z[k]-conj(Z[half-k]))/2i
+		float or_=0.5f*(zi-ci),oi=-0.5f*(zr-cr);
+		float xr=er+p->rt_re[k]*or_-p->rt_im[k]*oi;
+		float xi=ei+p->rt_re[k]*oi+p->rt_im[k]*or_;
+		power[k]=xr*xr+xi*xi;
+	}
+}
+
+static int spec_window(const char *name,float *win,int size){
+	int i=0;
+	for(i=0;i<size;i++){
+		double a=2*M_PI*i/size;
+		if(strcmp(name,"hann")==0)
+			win[i]=(float)(0.5-0.5*cos(a));
+		else if(strcmp(name,"hamming")==0)
+			win[i]=(float)(0.54-0.46*cos(a));
+		else if(strcmp(name,"blackman")==0)
+			win[i]=(float)(0.42-0.5*cos(a)+0.08*cos(2*a));
+		else if(strcmp(name,"rect")==0)
+			win[i]=1.0f;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Compute STFT spectrogram of 16LE PCM file.
+ * Channels are averaged. Every frame is saved as fft_size/2+1 float values of
+ * log-magnitude in dB (0dB is a full scale sine), from DC to Nyquist.
+ * @param url          Location of PCM (or WAVE) file.
+ * @param channels     Channel number of PCM file.
+ * @param sample_rate  Sample rate of PCM file.
+ * @param fft_size     FFT size, power of 2 from 16 to 65536.
+ * @param hop          Distance between frames in samples.
+ * @param window       Window function: "hann", "hamming", "blackman" or "rect".
+ * @param floor_db     Lower limit of output values, such as -120.
+ * @param url_out      Location of Output float file.
+ */
+int simplest_pcm16le_spectrogram(const char *url,int channels,int sample_rate,int fft_size,int hop,const char *window,
+								 float floor_db,const char *url_out){
+	FFT_PLAN plan;
+	FILE *fp=NULL,*fp_out=NULL;
+	short *pcm=NULL;
+	float *win=NULL,*samples=NULL,*scratch=NULL,*out=NULL;
+	double *average=NULL;
+	double gain=0,offset=0;
+	long long remain=-1,frames=0;
+	int bins=fft_size/2+1,block_len=0,have=0,got=0,nf=0,i=0,j=0,peak=1;
+
+	if(channels<1||hop<1||fft_plan_init(&plan,fft_size)<0){
+		printf("Error: Unsupported FFT size or hop.\n");
+		return -1;
+	}
+	win=(float *)malloc(fft_size*sizeof(float));
+	if(spec_window(window,win,fft_size)<0){
+		printf("Error: Unknown window %s.\n",window);
+		free(win);
+		fft_plan_free(&plan);
+		return -1;
+	}
+	if((fp=pcm_open_input(url,&remain))==NULL){
+		free(win);
+		fft_plan_free(&plan);
+		return -1;
+	}
+	if((fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot open output file.\n");
+		free(win);
+		fft_plan_free(&plan);
+		fclose(fp);
+		return -1;
+	}
+
+	//Scale so that a full scale sine gives 0dB
+	for(i=0;i<fft_size;i++)
+		gain+=win[i];
+	offset=20*log10(2.0/(gain*32768.0));
+
+	block_len=(SPEC_BLOCK_FRAMES-1)*hop+fft_size;
+	pcm=(short *)malloc(block_len*channels*sizeof(short));
+	samples=(float *)malloc(block_len*sizeof(float));
+	scratch=(float *)malloc(SPEC_BLOCK_FRAMES*fft_size*sizeof(float));
+	out=(float *)malloc(SPEC_BLOCK_FRAMES*bins*sizeof(float));
+	average=(double *)calloc(bins,sizeof(double));
+
+	for(;;){
+		got=pcm_read(pcm,channels*2,block_len-have,fp,&remain);
+		for(i=0;i<got;i++){
+			int sum=0;
+			for(j=0;j<channels;j++)
+				sum+=pcm[i*channels+j];
+			samples[have+i]=(float)sum/channels;
+		}
+		have+=got;
+		if(have<fft_size)
+			break;
+		nf=(have-fft_size)/hop+1;
+
+		//Frames of one block are independent
+#pragma omp parallel for schedule(static)
+		for(i=0;i<nf;i++){
+			float *re=scratch+i*fft_size;
+			fft_real_power(&plan,samples+i*hop,win,re,re+fft_size/2,out+i*bins);
+		}
+#pragma omp parallel for schedule(static)
+		for(j=0;j<bins;j++){
+			int f=0;
+			for(f=0;f<nf;f++){
+				float *v=out+f*bins+j;
+				double db=*v>0?10*log10(*v)+offset:floor_db;
+				average[j]+=*v;
+				*v=(float)(db<floor_db?floor_db:db);
+			}
+		}
+		fwrite(out,bins*sizeof(float),nf,fp_out);
+		frames+=nf;
+
+		memmove(samples,samples+nf*hop,(have-nf*hop)*sizeof(float));
+		have-=nf*hop;
+		if(got==0)
+			break;
+	}
+
+	for(j=1;j<bins;j++)
+		if(average[j]>average[peak])
+			peak=j;
+	printf("Frames:%lld Bins:%d Peak Freq:%.1fHz\n",frames,bins,(double)peak*sample_rate/fft_size);
+
+	free(pcm);
+	free(samples);
+	free(scratch);
+	free(out);
+	free(average);
+	free(win);
+	fft_plan_free(&plan);
+	fclose(fp);
+	fclose(fp_out);
+	return 0;
+}
+
+/**
+ * Convert spectrogram from simplest_pcm16le_spectrogram() to grayscale BMP file.
+ * Time goes from left to right, frequency from bottom to top.
+ * @param url       Location of spectrogram float file.
+ * @param fft_size  FFT size used to compute the spectrogram.
+ * @param floor_db  Value shown as black (0dB is white).
+ * @param bmppath   Location of Output BMP file.
+ */
+int simplest_spectrogram_to_bmp(const char *url,int fft_size,float floor_db,const char *bmppath){
+	long long size=0;
+	unsigned char *data=NULL,*rgb=NULL;
+	const float *db=NULL;
+	char rgbpath[1024];
+	int bins=fft_size/2+1,width=0,x=0,y=0;
+	FILE *fp=NULL;
+
+	if(floor_db>=0||strlen(bmppath)+5>sizeof(rgbpath))
+		return -1;
+	if((data=simplest_map_file(url,&size))==NULL){
+		printf("Error: Cannot open spectrogram file.\n");
+		return -1;
+	}
+	db=(const float *)data;
+	//RGB24 rows of simplest_rgb24_to_bmp() are not padded
+	width=(int)(size/((long long)bins*sizeof(float)))&~3;
+	if(width==0){
+		simplest_unmap_file(data,size);
+		return -1;
+	}
+
+	rgb=(unsigned char *)malloc(width*bins*3);
+	for(y=0;y<bins;y++){
+		const float *col=db+(bins-1-y);
+		unsigned char *row=rgb+y*width*3;
+		for(x=0;x<width;x++){
+			float v=(col[x*bins]-floor_db)*255.0f/(-floor_db);
+			unsigned char g=(unsigned char)(v<0?0:(v>255?255:v));
+			row[x*3+0]=row[x*3+1]=row[x*3+2]=g;
+		}
+	}
+	simplest_unmap_file(data,size);
+
+	sprintf(rgbpath,"%s.rgb",bmppath);
+	if((fp=fopen(rgbpath,"wb"))==NULL){
+		free(rgb);
+		return -1;
+	}
+	fwrite(rgb,1,width*bins*3,fp);
+	fclose(fp);
+	free(rgb);
+
+	simplest_rgb24_to_bmp(rgbpath,width,bins,bmppath);
+	remove(rgbpath);
+	return 0;
+}
+
+#define G711_BLOCK 16384
+
+static short g711_alaw_table[256];
+static short g711_ulaw_table[256];
+static unsigned char g711_bitlen[128];
+static volatile int g711_ready=0;
+
+static void g711_init(void){
+	int i=0;
+	if(g711_ready)
+		return;
+	for(i=0;i<256;i++){
+		int a=i^0x55,u=~i&0xFF;
+		int seg=(a&0x70)>>4,t=(a&0x0F)<<4;
+		t=seg==0?t+8:(t+0x108)<<(seg-1);
+		g711_alaw_table[i]=(short)((a&0x80)?t:-t);
+
+		t=(((u&0x0F)<<3)+0x84)<<((u&0x70)>>4);
+		g711_ulaw_table[i]=(short)((u&0x80)?0x84-t:t-0x84);
+	}
+	for(i=0;i<128;i++){
+		int n=0;
+		while((i>>n)!=0)
+			n++;
+		g711_bitlen[i]=(unsigned char)n;
+	}
+	g711_ready=1;
+}
+
+#ifdef PCM_USE_SSE2
+//2^e for 16bit lanes with e in 0..7
+static __m128i g711_pow2(__m128i e){
+	const __m128i one=_mm_set1_epi16(1);
+	__m128i p=_mm_add_epi16(one,_mm_and_si128(e,one));
+	p=_mm_mullo_epi16(p,_mm_add_epi16(one,_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(e,1),one),_mm_set1_epi16(3))));
+	p=_mm_mullo_epi16(p,_mm_add_epi16(one,_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(e,2),one),_mm_set1_epi16(15))));
+	return p;
+}
+#endif
+
+/**
+ * Decode G.711 samples to 16bit PCM.
+ * @param in    G.711 samples.
+ * @param out   Output 16bit samples.
+ * @param num   Number of samples.
+ * @param ulaw  0 for A-law, 1 for mu-law.
+ */
+void simplest_g711_decode(const unsigned char *in,short *out,int num,int ulaw){
+	const short *table=ulaw?g711_ulaw_table:g711_alaw_table;
+	int i=0;
+
+	g711_init();
+#ifdef PCM_USE_SSE2
+	//SSE2 has no byte shuffle or gather, so the table is evaluated arithmetically
+	{
+		const __m128i zero=_mm_setzero_si128();
+		const __m128i m0f=_mm_set1_epi16(0x0F),m07=_mm_set1_epi16(0x07),m80=_mm_set1_epi16(0x80);
+		for(;i+8<=num;i+=8){
+			__m128i x=_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(in+i)),zero);
+			__m128i v,t,e,neg;
+			if(ulaw){
+				v=_mm_xor_si128(x,_mm_set1_epi16(0xFF));
+				e=_mm_and_si128(_mm_srli_epi16(v,4),m07);
+				t=_mm_add_epi16(_mm_slli_epi16(_mm_and_si128(v,m0f),3),_mm_set1_epi16(0x84));
+				t=_mm_sub_epi16(_mm_mullo_epi16(t,g711_pow2(e)),_mm_set1_epi16(0x84));
+				//Sign bit set means negative
+				neg=_mm_cmpeq_epi16(_mm_and_si128(v,m80),m80);
+			}else{
+				v=_mm_xor_si128(x,_mm_set1_epi16(0x55));
+				e=_mm_and_si128(_mm_srli_epi16(v,4),m07);
+				t=_mm_add_epi16(_mm_slli_epi16(_mm_and_si128(v,m0f),4),_mm_set1_epi16(8));
+				t=_mm_add_epi16(t,_mm_and_si128(_mm_cmpgt_epi16(e,zero),_mm_set1_epi16(0x100)));
+				t=_mm_mullo_epi16(t,g711_pow2(_mm_subs_epu16(e,_mm_set1_epi16(1))));
+				//Sign bit clear means negative
+				neg=_mm_cmpeq_epi16(_mm_and_si128(v,m80),zero);
+			}
+			t=_mm_sub_epi16(_mm_xor_si128(t,neg),neg);
+			_mm_storeu_si128((__m128i *)(out+i),t);
+		}
+	}
+#endif
+	for(;i<num;i++)
+		out[i]=table[in[i]];
+}
+
+/**
+ * Encode 16bit PCM samples to G.711. The encoder has no data dependent branch,
+ * the segment is taken from a 128 entry bit length table.
+ * @param in    16bit samples.
+ * @param out   Output G.711 samples.
+ * @param num   Number of samples.
+ * @param ulaw  0 for A-law, 1 for mu-law.
+ */
+void simplest_g711_encode(const short *in,unsigned char *out,int num,int ulaw){
+	int i=0;
+
+	g711_init();
+	if(ulaw){
+		for(i=0;i<num;i++){
+			int m=in[i]>>15;
+			int mag=((in[i]>>2)^m)-m;
+			int seg=0;
+			mag+=0x21;
+			mag=mag>0x1FFF?0x1FFF:mag;
+			seg=g711_bitlen[mag>>6];
+			out[i]=(unsigned char)(((seg<<4)|((mag>>(seg+1))&0x0F))^(0xFF^(m&0x80)));
+		}
+	}else{
+		for(i=0;i<num;i++){
+			int m=in[i]>>15;
+			//-x-1 for negative input, same as Sun reference
+			int mag=(in[i]^m)>>3;
+			int seg=g711_bitlen[mag>>5];
+			int shift=seg+(seg==0);
+			out[i]=(unsigned char)(((seg<<4)|((mag>>shift)&0x0F))^(0xD5^(m&0x80)));
+		}
+	}
+}
+
+/**
+ * Encode 16LE PCM file to G.711 A-law or mu-law.
+ * @param url      Location of PCM (or WAVE) file.
+ * @param ulaw     0 for A-law, 1 for mu-law.
+ * @param url_out  Location of Output G.711 file.
+ */
+int simplest_pcm16le_to_g711(const char *url,int ulaw,const char *url_out){
+	FILE *fp=NULL,*fp_out=NULL;
+	short *pcm=NULL;
+	unsigned char *code=NULL;
+	long long remain=-1,samples=0;
+	int n=0;
+
+	if((fp=pcm_open_input(url,&remain))==NULL){
+		printf("Error: Cannot open input PCM file.\n");
+		return -1;
+	}
+	if((fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot open output file.\n");
+		fclose(fp);
+		return -1;
+	}
+	pcm=(short *)malloc(G711_BLOCK*sizeof(short));
+	code=(unsigned char *)malloc(G711_BLOCK);
+	while((n=pcm_read(pcm,2,G711_BLOCK,fp,&remain))>0){
+		simplest_g711_encode(pcm,code,n,ulaw);
+		fwrite(code,1,n,fp_out);
+		samples+=n;
+	}
+	printf("%s Samples:%lld\n",ulaw?"mu-law":"A-law",samples);
+
+	free(pcm);
+	free(code);
+	fclose(fp);
+	fclose(fp_out);
+	return 0;
+}
+
+/**
+ * Decode G.711 A-law or mu-law file to 16LE PCM.
+ * @param url      Location of G.711 file.
+ * @param ulaw     0 for A-law, 1 for mu-law.
+ * @param url_out  Location of Output PCM file.
+ */
+int simplest_g711_to_pcm16le(const char *url,int ulaw,const char *url_out){
+	FILE *fp=NULL,*fp_out=NULL;
+	short *pcm=NULL;
+	unsigned char *code=NULL;
+	long long samples=0;
+	int n=0;
+
+	if((fp=fopen(url,"rb"))==NULL){
+		printf("Error: Cannot open input G.711 file.\n");
+		return -1;
+	}
+	if((fp_out=fopen(url_out,"wb"))==NULL){
+		printf("Error: Cannot open output file.\n");
+		fclose(fp);
+		return -1;
+	}
+	pcm=(short *)malloc(G711_BLOCK*sizeof(short));
+	code=(unsigned char *)malloc(G711_BLOCK);
+	while((n=(int)fread(code,1,G711_BLOCK,fp))>0){
+		simplest_g711_decode(code,pcm,n,ulaw);
+		fwrite(pcm,2,n,fp_out);
+		samples+=n;
+	}
+	printf("%s Samples:%lld\n",ulaw?"mu-law":"A-law",samples);
+
+	free(pcm);
+	free(code);
+	fclose(fp);
+	fclose(fp_out);
+	return 0;
+}
 